@@ -31,19 +31,16 @@
 #include <byteorder.h>
 
 
-#ifndef __WORDSIZE
-#define __WORDSIZE (__SIZEOF_LONG__ * 8)
-#endif
-
-#ifndef BITS_PER_LONG
-#define BITS_PER_LONG __WORDSIZE
-#endif
+#define BITS_PER_WORD		32
+#define BIT_WORD(nr)		((nr) / BITS_PER_WORD)
+#define BIT_MASK(nr)		(1UL << ((nr) & (BITS_PER_WORD - 1)))
+#define BITS_TO_WORDS(nr)	(((nr) + BITS_PER_WORD - 1) / BITS_PER_WORD)
 
-#define BIT_WORD(nr)            ((nr) / BITS_PER_LONG)
 
-
-static uint32_t *fee_ccd2_bad_pixels;
-static uint32_t *fee_ccd4_bad_pixels;
+/* the currently active bad pixel maps, indexed by FEE_CCD_ID_2/4;
+ * these are exchanged atomically via fee_bad_pixel_map_swap()
+ */
+static struct fee_bad_pixel_map *fee_bad_pixels[2];
 
 
 /**
@@ -51,9 +48,20 @@ static uint32_t *fee_ccd4_bad_pixels;
  * @nr: bit number to test
  * @addr: Address to start counting from
  */
-static inline int test_bit(int nr, const volatile uint32_t *addr)
+static inline int test_bit(size_t nr, const uint32_t *addr)
+{
+        return 1UL & (addr[BIT_WORD(nr)] >> (nr & (BITS_PER_WORD - 1)));
+}
+
+
+/**
+ * set_bit - Set a bit
+ * @nr: bit number to set
+ * @addr: Address to start counting from
+ */
+static inline void set_bit(size_t nr, uint32_t *addr)
 {
-        return 1UL & (addr[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG-1)));
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
 }
 
 
@@ -203,51 +211,525 @@ void fee_pkt_wandering_mask_to_cpu(struct fee_data_pkt *pkt)
 }
 
 
+/**
+ * @brief move a wandering mask position to the next cycle
+ *
+ * @param[inout] col the column of the mask
+ * @param[inout] row the row of the mask
+ *
+ * @note the position is expected to be valid, i.e. between
+ *	 FEE_WANDERING_MASK_*_START and FEE_WANDERING_MASK_*_END
+ */
+
+void fee_wandering_mask_next(uint16_t *col, uint16_t *row)
+{
+	(*col) += FEE_WANDERING_MASK_STEP;
+	if ((*col) > FEE_WANDERING_MASK_COL_END) {
+		(*col) = FEE_WANDERING_MASK_COL_START;
+
+		(*row) += FEE_WANDERING_MASK_STEP;
+		if ((*row) > FEE_WANDERING_MASK_ROW_END)
+			(*row) = FEE_WANDERING_MASK_ROW_START;
+	}
+}
+
+
 
 
 
 /**
- * @brief check pixel mask for pixels marked invalid
- * #
- * @returns 1 if the event is marked as bad or is non-existant; 0 otherwise
+ * @brief get the frame geometry of a binning mode
  *
- * @note this is for use with event packets
+ * @param mode2 the FEE_MODE2_ binning mode
+ * @param[out] rows the number of rows
+ * @param[out] cols the number of columns
+ * @param[out] bins the binning factor
  *
- * @note there are some extra sanity checks which can be disabled in flight
- * of we need to squeeze out a few more cycles...
+ * @returns 0 on success, -1 if the mode is unknown
+ */
+
+static int fee_get_mode2_geometry(uint8_t mode2,
+				  size_t *rows, size_t *cols, size_t *bins)
+{
+	switch (mode2) {
+
+	case FEE_MODE2_NOBIN:
+		(*rows) = FEE_CCD_IMG_SEC_ROWS;
+		(*cols) = FEE_CCD_IMG_SEC_COLS;
+		(*bins) = 1;
+		break;
+
+	case FEE_MODE2_BIN6:
+		(*rows) = FEE_EDU_FRAME_6x6_ROWS;
+		(*cols) = FEE_EDU_FRAME_6x6_COLS;
+		(*bins) = 6;
+		break;
+
+	case FEE_MODE2_BIN24:
+		(*rows) = FEE_EDU_FRAME_24x24_ROWS;
+		(*cols) = FEE_EDU_FRAME_24x24_COLS;
+		(*bins) = 24;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief destroy a bad pixel map
+ */
+
+void fee_bad_pixel_map_destroy(struct fee_bad_pixel_map *map)
+{
+	if (!map)
+		return;
+
+	free(map->mask);
+	free(map->side[FEE_CCD_SIDE_F]);
+	free(map->side[FEE_CCD_SIDE_E]);
+	free(map);
+}
+
+
+/**
+ * @brief create an empty bad pixel map
+ *
+ * @param mode2 the FEE_MODE2_ binning mode the map applies to
+ * @param per_side if set, allocate extra masks for the E and F sides
  *
+ * @returns NULL on error, pointer otherwise
  */
 
-int fee_event_pixel_is_bad(struct fee_data_pkt *pkt)
+struct fee_bad_pixel_map *fee_bad_pixel_map_create(uint8_t mode2, int per_side)
+{
+	size_t rows, cols, bins;
+
+	struct fee_bad_pixel_map *map;
+
+
+	if (fee_get_mode2_geometry(mode2, &rows, &cols, &bins)) {
+		DBG("Unknown binning mode, cannot create bad pixel map\n");
+		return NULL;
+	}
+
+	map = (struct fee_bad_pixel_map *) calloc(sizeof(struct fee_bad_pixel_map), 1);
+	if (!map) {
+		DBG("Could not allocate bad pixel map");
+		return NULL;
+	}
+
+	map->mode2 = mode2;
+	map->rows  = rows;
+	map->cols  = cols;
+	map->bins  = bins;
+	map->words = BITS_TO_WORDS(rows * cols);
+
+	map->mask = (uint32_t *) calloc(sizeof(uint32_t), map->words);
+	if (!map->mask)
+		goto error;
+
+	if (!per_side)
+		return map;
+
+	map->side[FEE_CCD_SIDE_F] = (uint32_t *) calloc(sizeof(uint32_t), map->words);
+	if (!map->side[FEE_CCD_SIDE_F])
+		goto error;
+
+	map->side[FEE_CCD_SIDE_E] = (uint32_t *) calloc(sizeof(uint32_t), map->words);
+	if (!map->side[FEE_CCD_SIDE_E])
+		goto error;
+
+	return map;
+
+error:
+	DBG("Could not allocate bad pixel mask");
+	fee_bad_pixel_map_destroy(map);
+
+	return NULL;
+}
+
+
+/**
+ * @brief get the mask of a map for a given side selector
+ *
+ * @returns the mask or NULL if not available
+ */
+
+static uint32_t *fee_bad_pixel_map_get_mask(struct fee_bad_pixel_map *map,
+					    uint8_t side)
+{
+	switch (side) {
+	case FEE_CCD_SIDE_F:
+	case FEE_CCD_SIDE_E:
+		return map->side[side];
+	case FEE_BAD_PIX_SIDE_BOTH:
+		return map->mask;
+	default:
+		return NULL;
+	}
+}
+
+
+/**
+ * @brief load a bitmap into a bad pixel map
+ *
+ * @param map the bad pixel map
+ * @param side FEE_CCD_SIDE_E or FEE_CCD_SIDE_F for a per-side mask,
+ *	  FEE_BAD_PIX_SIDE_BOTH for the mask common to both sides
+ * @param bitmap the bitmap, one bit per pixel in row-major order of the
+ *	  map's binning mode, the LSB of the first word is pixel (0,0)
+ * @param n_words the number of 32 bit words in the bitmap
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note bitmaps shorter than the map clear the remaining pixels, excess
+ *	 words are ignored
+ */
+
+int fee_bad_pixel_map_load(struct fee_bad_pixel_map *map, uint8_t side,
+			   const uint32_t *bitmap, size_t n_words)
+{
+	uint32_t *mask;
+
+
+	if (!map)
+		return -1;
+
+	if (!bitmap)
+		return -1;
+
+	mask = fee_bad_pixel_map_get_mask(map, side);
+	if (!mask)
+		return -1;
+
+	if (n_words > map->words)
+		n_words = map->words;
+
+	memcpy(mask, bitmap, n_words * sizeof(uint32_t));
+	memset(&mask[n_words], 0, (map->words - n_words) * sizeof(uint32_t));
+
+	/* clear the padding bits in the last word */
+	if ((map->rows * map->cols) & (BITS_PER_WORD - 1))
+		mask[map->words - 1] &= BIT_MASK(map->rows * map->cols) - 1;
+
+	return 0;
+}
+
+
+/**
+ * @brief mark a single pixel in a bad pixel map
+ *
+ * @param map the bad pixel map
+ * @param side the side selector, see fee_bad_pixel_map_load()
+ * @param row the pixel row in the map's binning mode
+ * @param col the pixel column in the map's binning mode
+ *
+ * @returns 0 on success, -1 on error
+ */
+
+int fee_bad_pixel_map_set(struct fee_bad_pixel_map *map, uint8_t side,
+			  size_t row, size_t col)
+{
+	uint32_t *mask;
+
+
+	if (!map)
+		return -1;
+
+	if (row >= map->rows || col >= map->cols)
+		return -1;
+
+	mask = fee_bad_pixel_map_get_mask(map, side);
+	if (!mask)
+		return -1;
+
+	set_bit(row * map->cols + col, mask);
+
+	return 0;
+}
+
+
+/**
+ * @brief test a single pixel in a bad pixel map
+ *
+ * @param map the bad pixel map
+ * @param side FEE_CCD_SIDE_E or FEE_CCD_SIDE_F
+ * @param row the pixel row in the map's binning mode
+ * @param col the pixel column in the map's binning mode
+ *
+ * @returns 1 if the pixel is bad or out of bounds, 0 otherwise
+ *
+ * @note a pixel is bad if it is marked in the common or the per-side mask
+ */
+
+int fee_bad_pixel_map_test(const struct fee_bad_pixel_map *map, uint8_t side,
+			   size_t row, size_t col)
 {
 	size_t idx;
 
-	uint32_t *tbl;
 
+	if (row >= map->rows || col >= map->cols)
+		return 1;
+
+	idx = row * map->cols + col;
+
+	if (test_bit(idx, map->mask))
+		return 1;
+
+	if (side > FEE_CCD_SIDE_E)
+		return 0;
+
+	if (!map->side[side])
+		return 0;
+
+	return test_bit(idx, map->side[side]);
+}
+
+
+/**
+ * @brief test a pixel region of another binning mode in a bad pixel map
+ *
+ * @param map the bad pixel map
+ * @param side FEE_CCD_SIDE_E or FEE_CCD_SIDE_F
+ * @param row the pixel row in the binning mode given by bins
+ * @param col the pixel column in the binning mode given by bins
+ * @param bins the binning factor of row and col
+ *
+ * @returns 1 if any pixel of the map covered by the binned pixel is bad
+ *
+ * @note the covered range is clipped to the map; a binned pixel that
+ *	 does not cover any pixel of the map is not bad, as the map holds
+ *	 no information about it
+ */
+
+static int fee_bad_pixel_map_test_binned(const struct fee_bad_pixel_map *map,
+					 uint8_t side,
+					 size_t row, size_t col, size_t bins)
+{
+	size_t r, c;
+	size_t r0, r1;
+	size_t c0, c1;
+
+
+	if (bins == map->bins)
+		return fee_bad_pixel_map_test(map, side, row, col);
+
+	/* the first and (exclusive) last map pixel covered by the bin */
+	r0 = (row * bins) / map->bins;
+	c0 = (col * bins) / map->bins;
+	r1 = ((row + 1) * bins + map->bins - 1) / map->bins;
+	c1 = ((col + 1) * bins + map->bins - 1) / map->bins;
+
+	if (r1 > map->rows)
+		r1 = map->rows;
+
+	if (c1 > map->cols)
+		c1 = map->cols;
+
+	for (r = r0; r < r1; r++)
+		for (c = c0; c < c1; c++)
+			if (fee_bad_pixel_map_test(map, side, r, c))
+				return 1;
+
+	return 0;
+}
+
+
+/**
+ * @brief create a bad pixel map for a different binning mode
+ *
+ * @param map the source bad pixel map
+ * @param mode2 the FEE_MODE2_ binning mode of the new map
+ *
+ * @returns NULL on error, pointer otherwise
+ *
+ * @note a binned pixel is considered bad if any of the pixels it covers is
+ *	 bad; the per-side masks are kept if present in the source map
+ */
+
+struct fee_bad_pixel_map *fee_bad_pixel_map_rebin(const struct fee_bad_pixel_map *map,
+						  uint8_t mode2)
+{
+	int per_side;
+	size_t r, c;
+
+	struct fee_bad_pixel_map *bin;
+
+
+	if (!map)
+		return NULL;
+
+	per_side = map->side[FEE_CCD_SIDE_F] || map->side[FEE_CCD_SIDE_E];
+
+	bin = fee_bad_pixel_map_create(mode2, per_side);
+	if (!bin)
+		return NULL;
+
+	for (r = 0; r < bin->rows; r++) {
+		for (c = 0; c < bin->cols; c++) {
+
+			size_t idx = r * bin->cols + c;
+
+			if (!per_side) {
+				if (fee_bad_pixel_map_test_binned(map, FEE_BAD_PIX_SIDE_BOTH,
+								  r, c, bin->bins))
+					set_bit(idx, bin->mask);
+				continue;
+			}
+
+			/* the per-side tests include the common mask,
+			 * so the rebinned per-side masks carry all bad
+			 * pixels and the common mask remains empty
+			 */
+			if (fee_bad_pixel_map_test_binned(map, FEE_CCD_SIDE_F,
+							  r, c, bin->bins))
+				set_bit(idx, bin->side[FEE_CCD_SIDE_F]);
+
+			if (fee_bad_pixel_map_test_binned(map, FEE_CCD_SIDE_E,
+							  r, c, bin->bins))
+				set_bit(idx, bin->side[FEE_CCD_SIDE_E]);
+		}
+	}
+
+	return bin;
+}
+
+
+/**
+ * @brief atomically replace the active bad pixel map of a CCD
+ *
+ * @param ccd_id FEE_CCD_ID_2 or FEE_CCD_ID_4
+ * @param map the new bad pixel map, may be NULL to disable bad pixel checks
+ *
+ * @returns the previously active map (may be NULL), the caller takes
+ *	    ownership; on invalid ccd_id, the map argument is returned
+ *
+ * @warn make sure no concurrent fee_event_pixel_is_bad() or
+ *	 fee_event_filter_bad_pixels() call is in progress before destroying
+ *	 the returned map
+ */
+
+struct fee_bad_pixel_map *fee_bad_pixel_map_swap(uint8_t ccd_id,
+						 struct fee_bad_pixel_map *map)
+{
+	if (ccd_id > FEE_CCD_ID_4)
+		return map;
+
+	return __atomic_exchange_n(&fee_bad_pixels[ccd_id], map,
+				   __ATOMIC_ACQ_REL);
+}
+
+
+/**
+ * @brief get the active bad pixel map of a CCD
+ *
+ * @param ccd_id FEE_CCD_ID_2 or FEE_CCD_ID_4
+ *
+ * @returns the map or NULL if none is loaded
+ */
+
+const struct fee_bad_pixel_map *fee_bad_pixel_map_get(uint8_t ccd_id)
+{
+	if (ccd_id > FEE_CCD_ID_4)
+		return NULL;
+
+	return __atomic_load_n(&fee_bad_pixels[ccd_id], __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * @brief check an event against a bad pixel map
+ */
+
+static int fee_event_pixel_is_bad_internal(const struct fee_bad_pixel_map *map,
+					   const struct fee_event_detection *ev)
+{
+	if (!map)
+		return 0;
+
+	/* events are always located in binned frame coordinates */
+	if (map->bins == FEE_EV_BINS)
+		return fee_bad_pixel_map_test(map, ev->hdr.type.ccd_side,
+					      ev->row, ev->col);
+
+	return fee_bad_pixel_map_test_binned(map, ev->hdr.type.ccd_side,
+					     ev->row, ev->col, FEE_EV_BINS);
+}
+
+
+/**
+ * @brief check pixel mask for pixels marked invalid
+ *
+ * @returns 1 if the event is marked as bad or is non-existant; 0 otherwise
+ *
+ * @note this is for use with event packets, the packet header and event
+ *	 fields must be in cpu endianess
+ *
+ * @note if no bad pixel map is loaded for the CCD, no pixel is bad
+ */
+
+int fee_event_pixel_is_bad(struct fee_data_pkt *pkt)
+{
 	struct fee_event_detection *ev;
 
 
 	if (!fee_pkt_is_event(pkt))
 		return 1;
 
-
 	ev = (struct fee_event_detection *) pkt;
 
-	idx = ev->row * FEE_EDU_FRAME_6x6_COLS + ev->col;
+	return fee_event_pixel_is_bad_internal(fee_bad_pixel_map_get(ev->hdr.type.ccd_id), ev);
+}
 
-	if (idx > FEE_EDU_FRAME_6x6_COLS * FEE_EDU_FRAME_6x6_ROWS)
-		return 1;
 
-	if (pkt->hdr.type.ccd_id == FEE_CCD_ID_2)
-		tbl = fee_ccd2_bad_pixels;
+/**
+ * @brief remove events on bad pixels from an array of event packets
+ *
+ * @param ev an array of event packets
+ * @param n the number of elements in the array
+ *
+ * @returns the number of events remaining at the start of the array
+ *
+ * @note the active maps are looked up once per call, so a concurrent
+ *	 fee_bad_pixel_map_swap() will not affect a batch in progress;
+ *	 the relative order of the remaining events is preserved
+ *
+ * @note this is for use with event packets, the packet header and event
+ *	 fields must be in cpu endianess; non-event packets are removed
+ */
 
-	if (pkt->hdr.type.ccd_id == FEE_CCD_ID_4)
-		tbl = fee_ccd4_bad_pixels;
+size_t fee_event_filter_bad_pixels(struct fee_event_detection *ev, size_t n)
+{
+	size_t i;
+	size_t cnt = 0;
 
-	if (!tbl)
-		return 1;
+	const struct fee_bad_pixel_map *map[2];
+
+
+	if (!ev)
+		return 0;
+
+	map[FEE_CCD_ID_2] = fee_bad_pixel_map_get(FEE_CCD_ID_2);
+	map[FEE_CCD_ID_4] = fee_bad_pixel_map_get(FEE_CCD_ID_4);
+
+	for (i = 0; i < n; i++) {
+
+		if (ev[i].hdr.type.pkt_type != FEE_PKT_TYPE_EV_DET)
+			continue;
+
+		if (fee_event_pixel_is_bad_internal(map[ev[i].hdr.type.ccd_id], &ev[i]))
+			continue;
 
-	return test_bit(idx, tbl);
+		if (cnt != i)
+			memcpy(&ev[cnt], &ev[i], sizeof(struct fee_event_detection));
+
+		cnt++;
+	}
+
+	return cnt;
 }
 
 
@@ -263,22 +745,27 @@ int fee_event_pixel_is_bad(struct fee_data_pkt *pkt)
  * see TN "SMILE SXI CCD Testing and Calibration
  * Event Detection Methodology" issue 2 rev 0, section "Data Sorting Algorithm"
  *
- * @returns 1 if the event is considered an X-ray, 0 otherwise
+ * @returns a mask of the criteria (FEE_EV_REJ_*) by which the event is
+ *	    considered non-X-ray, 0 if it is considered an X-ray
+ *
+ * @note all criteria are evaluated, so the mask may have multiple bits set
  *
+ * @note the packet header and event fields must be in cpu endianess
  */
 
-int fee_event_is_xray(struct fee_data_pkt *pkt,
-		      uint16_t centre_th, uint32_t sum_th, uint16_t ring_th)
+uint8_t fee_event_classify(struct fee_data_pkt *pkt,
+			   uint16_t centre_th, uint32_t sum_th, uint16_t ring_th)
 {
 #define PIXEL_RING_COUNT_MAX 4
 
 	int cnt = 0;
 	uint32_t sum = 0;
+	uint8_t rej = 0;
 	struct fee_event_detection *ev;
 
 
 	if (!fee_pkt_is_event(pkt))
-		return 0;
+		return FEE_EV_REJ_INVALID;
 
 	ev = (struct fee_event_detection *) pkt;
 
@@ -287,7 +774,7 @@ int fee_event_is_xray(struct fee_data_pkt *pkt,
 		DBG("Event pixel over threshold, not an x-ray\n");
 		fee_pkt_show_event(pkt);
 #endif
-		return 0;
+		rej |= FEE_EV_REJ_CENTRE;
 	}
 
 	sum += ev->pix[6];
@@ -304,7 +791,7 @@ int fee_event_is_xray(struct fee_data_pkt *pkt,
 		DBG("Ring sum (%d) over threshold, not an x-ray\n", sum);
 		fee_pkt_show_event(pkt);
 #endif
-		return 0;
+		rej |= FEE_EV_REJ_RING_SUM;
 	}
 
 	if (ev->pix[6] > ring_th)
@@ -329,12 +816,26 @@ int fee_event_is_xray(struct fee_data_pkt *pkt,
 		DBG("Too many ring pixels (%d) over threshold, not an x-ray\n", cnt);
 		fee_pkt_show_event(pkt);
 #endif
-		return 0;
+		rej |= FEE_EV_REJ_RING_CNT;
 	}
 
+	return rej;
+}
 
 
-	return 1;
+/**
+ * @brief perform event classification
+ *
+ * @see fee_event_classify() for parameters
+ *
+ * @returns 1 if the event is considered an X-ray, 0 otherwise
+ *
+ */
+
+int fee_event_is_xray(struct fee_data_pkt *pkt,
+		      uint16_t centre_th, uint32_t sum_th, uint16_t ring_th)
+{
+	return !fee_event_classify(pkt, centre_th, sum_th, ring_th);
 }
 
 
@@ -142,6 +142,28 @@ struct fee_data_hdr {
 #define FEE_EV_DET_PIXELS	25	/* 5x5 grid around event pixel */
 #define FEE_EV_PIXEL_IDX	12	/* the index of the event pixel */
 #define FEE_EV_DATA_LEN		((2 +  FEE_EV_DET_PIXELS) *  sizeof(uint16_t))
+#define FEE_EV_BINS		 6	/* event detection runs in 6x6 binning mode */
+
+/* wandering mask positions in the 6x6 binned frame; the mask moves by
+ * FEE_WANDERING_MASK_STEP columns every cycle, wrapping to the next
+ * set of rows (confirmed by test with FEE)
+ */
+#define FEE_WANDERING_MASK_STEP		5
+#define FEE_WANDERING_MASK_COL_START	2
+#define FEE_WANDERING_MASK_ROW_START	2
+#define FEE_WANDERING_MASK_COL_END	(FEE_EDU_FRAME_6x6_COLS - 2)
+#define FEE_WANDERING_MASK_ROW_END	(FEE_EDU_FRAME_6x6_ROWS - 2)
+
+/* event classification flags, e.g. as kept in an event store */
+#define FEE_EV_CLASS_XRAY	0x01	/* passed fee_event_is_xray() */
+#define FEE_EV_CLASS_BAD_PIXEL	0x02	/* located on a bad pixel */
+
+/* event rejection criteria, see fee_event_classify() */
+#define FEE_EV_REJ_CENTRE	0x01	/* centre pixel over threshold */
+#define FEE_EV_REJ_RING_SUM	0x02	/* ring sum over threshold */
+#define FEE_EV_REJ_RING_CNT	0x04	/* too many ring pixels over threshold */
+#define FEE_EV_REJ_CRITERIA	3	/* number of criteria above */
+#define FEE_EV_REJ_INVALID	0x80	/* not an event */
 
 __extension__
 struct fee_event_detection {
@@ -304,6 +326,30 @@ struct fee_hk_data_payload {
 
 
 
+/**
+ * Bad pixel maps hold one bit per pixel (set == bad) in row-major order for
+ * the frame geometry of the binning mode they were created for. The common
+ * mask applies to both sides of a CCD, the per-side masks are optional and
+ * extend the common mask for either the E or F side.
+ */
+
+#define FEE_BAD_PIX_SIDE_BOTH	0x3	/* selects the common mask */
+
+struct fee_bad_pixel_map {
+
+	uint8_t mode2;		/* the binning mode of the map */
+
+	size_t rows;		/* the frame geometry of the binning mode */
+	size_t cols;
+	size_t bins;
+
+	size_t words;		/* the number of 32 bit words per mask */
+
+	uint32_t *mask;		/* common mask */
+	uint32_t *side[2];	/* FEE_CCD_SIDE_F/E masks, NULL if unused */
+};
+
+
 /**
  * The FT mode frame container structure
  */
@@ -361,10 +407,28 @@ void fee_pkt_show_event(struct fee_data_pkt *pkt);
 void fee_pkt_show_wandering_mask(struct fee_data_pkt *pkt);
 void fee_pkt_event_to_cpu(struct fee_data_pkt *pkt);
 void fee_pkt_wandering_mask_to_cpu(struct fee_data_pkt *pkt);
+void fee_wandering_mask_next(uint16_t *col, uint16_t *row);
 
+uint8_t fee_event_classify(struct fee_data_pkt *pkt,
+			   uint16_t centre_th, uint32_t sum_th, uint16_t ring_th);
 int fee_event_is_xray(struct fee_data_pkt *pkt,
 		      uint16_t centre_th, uint32_t sum_th, uint16_t ring_th);
 int fee_event_pixel_is_bad(struct fee_data_pkt *pkt);
+size_t fee_event_filter_bad_pixels(struct fee_event_detection *ev, size_t n);
+
+void fee_bad_pixel_map_destroy(struct fee_bad_pixel_map *map);
+struct fee_bad_pixel_map *fee_bad_pixel_map_create(uint8_t mode2, int per_side);
+int fee_bad_pixel_map_load(struct fee_bad_pixel_map *map, uint8_t side,
+			   const uint32_t *bitmap, size_t n_words);
+int fee_bad_pixel_map_set(struct fee_bad_pixel_map *map, uint8_t side,
+			  size_t row, size_t col);
+int fee_bad_pixel_map_test(const struct fee_bad_pixel_map *map, uint8_t side,
+			   size_t row, size_t col);
+struct fee_bad_pixel_map *fee_bad_pixel_map_rebin(const struct fee_bad_pixel_map *map,
+						  uint8_t mode2);
+struct fee_bad_pixel_map *fee_bad_pixel_map_swap(uint8_t ccd_id,
+						 struct fee_bad_pixel_map *map);
+const struct fee_bad_pixel_map *fee_bad_pixel_map_get(uint8_t ccd_id);
 
 void fee_ft_aggregator_destroy(struct fee_ft_data *ft);
 struct fee_ft_data *fee_ft_aggregator_create(void);
@@ -0,0 +1,233 @@
+/**
+ * @file   smile_fee_bin.c
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE frame binning
+ *
+ * Bins a full frame of CCD samples into blocks of bins x bins, as the FEE
+ * does in its 6x6 and 24x24 binning modes. Each strip of input rows is
+ * summed into a line of 32 bit accumulators, which are then added up
+ * horizontally in blocks of bins columns and saturated to 16 bits.
+ *
+ * The line accumulator of a full CCD row fits into the L1 cache, so every
+ * input sample is read exactly once. The vertical pass widens four
+ * samples at a time, the horizontal pass adds the lanes pairwise where the
+ * bin factor is a multiple of the vector width. The common bin factors are
+ * instantiated with a constant argument, so their inner loops are unrolled
+ * by the compiler.
+ *
+ */
+
+#include <debug.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <smile_fee_bin.h>
+
+
+#define FEE_BIN_LANES	4
+
+typedef uint32_t fee_bin_v32 __attribute__((vector_size(FEE_BIN_LANES * sizeof(uint32_t))));
+typedef uint16_t fee_bin_v16 __attribute__((vector_size(FEE_BIN_LANES * sizeof(uint16_t))));
+
+
+/**
+ * @brief add a row of samples to the line accumulator
+ */
+
+static inline __attribute__((always_inline))
+void fee_bin_acc_row(uint32_t *acc, const uint16_t *src, size_t n)
+{
+	size_t i;
+
+	fee_bin_v16 s;
+	fee_bin_v32 a;
+
+
+	for (i = 0; i + FEE_BIN_LANES <= n; i += FEE_BIN_LANES) {
+		memcpy(&s, &src[i], sizeof(s));
+		memcpy(&a, &acc[i], sizeof(a));
+		a += __builtin_convertvector(s, fee_bin_v32);
+		memcpy(&acc[i], &a, sizeof(a));
+	}
+
+	for (; i < n; i++)
+		acc[i] += src[i];
+}
+
+
+/**
+ * @brief sum a block of bins accumulators
+ */
+
+static inline __attribute__((always_inline))
+uint32_t fee_bin_hsum(const uint32_t *acc, const unsigned int bins)
+{
+	unsigned int i;
+	uint32_t sum = 0;
+
+	fee_bin_v32 v;
+	fee_bin_v32 a = {0};
+
+
+	if (!(bins % FEE_BIN_LANES)) {
+
+		for (i = 0; i < bins; i += FEE_BIN_LANES) {
+			memcpy(&v, &acc[i], sizeof(v));
+			a += v;
+		}
+
+		return (a[0] + a[1]) + (a[2] + a[3]);
+	}
+
+	for (i = 0; i < bins; i++)
+		sum += acc[i];
+
+	return sum;
+}
+
+
+/**
+ * @brief bin rows x cols samples into blocks of bins x bins
+ *
+ * @note bins is constant in the specialised callers below
+ */
+
+static inline __attribute__((always_inline))
+void fee_bin_block(uint16_t *dst, size_t dst_cols, uint32_t *acc,
+		   const uint16_t *src, size_t src_cols,
+		   size_t rows, size_t cols, const unsigned int bins)
+{
+	size_t x, y;
+	unsigned int i;
+	uint32_t sum;
+
+
+	for (y = 0; y < rows; y++) {
+
+		memset(acc, 0, cols * bins * sizeof(uint32_t));
+
+		for (i = 0; i < bins; i++)
+			fee_bin_acc_row(acc, &src[(y * bins + i) * src_cols],
+					cols * bins);
+
+		for (x = 0; x < cols; x++) {
+			sum = fee_bin_hsum(&acc[x * bins], bins);
+			dst[y * dst_cols + x] = sum > 0xFFFF ? 0xFFFF : sum;
+		}
+	}
+}
+
+
+static void fee_bin_block_6(uint16_t *dst, size_t dst_cols, uint32_t *acc,
+			    const uint16_t *src, size_t src_cols,
+			    size_t rows, size_t cols)
+{
+	fee_bin_block(dst, dst_cols, acc, src, src_cols, rows, cols, 6);
+}
+
+
+static void fee_bin_block_24(uint16_t *dst, size_t dst_cols, uint32_t *acc,
+			     const uint16_t *src, size_t src_cols,
+			     size_t rows, size_t cols)
+{
+	fee_bin_block(dst, dst_cols, acc, src, src_cols, rows, cols, 24);
+}
+
+
+static void fee_bin_block_n(uint16_t *dst, size_t dst_cols, uint32_t *acc,
+			    const uint16_t *src, size_t src_cols,
+			    size_t rows, size_t cols, unsigned int bins)
+{
+	fee_bin_block(dst, dst_cols, acc, src, src_cols, rows, cols, bins);
+}
+
+
+/**
+ * @brief bin a frame of samples
+ *
+ * @param dst the output frame
+ * @param dst_rows the number of rows of the output frame
+ * @param dst_cols the number of columns (the row stride) of the output frame
+ * @param src the input frame
+ * @param rows the number of rows of the input frame
+ * @param cols the number of columns of the input frame
+ * @param bins the bin factor in both directions, 1...FEE_BIN_MAX
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note partial blocks at the edges of the input frame are dropped and
+ *	 samples of the output frame outside the binned area are not
+ *	 touched; the output is clipped to dst_rows x dst_cols
+ *
+ * @note binned samples saturate at 0xFFFF
+ */
+
+int fee_bin_frame(uint16_t *dst, size_t dst_rows, size_t dst_cols,
+		  const uint16_t *src, size_t rows, size_t cols,
+		  unsigned int bins)
+{
+	size_t y;
+	size_t rw, cl;
+
+	uint32_t *acc;
+
+
+	if (!dst || !src)
+		return -1;
+
+	if (!bins || bins > FEE_BIN_MAX)
+		return -1;
+
+	rw = rows / bins;
+	cl = cols / bins;
+
+	if (rw > dst_rows)
+		rw = dst_rows;
+
+	if (cl > dst_cols)
+		cl = dst_cols;
+
+	if (!rw || !cl)
+		return 0;
+
+	if (bins == 1) {
+		for (y = 0; y < rw; y++)
+			memcpy(&dst[y * dst_cols], &src[y * cols],
+			       cl * sizeof(uint16_t));
+		return 0;
+	}
+
+	acc = malloc(cl * bins * sizeof(uint32_t));
+	if (!acc) {
+		DBG("Could not allocate line accumulator\n");
+		return -1;
+	}
+
+	switch (bins) {
+	case 6:
+		fee_bin_block_6(dst, dst_cols, acc, src, cols, rw, cl);
+		break;
+	case 24:
+		fee_bin_block_24(dst, dst_cols, acc, src, cols, rw, cl);
+		break;
+	default:
+		fee_bin_block_n(dst, dst_cols, acc, src, cols, rw, cl, bins);
+		break;
+	}
+
+	free(acc);
+
+	return 0;
+}
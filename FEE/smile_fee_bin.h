@@ -0,0 +1,36 @@
+/**
+ * @file   smile_fee_bin.h
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE frame binning
+ *
+ */
+
+#ifndef SMILE_FEE_BIN_H
+#define SMILE_FEE_BIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* the largest bin factor for which a 32 bit accumulator cannot overflow */
+#define FEE_BIN_MAX	256
+
+
+int fee_bin_frame(uint16_t *dst, size_t dst_rows, size_t dst_cols,
+		  const uint16_t *src, size_t rows, size_t cols,
+		  unsigned int bins);
+
+
+#endif /* SMILE_FEE_BIN_H */
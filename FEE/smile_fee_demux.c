@@ -0,0 +1,429 @@
+/**
+ * @file   smile_fee_demux.c
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE link packet demultiplexer
+ *
+ * The demultiplexer is the single reader of a GRESB link socket. It
+ * reads in large chunks, frames the GRESB packets and sorts their SpW
+ * payload by protocol id into a RMAP and a FEE data queue, which are
+ * drained via the usual rx(NULL)/rx(buf) semantics, e.g. by the rx
+ * callback of smile_fee_rmap_init() and the data aggregators.
+ *
+ * If a queue is full, reading from the link stops until the consumer
+ * has caught up, so the backpressure propagates to the sender. This
+ * does not hold for RMAP: if the RMAP queue is read while it is empty,
+ * FEE data packets that do not fit into the full data queue are dropped,
+ * so the RMAP replies behind them are not starved by a slow data reader.
+ *
+ * @note this is not thread safe, use from a single thread only
+ */
+
+#include <debug.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <smile_fee.h>
+#include <smile_fee_demux.h>
+
+
+/* the length prefix of a record marking the wrap to the buffer start */
+#define DEMUX_WRAP	0xFFFFFFFFUL
+
+#define DEMUX_REC_SIZE(len)	(sizeof(uint32_t) + (((len) + 3UL) & ~3UL))
+
+
+/**
+ * @brief initialise a packet queue
+ *
+ * @returns 0 on success, -1 on error
+ */
+
+static int fee_demux_queue_init(struct fee_demux_queue *q, size_t size)
+{
+	/* records are 4-byte aligned */
+	size = (size + 3UL) & ~3UL;
+
+	q->buf = malloc(size);
+	if (!q->buf)
+		return -1;
+
+	q->size = size;
+	q->rd   = 0;
+	q->wr   = 0;
+	q->cnt  = 0;
+
+	return 0;
+}
+
+
+/**
+ * @brief get the next record in a queue
+ *
+ * @returns the record length prefix or NULL if the queue is empty
+ */
+
+static uint32_t *fee_demux_queue_peek(struct fee_demux_queue *q)
+{
+	uint32_t *rec;
+
+
+	if (!q->cnt)
+		return NULL;
+
+	if (q->size - q->rd < sizeof(uint32_t))
+		q->rd = 0;
+
+	rec = (uint32_t *) &q->buf[q->rd];
+
+	if ((*rec) == DEMUX_WRAP) {
+		q->rd = 0;
+		rec = (uint32_t *) q->buf;
+	}
+
+	return rec;
+}
+
+
+/**
+ * @brief remove the next record from a queue
+ */
+
+static void fee_demux_queue_pop(struct fee_demux_queue *q)
+{
+	uint32_t *rec;
+
+
+	rec = fee_demux_queue_peek(q);
+	if (!rec)
+		return;
+
+	q->rd += DEMUX_REC_SIZE(*rec);
+	q->cnt--;
+
+	if (!q->cnt) {
+		q->rd = 0;
+		q->wr = 0;
+	}
+}
+
+
+/**
+ * @brief add a packet to a queue
+ *
+ * @returns 0 on success, -1 if the queue is full
+ */
+
+static int fee_demux_queue_push(struct fee_demux_queue *q,
+				const uint8_t *data, uint32_t len)
+{
+	size_t need;
+
+
+	need = DEMUX_REC_SIZE(len);
+
+	if (q->cnt && q->wr == q->rd)
+		return -1;
+
+	if (q->wr >= q->rd) {
+
+		/* free space is from wr to the end, then up to rd */
+		if (q->size - q->wr < need) {
+
+			if (q->cnt && q->rd < need)
+				return -1;
+
+			if (!q->cnt && q->size < need)
+				return -1;
+
+			if (q->size - q->wr >= sizeof(uint32_t))
+				(*(uint32_t *) &q->buf[q->wr]) = DEMUX_WRAP;
+
+			q->wr = 0;
+
+			if (!q->cnt)
+				q->rd = 0;
+		}
+
+	} else if (q->rd - q->wr < need) {
+		return -1;
+	}
+
+	(*(uint32_t *) &q->buf[q->wr]) = len;
+	memcpy(&q->buf[q->wr + sizeof(uint32_t)], data, len);
+
+	q->wr += need;
+	q->cnt++;
+
+	return 0;
+}
+
+
+/**
+ * @brief create a packet demultiplexer
+ *
+ * @param fd a connected stream or local packet socket to the GRESB (bridge)
+ * @param rmap_qsize the size of the RMAP queue in bytes, 0 for default
+ * @param data_qsize the size of the FEE data queue in bytes, 0 for default
+ *
+ * @returns the demultiplexer or NULL on error
+ *
+ * @note the demultiplexer takes ownership of the socket, which should be
+ *	 set to non-blocking mode
+ */
+
+struct fee_demux *fee_demux_create(int fd, size_t rmap_qsize, size_t data_qsize)
+{
+	struct fee_demux *dmx;
+
+
+	if (fd < 0)
+		return NULL;
+
+	if (!rmap_qsize)
+		rmap_qsize = FEE_DEMUX_RMAP_QUEUE_SIZE;
+
+	if (!data_qsize)
+		data_qsize = FEE_DEMUX_DATA_QUEUE_SIZE;
+
+	dmx = (struct fee_demux *) calloc(1, sizeof(struct fee_demux));
+	if (!dmx)
+		return NULL;
+
+	dmx->fd = fd;
+
+	if (gresb_rx_buf_init(&dmx->rx, GRESB_RX_BUF_SIZE))
+		goto error;
+
+	dmx->rx.msg = gresb_sock_is_msg(fd);
+
+	if (fee_demux_queue_init(&dmx->q[FEE_DEMUX_RMAP], rmap_qsize))
+		goto error;
+
+	if (fee_demux_queue_init(&dmx->q[FEE_DEMUX_DATA], data_qsize))
+		goto error;
+
+	return dmx;
+
+error:
+	gresb_rx_buf_free(&dmx->rx);
+	free(dmx->q[FEE_DEMUX_RMAP].buf);
+	free(dmx->q[FEE_DEMUX_DATA].buf);
+	free(dmx);
+
+	return NULL;
+}
+
+
+/**
+ * @brief destroy a packet demultiplexer and close its socket
+ */
+
+void fee_demux_destroy(struct fee_demux *dmx)
+{
+	if (!dmx)
+		return;
+
+	close(dmx->fd);
+
+	gresb_rx_buf_free(&dmx->rx);
+	free(dmx->q[FEE_DEMUX_RMAP].buf);
+	free(dmx->q[FEE_DEMUX_DATA].buf);
+	free(dmx);
+}
+
+
+/**
+ * @brief sort the framed packets in the receive buffer into the queues
+ *
+ * @param drop if set, drop FEE data packets if the data queue is full
+ *
+ * @returns the number of packets dispatched, -1 if a queue is full
+ */
+
+static int fee_demux_dispatch(struct fee_demux *dmx, int drop)
+{
+	int cnt = 0;
+	size_t len;
+	size_t n;
+
+	uint8_t *buf;
+	const uint8_t *spw;
+	struct fee_demux_queue *q;
+
+
+	while ((buf = gresb_rx_buf_peek_pkt(&dmx->rx, &len))) {
+
+		spw = gresb_get_spw_data(buf);
+		n   = len - GRESB_PKT_HDR_SIZE;
+
+		/* the protocol id follows the logical address */
+		q = NULL;
+		if (n >= 2) {
+			if (spw[1] == RMAP_PROTOCOL_ID)
+				q = &dmx->q[FEE_DEMUX_RMAP];
+			else if (spw[1] == FEE_DATA_PROTOCOL)
+				q = &dmx->q[FEE_DEMUX_DATA];
+		}
+
+		if (!q) {
+			dmx->unknown++;
+			gresb_rx_buf_pop_pkt(&dmx->rx);
+			continue;
+		}
+
+		if (DEMUX_REC_SIZE(n) > q->size) {
+			DBG("Packet of %lu bytes exceeds queue size\n",
+			    (unsigned long) n);
+			dmx->oversized++;
+			gresb_rx_buf_pop_pkt(&dmx->rx);
+			continue;
+		}
+
+		if (!fee_demux_queue_push(q, spw, n)) {
+			gresb_rx_buf_pop_pkt(&dmx->rx);
+			cnt++;
+			continue;
+		}
+
+		if (!drop || q != &dmx->q[FEE_DEMUX_DATA])
+			return -1;
+
+		dmx->overrun++;
+		gresb_rx_buf_pop_pkt(&dmx->rx);
+	}
+
+	return cnt;
+}
+
+
+/**
+ * @brief read pending data from the link and sort it into the queues
+ *
+ * @param drop if set, drop FEE data packets if the data queue is full
+ *
+ * @returns the number of packets dispatched or -1 if the link was
+ *	    closed or failed
+ */
+
+static int fee_demux_read(struct fee_demux *dmx, int drop)
+{
+	int ret;
+	int cnt = 0;
+	ssize_t n;
+
+
+	while (1) {
+
+		ret = fee_demux_dispatch(dmx, drop);
+		if (ret < 0)
+			break;	/* backpressure */
+
+		cnt += ret;
+
+		n = gresb_rx_buf_fill(&dmx->rx, dmx->fd);
+		if (n > 0)
+			continue;
+
+		if (!n) {
+			DBG("Link closed by peer\n");
+			return -1;
+		}
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+
+		DBG("Link receive error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return cnt;
+}
+
+
+/**
+ * @brief read pending data from the link and sort it into the queues
+ *
+ * @returns the number of packets dispatched or -1 if the link was
+ *	    closed or failed
+ *
+ * @note reading stops when a queue is full
+ */
+
+int fee_demux_poll(struct fee_demux *dmx)
+{
+	if (!dmx)
+		return -1;
+
+	return fee_demux_read(dmx, 0);
+}
+
+
+/**
+ * @brief receive a packet from a queue
+ *
+ * @param queue the queue to receive from (FEE_DEMUX_RMAP or FEE_DEMUX_DATA)
+ * @param pkt a buffer to copy the next packet into or NULL
+ *
+ * @returns the size of the next packet, 0 if none is available
+ *
+ * @note if pkt is NULL, the size of the next packet is returned and the
+ *	 packet is held until called with a buffer of at least that size;
+ *	 this matches the semantics of the rx callback of
+ *	 smile_fee_rmap_init()
+ *
+ * @note the packet is the SpW data of the GRESB packet, i.e. it starts
+ *	 with the logical address
+ *
+ * @note if the RMAP queue is empty, FEE data packets that do not fit into
+ *	 the data queue are dropped until the link is drained, see
+ *	 fee_demux_read()
+ */
+
+uint32_t fee_demux_rx(struct fee_demux *dmx, unsigned int queue, uint8_t *pkt)
+{
+	uint32_t len;
+	uint32_t *rec;
+	struct fee_demux_queue *q;
+
+
+	if (!dmx)
+		return 0;
+
+	if (queue >= FEE_DEMUX_QUEUES)
+		return 0;
+
+	q = &dmx->q[queue];
+
+	/* a full data queue must not hold back the RMAP replies */
+	if (!q->cnt)
+		fee_demux_read(dmx, queue == FEE_DEMUX_RMAP);
+
+	rec = fee_demux_queue_peek(q);
+	if (!rec)
+		return 0;
+
+	len = (*rec);
+
+	if (!pkt)
+		return len;
+
+	memcpy(pkt, &rec[1], len);
+	fee_demux_queue_pop(q);
+
+	return len;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file   smile_fee_demux.h
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE link packet demultiplexer
+ *
+ */
+
+#ifndef SMILE_FEE_DEMUX_H
+#define SMILE_FEE_DEMUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gresb.h>
+
+
+/* queue selection */
+#define FEE_DEMUX_RMAP		0	/* RMAP_PROTOCOL_ID */
+#define FEE_DEMUX_DATA		1	/* FEE_DATA_PROTOCOL */
+#define FEE_DEMUX_QUEUES	2
+
+#define FEE_DEMUX_RMAP_QUEUE_SIZE	0x10000		/* default, bytes */
+#define FEE_DEMUX_DATA_QUEUE_SIZE	0x400000	/* default, bytes */
+
+
+/* a bounded queue of length-prefixed packets in a byte ring
+ *
+ * a full queue stops reading from the link (backpressure), except when
+ * the RMAP queue is read while empty: FEE data packets that do not fit
+ * into the data queue are then dropped and counted as overrun, so a slow
+ * data reader never starves the RMAP replies behind them
+ */
+struct fee_demux_queue {
+	uint8_t *buf;
+	size_t size;
+	size_t rd;
+	size_t wr;
+	size_t cnt;		/* packets in queue */
+};
+
+struct fee_demux {
+	int fd;
+
+	struct gresb_rx_buf rx;
+	struct fee_demux_queue q[FEE_DEMUX_QUEUES];
+
+	uint32_t unknown;	/* dropped packets of unknown protocol */
+	uint32_t oversized;	/* dropped packets too large for a queue */
+	uint32_t overrun;	/* dropped data packets, data queue full */
+};
+
+
+struct fee_demux *fee_demux_create(int fd, size_t rmap_qsize, size_t data_qsize);
+void fee_demux_destroy(struct fee_demux *dmx);
+
+int fee_demux_poll(struct fee_demux *dmx);
+uint32_t fee_demux_rx(struct fee_demux *dmx, unsigned int queue, uint8_t *pkt);
+
+
+#endif /* SMILE_FEE_DEMUX_H */
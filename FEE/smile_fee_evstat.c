@@ -0,0 +1,384 @@
+/**
+ * @file   smile_fee_evstat.c
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE online event statistics
+ *
+ * The statistics are updated incrementally from the event stream in
+ * constant time per event; all memory is allocated on creation.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <smile_fee_evstat.h>
+
+
+#define EV_STAT_OCC_SIZE	(FEE_EV_STAT_OCC_ROWS * FEE_EV_STAT_OCC_COLS)
+
+
+/**
+ * @brief get the histogram bin of a value
+ */
+
+static inline size_t fee_ev_stat_hist_bin(uint32_t val, unsigned int shift)
+{
+	val >>= shift;
+
+	if (val >= FEE_EV_STAT_HIST_BINS)
+		return FEE_EV_STAT_HIST_BINS - 1;
+
+	return val;
+}
+
+
+/**
+ * @brief destroy an event statistics structure
+ */
+
+void fee_ev_stat_destroy(struct fee_ev_stat *st)
+{
+	if (!st)
+		return;
+
+	/* single allocation, see fee_ev_stat_create() */
+	free(st->occ[0][0]);
+	free(st);
+}
+
+
+/**
+ * @brief create an event statistics structure
+ *
+ * @param centre_th the centre pixel threshold of the classifier
+ * @param sum_th    the ring sum threshold of the classifier
+ * @param ring_th   the ring pixel threshold of the classifier
+ *
+ * @returns the statistics structure or NULL on error
+ *
+ * @see fee_event_classify()
+ */
+
+struct fee_ev_stat *fee_ev_stat_create(uint16_t centre_th, uint32_t sum_th,
+				       uint16_t ring_th)
+{
+	uint32_t *occ;
+	struct fee_ev_stat *st;
+
+
+	st = (struct fee_ev_stat *) calloc(1, sizeof(struct fee_ev_stat));
+	if (!st)
+		return NULL;
+
+	occ = calloc(4 * EV_STAT_OCC_SIZE, sizeof(uint32_t));
+	if (!occ) {
+		free(st);
+		return NULL;
+	}
+
+	st->occ[0][0] = &occ[0 * EV_STAT_OCC_SIZE];
+	st->occ[0][1] = &occ[1 * EV_STAT_OCC_SIZE];
+	st->occ[1][0] = &occ[2 * EV_STAT_OCC_SIZE];
+	st->occ[1][1] = &occ[3 * EV_STAT_OCC_SIZE];
+
+	st->centre_th = centre_th;
+	st->sum_th    = sum_th;
+	st->ring_th   = ring_th;
+
+	return st;
+}
+
+
+/**
+ * @brief clear all accumulated statistics
+ *
+ * @note the classifier thresholds are retained
+ */
+
+void fee_ev_stat_reset(struct fee_ev_stat *st)
+{
+	uint32_t *occ;
+
+	uint16_t centre_th;
+	uint32_t sum_th;
+	uint16_t ring_th;
+
+
+	if (!st)
+		return;
+
+	occ       = st->occ[0][0];
+	centre_th = st->centre_th;
+	sum_th    = st->sum_th;
+	ring_th   = st->ring_th;
+
+	memset(occ, 0, 4 * EV_STAT_OCC_SIZE * sizeof(uint32_t));
+	memset(st, 0, sizeof(struct fee_ev_stat));
+
+	st->occ[0][0] = &occ[0 * EV_STAT_OCC_SIZE];
+	st->occ[0][1] = &occ[1 * EV_STAT_OCC_SIZE];
+	st->occ[1][0] = &occ[2 * EV_STAT_OCC_SIZE];
+	st->occ[1][1] = &occ[3 * EV_STAT_OCC_SIZE];
+
+	st->centre_th = centre_th;
+	st->sum_th    = sum_th;
+	st->ring_th   = ring_th;
+}
+
+
+/**
+ * @brief complete the current frame and update the per-frame rates
+ *
+ * @note this is done implicitly by fee_ev_stat_update() when the
+ *	 frame counter changes; call this when the last packet of a
+ *	 readout cycle was received to close the frame without delay
+ */
+
+void fee_ev_stat_frame_end(struct fee_ev_stat *st)
+{
+	size_t i, j;
+
+
+	if (!st)
+		return;
+
+	if (!st->frame_valid)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+
+			st->last_cnt[i][j]   = st->frame_cnt[i][j];
+			st->total_cnt[i][j] += st->frame_cnt[i][j];
+
+			if (st->frame_cnt[i][j] > st->peak_cnt[i][j])
+				st->peak_cnt[i][j] = st->frame_cnt[i][j];
+
+			st->frame_cnt[i][j] = 0;
+		}
+	}
+
+	st->frames++;
+	st->frame_valid = 0;
+}
+
+
+/**
+ * @brief update the statistics with an event
+ *
+ * @param pkt an event packet
+ *
+ * @returns the result of the classification of the event, i.e. 0 if the
+ *	    event is considered an X-ray, FEE_EV_REJ_INVALID if the
+ *	    packet is not an event
+ *
+ * @note the packet header and event fields must be in cpu endianess
+ */
+
+uint8_t fee_ev_stat_update(struct fee_ev_stat *st, struct fee_data_pkt *pkt)
+{
+	size_t i;
+	uint8_t rej;
+	uint8_t id;
+	uint8_t side;
+	uint32_t sum;
+
+	struct fee_event_detection *ev;
+
+
+	if (!st)
+		return FEE_EV_REJ_INVALID;
+
+	rej = fee_event_classify(pkt, st->centre_th, st->sum_th, st->ring_th);
+	if (rej & FEE_EV_REJ_INVALID)
+		return rej;
+
+	ev = (struct fee_event_detection *) pkt;
+
+	if (st->frame_valid && st->frame != ev->hdr.frame_cntr)
+		fee_ev_stat_frame_end(st);
+
+	if (!st->frame_valid) {
+		st->frame       = ev->hdr.frame_cntr;
+		st->frame_valid = 1;
+	}
+
+	/* 3x3 sum around the centre */
+	sum  = ev->pix[6];
+	sum += ev->pix[7];
+	sum += ev->pix[8];
+	sum += ev->pix[11];
+	sum += ev->pix[FEE_EV_PIXEL_IDX];
+	sum += ev->pix[13];
+	sum += ev->pix[16];
+	sum += ev->pix[17];
+	sum += ev->pix[18];
+
+	st->events++;
+
+	st->centre_hist[FEE_EV_STAT_ALL][fee_ev_stat_hist_bin(ev->pix[FEE_EV_PIXEL_IDX], FEE_EV_STAT_CENTRE_SHIFT)]++;
+	st->sum_hist[FEE_EV_STAT_ALL][fee_ev_stat_hist_bin(sum, FEE_EV_STAT_SUM_SHIFT)]++;
+
+	if (!rej) {
+		st->accepted++;
+		st->centre_hist[FEE_EV_STAT_ACCEPTED][fee_ev_stat_hist_bin(ev->pix[FEE_EV_PIXEL_IDX], FEE_EV_STAT_CENTRE_SHIFT)]++;
+		st->sum_hist[FEE_EV_STAT_ACCEPTED][fee_ev_stat_hist_bin(sum, FEE_EV_STAT_SUM_SHIFT)]++;
+	}
+
+	for (i = 0; i < FEE_EV_REJ_CRITERIA; i++) {
+		if (rej & (1 << i))
+			st->rejected[i]++;
+	}
+
+	id   = ev->hdr.type.ccd_id;
+	side = ev->hdr.type.ccd_side;
+
+	if (side > FEE_CCD_SIDE_E) {
+		st->invalid++;
+		return rej;
+	}
+
+	st->frame_cnt[id][side]++;
+
+	if (ev->row >= FEE_EV_STAT_OCC_ROWS || ev->col >= FEE_EV_STAT_OCC_COLS) {
+		st->invalid++;
+		return rej;
+	}
+
+	st->occ[id][side][ev->row * FEE_EV_STAT_OCC_COLS + ev->col]++;
+
+	return rej;
+}
+
+
+/**
+ * @brief get the fraction of events rejected by a criterion
+ *
+ * @param rej a single FEE_EV_REJ_ criterion or 0 for any criterion
+ *
+ * @returns the fraction of rejected events, 0.0 if there were no events
+ */
+
+double fee_ev_stat_reject_fraction(const struct fee_ev_stat *st, uint8_t rej)
+{
+	size_t i;
+
+
+	if (!st)
+		return 0.0;
+
+	if (!st->events)
+		return 0.0;
+
+	if (!rej)
+		return (double) (st->events - st->accepted) / (double) st->events;
+
+	for (i = 0; i < FEE_EV_REJ_CRITERIA; i++) {
+		if (rej & (1 << i))
+			return (double) st->rejected[i] / (double) st->events;
+	}
+
+	return 0.0;
+}
+
+
+/**
+ * @brief get the mean number of events per completed frame
+ *
+ * @returns the event rate or 0.0 if no frame was completed
+ */
+
+double fee_ev_stat_rate(const struct fee_ev_stat *st,
+			uint8_t ccd_id, uint8_t ccd_side)
+{
+	if (!st)
+		return 0.0;
+
+	if (ccd_id > FEE_CCD_ID_4)
+		return 0.0;
+
+	if (ccd_side > FEE_CCD_SIDE_E)
+		return 0.0;
+
+	if (!st->frames)
+		return 0.0;
+
+	return (double) st->total_cnt[ccd_id][ccd_side] / (double) st->frames;
+}
+
+
+/**
+ * @brief get the number of events seen at a binned pixel position
+ */
+
+uint32_t fee_ev_stat_occupancy(const struct fee_ev_stat *st,
+			       uint8_t ccd_id, uint8_t ccd_side,
+			       uint16_t row, uint16_t col)
+{
+	if (!st)
+		return 0;
+
+	if (ccd_id > FEE_CCD_ID_4)
+		return 0;
+
+	if (ccd_side > FEE_CCD_SIDE_E)
+		return 0;
+
+	if (row >= FEE_EV_STAT_OCC_ROWS || col >= FEE_EV_STAT_OCC_COLS)
+		return 0;
+
+	return st->occ[ccd_id][ccd_side][row * FEE_EV_STAT_OCC_COLS + col];
+}
+
+
+/**
+ * @brief print a summary of the event statistics
+ */
+
+void fee_ev_stat_show(const struct fee_ev_stat *st)
+{
+	size_t i, j;
+
+	static const char *rej_str[FEE_EV_REJ_CRITERIA] = {
+		"centre pixel", "ring sum", "ring count"};
+
+
+	if (!st)
+		return;
+
+	printf("\n\tEvents %lu, accepted %lu, rejected %.2f%%, invalid %lu\n",
+	       (unsigned long) st->events, (unsigned long) st->accepted,
+	       100.0 * fee_ev_stat_reject_fraction(st, 0),
+	       (unsigned long) st->invalid);
+
+	for (i = 0; i < FEE_EV_REJ_CRITERIA; i++)
+		printf("\tRejected by %-13s %.2f%%\n", rej_str[i],
+		       100.0 * fee_ev_stat_reject_fraction(st, 1 << i));
+
+	printf("\tFrames: %u\n", st->frames);
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			printf("\tCCD%c %c: last %u, peak %u, mean %.2f events/frame\n",
+			       i == FEE_CCD_ID_2 ? '2' : '4',
+			       j == FEE_CCD_SIDE_E ? 'E' : 'F',
+			       st->last_cnt[i][j], st->peak_cnt[i][j],
+			       fee_ev_stat_rate(st, i, j));
+		}
+	}
+
+	printf("\n");
+}
@@ -0,0 +1,92 @@
+/**
+ * @file   smile_fee_evstat.h
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE online event statistics
+ *
+ */
+
+#ifndef SMILE_FEE_EVSTAT_H
+#define SMILE_FEE_EVSTAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <smile_fee.h>
+
+
+#define FEE_EV_STAT_HIST_BINS		1024
+#define FEE_EV_STAT_CENTRE_SHIFT	6	/* 64 ADU per centre hist. bin */
+#define FEE_EV_STAT_SUM_SHIFT		10	/* 1024 ADU per 3x3 sum hist. bin */
+
+/* histogram selection */
+#define FEE_EV_STAT_ALL		0
+#define FEE_EV_STAT_ACCEPTED	1
+
+/* rows and columns of the occupancy map, i.e. the 6x6 binned frame */
+#define FEE_EV_STAT_OCC_ROWS	FEE_EDU_FRAME_6x6_ROWS
+#define FEE_EV_STAT_OCC_COLS	FEE_EDU_FRAME_6x6_COLS
+
+
+/* indexed by [ccd_id][ccd_side] where applicable */
+struct fee_ev_stat {
+
+	/* classifier thresholds, see fee_event_classify() */
+	uint16_t centre_th;
+	uint32_t sum_th;
+	uint16_t ring_th;
+
+	/* energy histograms; bins are clamped to the last one */
+	uint32_t centre_hist[2][FEE_EV_STAT_HIST_BINS];
+	uint32_t sum_hist[2][FEE_EV_STAT_HIST_BINS];
+
+	uint64_t events;	/* total number of events */
+	uint64_t accepted;	/* events classified as X-ray */
+	uint64_t rejected[FEE_EV_REJ_CRITERIA];	/* events failing a criterion */
+	uint64_t invalid;	/* events outside of the occupancy map */
+
+	/* per-frame rates */
+	uint16_t frame;		/* frame counter of the current frame */
+	int frame_valid;	/* set if a frame is in progress */
+	uint32_t frames;	/* number of completed frames */
+
+	uint32_t frame_cnt[2][2];	/* events in the current frame */
+	uint32_t last_cnt[2][2];	/* events in the last completed frame */
+	uint32_t peak_cnt[2][2];	/* max. events in a completed frame */
+	uint64_t total_cnt[2][2];	/* events in all completed frames */
+
+	/* event occupancy at 6x6 binned resolution */
+	uint32_t *occ[2][2];
+};
+
+
+void fee_ev_stat_destroy(struct fee_ev_stat *st);
+struct fee_ev_stat *fee_ev_stat_create(uint16_t centre_th, uint32_t sum_th,
+				       uint16_t ring_th);
+void fee_ev_stat_reset(struct fee_ev_stat *st);
+
+uint8_t fee_ev_stat_update(struct fee_ev_stat *st, struct fee_data_pkt *pkt);
+void fee_ev_stat_frame_end(struct fee_ev_stat *st);
+
+double fee_ev_stat_reject_fraction(const struct fee_ev_stat *st, uint8_t rej);
+double fee_ev_stat_rate(const struct fee_ev_stat *st,
+			uint8_t ccd_id, uint8_t ccd_side);
+uint32_t fee_ev_stat_occupancy(const struct fee_ev_stat *st,
+			       uint8_t ccd_id, uint8_t ccd_side,
+			       uint16_t row, uint16_t col);
+
+void fee_ev_stat_show(const struct fee_ev_stat *st);
+
+
+#endif /* SMILE_FEE_EVSTAT_H */
@@ -0,0 +1,679 @@
+/**
+ * @file   smile_fee_evstore.c
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE columnar event store
+ *
+ * Events are buffered column-wise into blocks which are appended to a
+ * data file with a single gathered write once full. The frame counters
+ * of the events in a block are recorded in a small sidecar index, so
+ * the events of a particular frame may be retrieved without scanning
+ * the whole file.
+ *
+ */
+
+#include <debug.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include <smile_fee_evstore.h>
+
+
+#define EV_STORE_ALIGN(x)	(((x) + 3UL) & ~3UL)
+
+/* column indices */
+#define EV_COL_FRAME	0
+#define EV_COL_CCD	1
+#define EV_COL_SIDE	2
+#define EV_COL_ROW	3
+#define EV_COL_COL	4
+#define EV_COL_PIX	5
+#define EV_COL_FLAGS	(EV_COL_PIX + FEE_EV_DET_PIXELS)
+#define EV_COLS		(EV_COL_FLAGS + 1)
+
+/* a header, all columns and their padding */
+#define EV_STORE_IOV	(1 + 2 * EV_COLS)
+
+/* the number of index entries read per call */
+#define EV_STORE_IDX_CHUNK	256
+
+
+struct fee_ev_store {
+	int fd;
+	int idx_fd;
+
+	uint64_t offset;		/* file offset of the next block */
+
+	size_t cap;			/* events per block */
+	size_t n;			/* events in current block */
+
+	uint8_t *buf;			/* column storage */
+	void *col[EV_COLS];		/* column start in buf */
+
+	struct fee_ev_store_idx *idx;	/* index entries of current block */
+	size_t n_idx;
+
+	int failed;			/* set after a write error */
+};
+
+
+static const uint8_t ev_store_pad[4];
+
+
+/**
+ * @brief get the element size of a column
+ */
+
+static size_t fee_ev_store_col_size(size_t c)
+{
+	if (c == EV_COL_CCD || c == EV_COL_SIDE || c == EV_COL_FLAGS)
+		return sizeof(uint8_t);
+
+	return sizeof(uint16_t);
+}
+
+
+/**
+ * @brief compute the column offsets of a block of n events
+ *
+ * @param off the offsets of the columns relative to the end of the header
+ *
+ * @returns the size of the block payload
+ */
+
+static size_t fee_ev_store_layout(size_t n, size_t off[EV_COLS])
+{
+	size_t c;
+	size_t pos = 0;
+
+
+	for (c = 0; c < EV_COLS; c++) {
+		off[c] = pos;
+		pos    = EV_STORE_ALIGN(pos + n * fee_ev_store_col_size(c));
+	}
+
+	return pos;
+}
+
+
+/**
+ * @brief open a file and move to its end
+ *
+ * @returns the file descriptor or -1 on error
+ */
+
+static int fee_ev_store_open_append(const char *path, off_t *end)
+{
+	int fd;
+
+
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+
+	(*end) = lseek(fd, 0, SEEK_END);
+	if ((*end) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/**
+ * @brief write a vector of buffers, retrying on short writes
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note the vector is modified
+ */
+
+static int fee_ev_store_writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+
+	while (cnt) {
+
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (cnt && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+
+		if (cnt) {
+			iov->iov_base = (uint8_t *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief read exactly n bytes at a file offset
+ *
+ * @returns 0 on success, -1 on error or short file
+ */
+
+static int fee_ev_store_pread_all(int fd, void *buf, size_t n, uint64_t offset)
+{
+	ssize_t rd;
+
+
+	while (n) {
+
+		rd = pread(fd, buf, n, (off_t) offset);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (!rd)
+			return -1;
+
+		buf     = (uint8_t *) buf + rd;
+		n      -= rd;
+		offset += rd;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief create an event store
+ *
+ * @param path the data file to append to; the index is placed
+ *	  in a file of the same name with FEE_EV_STORE_IDX_SUFFIX appended
+ * @param blk_ev the number of events per block, 0 for default
+ *
+ * @returns the event store or NULL on error
+ *
+ * @note existing files are appended to
+ */
+
+struct fee_ev_store *fee_ev_store_create(const char *path, size_t blk_ev)
+{
+	size_t c;
+	size_t sz;
+	size_t off[EV_COLS];
+
+	off_t end;
+	off_t idx_end;
+
+	char *idx_path;
+	struct fee_ev_store *st;
+
+
+	if (!path)
+		return NULL;
+
+	if (!blk_ev)
+		blk_ev = FEE_EV_STORE_BLK_EV;
+
+	st = (struct fee_ev_store *) calloc(1, sizeof(struct fee_ev_store));
+	if (!st)
+		return NULL;
+
+	st->fd     = -1;
+	st->idx_fd = -1;
+	st->cap    = blk_ev;
+
+	sz = fee_ev_store_layout(st->cap, off);
+
+	st->buf = malloc(sz);
+	st->idx = malloc(st->cap * sizeof(struct fee_ev_store_idx));
+
+	idx_path = malloc(strlen(path) + sizeof(FEE_EV_STORE_IDX_SUFFIX));
+
+	if (!st->buf || !st->idx || !idx_path)
+		goto error;
+
+	for (c = 0; c < EV_COLS; c++)
+		st->col[c] = st->buf + off[c];
+
+	strcpy(idx_path, path);
+	strcat(idx_path, FEE_EV_STORE_IDX_SUFFIX);
+
+	st->fd = fee_ev_store_open_append(path, &end);
+	if (st->fd < 0) {
+		DBG("Could not open event store %s\n", path);
+		goto error;
+	}
+
+	st->idx_fd = fee_ev_store_open_append(idx_path, &idx_end);
+	if (st->idx_fd < 0) {
+		DBG("Could not open event store index %s\n", idx_path);
+		goto error;
+	}
+
+	st->offset = (uint64_t) end;
+
+	free(idx_path);
+
+	return st;
+
+error:
+	free(idx_path);
+	fee_ev_store_destroy(st);
+
+	return NULL;
+}
+
+
+/**
+ * @brief destroy an event store
+ *
+ * @returns 0 on success, -1 if pending events could not be written
+ *
+ * @note pending events are flushed before the store is closed
+ */
+
+int fee_ev_store_destroy(struct fee_ev_store *st)
+{
+	int ret = 0;
+
+
+	if (!st)
+		return 0;
+
+	if (st->fd >= 0 && st->idx_fd >= 0)
+		ret = fee_ev_store_flush(st);
+
+	if (st->fd >= 0)
+		close(st->fd);
+
+	if (st->idx_fd >= 0)
+		close(st->idx_fd);
+
+	free(st->buf);
+	free(st->idx);
+	free(st);
+
+	return ret;
+}
+
+
+/**
+ * @brief write the current block and its index entries
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note the block is written in a single gathered write, the columns
+ *	 are truncated to the actual number of events in the block
+ *
+ * @note on a write error, the events of the block are dropped and the
+ *	 store is marked as failed, see fee_ev_store_add()
+ */
+
+int fee_ev_store_flush(struct fee_ev_store *st)
+{
+	size_t c;
+	size_t i;
+	size_t len;
+	size_t pos = 0;
+	int cnt = 0;
+
+	struct iovec iov[EV_STORE_IOV];
+	struct fee_ev_store_blk_hdr hdr;
+
+
+	if (!st)
+		return -1;
+
+	if (!st->n)
+		return 0;
+
+	hdr.magic       = FEE_EV_STORE_MAGIC;
+	hdr.n_ev        = st->n;
+	hdr.frame_first = ((uint16_t *) st->col[EV_COL_FRAME])[0];
+	hdr.frame_last  = ((uint16_t *) st->col[EV_COL_FRAME])[st->n - 1];
+
+	iov[cnt].iov_base = &hdr;
+	iov[cnt].iov_len  = sizeof(hdr);
+	cnt++;
+
+	for (c = 0; c < EV_COLS; c++) {
+
+		len = st->n * fee_ev_store_col_size(c);
+
+		iov[cnt].iov_base = st->col[c];
+		iov[cnt].iov_len  = len;
+		cnt++;
+
+		pos += len;
+
+		if (EV_STORE_ALIGN(pos) != pos) {
+			iov[cnt].iov_base = (void *) ev_store_pad;
+			iov[cnt].iov_len  = EV_STORE_ALIGN(pos) - pos;
+			cnt++;
+			pos = EV_STORE_ALIGN(pos);
+		}
+	}
+
+	hdr.size = sizeof(hdr) + pos;
+
+	if (fee_ev_store_writev_all(st->fd, iov, cnt)) {
+		DBG("Error writing event block: %s\n", strerror(errno));
+		goto error;
+	}
+
+	for (i = 0; i < st->n_idx; i++)
+		st->idx[i].offset = st->offset;
+
+	/* the block is in the file, the next one must not overwrite it */
+	st->offset += hdr.size;
+
+	iov[0].iov_base = st->idx;
+	iov[0].iov_len  = st->n_idx * sizeof(struct fee_ev_store_idx);
+
+	if (fee_ev_store_writev_all(st->idx_fd, iov, 1)) {
+		DBG("Error writing event index: %s\n", strerror(errno));
+		goto error;
+	}
+
+	st->n     = 0;
+	st->n_idx = 0;
+
+	return 0;
+
+error:
+	st->failed = 1;
+	st->n      = 0;
+	st->n_idx  = 0;
+
+	return -1;
+}
+
+
+/**
+ * @brief add an event to the store
+ *
+ * @param ev an event packet, header and event fields in cpu endianess
+ * @param flags the classification flags of the event (FEE_EV_CLASS_*)
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note the event is buffered, the block is written once full
+ *
+ * @note once a block could not be written, the store refuses all further
+ *	 events and should be destroyed by the caller
+ */
+
+int fee_ev_store_add(struct fee_ev_store *st,
+		     const struct fee_event_detection *ev, uint8_t flags)
+{
+	size_t i;
+	size_t n;
+	uint16_t frame;
+
+
+	if (!st)
+		return -1;
+
+	if (!ev)
+		return -1;
+
+	if (st->failed || st->n == st->cap)
+		return -1;
+
+	n     = st->n;
+	frame = ev->hdr.frame_cntr;
+
+	if (!n || ((uint16_t *) st->col[EV_COL_FRAME])[n - 1] != frame) {
+		st->idx[st->n_idx].frame    = frame;
+		st->idx[st->n_idx].reserved = 0;
+		st->idx[st->n_idx].first    = n;
+		st->n_idx++;
+	}
+
+	((uint16_t *) st->col[EV_COL_FRAME])[n] = frame;
+	((uint8_t *)  st->col[EV_COL_CCD])[n]   = ev->hdr.type.ccd_id;
+	((uint8_t *)  st->col[EV_COL_SIDE])[n]  = ev->hdr.type.ccd_side;
+	((uint16_t *) st->col[EV_COL_ROW])[n]   = ev->row;
+	((uint16_t *) st->col[EV_COL_COL])[n]   = ev->col;
+	((uint8_t *)  st->col[EV_COL_FLAGS])[n] = flags;
+
+	for (i = 0; i < FEE_EV_DET_PIXELS; i++)
+		((uint16_t *) st->col[EV_COL_PIX + i])[n] = ev->pix[i];
+
+	st->n++;
+
+	if (st->n == st->cap)
+		return fee_ev_store_flush(st);
+
+	return 0;
+}
+
+
+/**
+ * @brief extract the events of a frame from a block
+ *
+ * @returns the number of events of the frame found in the block
+ */
+
+static size_t fee_ev_store_extract(const uint8_t *blk, size_t n_ev,
+				   size_t first, uint16_t frame,
+				   struct fee_event_detection *ev,
+				   uint8_t *flags, size_t n)
+{
+	size_t i;
+	size_t k;
+	size_t cnt = 0;
+	size_t off[EV_COLS];
+
+	const uint16_t *f;
+
+
+	fee_ev_store_layout(n_ev, off);
+
+	f = (const uint16_t *) (blk + off[EV_COL_FRAME]);
+
+	for (i = first; i < n_ev; i++) {
+
+		if (f[i] != frame)
+			continue;
+
+		if (ev && cnt < n) {
+
+			memset(&ev[cnt], 0, sizeof(struct fee_event_detection));
+
+			ev[cnt].hdr.proto_id      = FEE_DATA_PROTOCOL;
+			ev[cnt].hdr.data_len      = FEE_EV_DATA_LEN;
+			ev[cnt].hdr.type.pkt_type = FEE_PKT_TYPE_EV_DET;
+			ev[cnt].hdr.type.ccd_id   = blk[off[EV_COL_CCD] + i];
+			ev[cnt].hdr.type.ccd_side = blk[off[EV_COL_SIDE] + i];
+			ev[cnt].hdr.frame_cntr    = frame;
+
+			ev[cnt].row = ((const uint16_t *) (blk + off[EV_COL_ROW]))[i];
+			ev[cnt].col = ((const uint16_t *) (blk + off[EV_COL_COL]))[i];
+
+			for (k = 0; k < FEE_EV_DET_PIXELS; k++)
+				ev[cnt].pix[k] = ((const uint16_t *) (blk + off[EV_COL_PIX + k]))[i];
+
+			if (flags)
+				flags[cnt] = blk[off[EV_COL_FLAGS] + i];
+		}
+
+		cnt++;
+	}
+
+	return cnt;
+}
+
+
+/**
+ * @brief read the events of a frame from an event store
+ *
+ * @param path the data file of the store
+ * @param frame the frame counter to look up
+ * @param ev an array of events to fill, may be NULL to only count the events
+ * @param flags an array of classification flags to fill, may be NULL
+ * @param n the number of elements in the arrays
+ *
+ * @returns the number of events of the frame in the store, -1 on error
+ *
+ * @note at most n events are returned, if the return value is larger than
+ *	 n, the arrays were too small
+ *
+ * @note the frame counter wraps, all matching frames are returned
+ *
+ * @note events are returned in cpu endianess, packet header fields not
+ *	 stored (e.g. the sequence counter) are zero
+ *
+ * @note a block whose size does not match its number of events or an
+ *	 index entry pointing past the events of its block is an error
+ */
+
+ssize_t fee_ev_store_read_frame(const char *path, uint16_t frame,
+				struct fee_event_detection *ev,
+				uint8_t *flags, size_t n)
+{
+	int fd = -1;
+	int idx_fd = -1;
+
+	size_t i;
+	size_t cnt = 0;
+	size_t blk_sz = 0;
+	size_t off[EV_COLS];
+	ssize_t rd;
+
+	uint64_t last = UINT64_MAX;
+
+	char *idx_path = NULL;
+	uint8_t *blk = NULL;
+	struct fee_ev_store_idx *idx;
+	struct fee_ev_store_blk_hdr hdr;
+
+
+	if (!path)
+		return -1;
+
+	idx = malloc(EV_STORE_IDX_CHUNK * sizeof(struct fee_ev_store_idx));
+	idx_path = malloc(strlen(path) + sizeof(FEE_EV_STORE_IDX_SUFFIX));
+
+	if (!idx || !idx_path)
+		goto error;
+
+	strcpy(idx_path, path);
+	strcat(idx_path, FEE_EV_STORE_IDX_SUFFIX);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		goto error;
+
+	idx_fd = open(idx_path, O_RDONLY);
+	if (idx_fd < 0)
+		goto error;
+
+	while (1) {
+
+		rd = read(idx_fd, idx,
+			  EV_STORE_IDX_CHUNK * sizeof(struct fee_ev_store_idx));
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+
+		if (!rd)
+			break;
+
+		/* XXX a partially written trailing entry is ignored */
+		for (i = 0; i < rd / sizeof(struct fee_ev_store_idx); i++) {
+
+			if (idx[i].frame != frame)
+				continue;
+
+			/* already scanned from an earlier entry */
+			if (idx[i].offset == last)
+				continue;
+
+			if (fee_ev_store_pread_all(fd, &hdr, sizeof(hdr), idx[i].offset))
+				goto error;
+
+			if (hdr.magic != FEE_EV_STORE_MAGIC || hdr.size < sizeof(hdr)) {
+				DBG("Invalid block magic %x at %lu\n", hdr.magic,
+				    (unsigned long) idx[i].offset);
+				goto error;
+			}
+
+			/* the columns of all events must be in the block */
+			if (hdr.size - sizeof(hdr) != fee_ev_store_layout(hdr.n_ev, off) ||
+			    idx[i].first > hdr.n_ev) {
+				DBG("Invalid block of %u events at %lu\n", hdr.n_ev,
+				    (unsigned long) idx[i].offset);
+				goto error;
+			}
+
+			if (hdr.size - sizeof(hdr) > blk_sz) {
+				free(blk);
+				blk_sz = hdr.size - sizeof(hdr);
+				blk = malloc(blk_sz);
+				if (!blk)
+					goto error;
+			}
+
+			if (fee_ev_store_pread_all(fd, blk, hdr.size - sizeof(hdr),
+						   idx[i].offset + sizeof(hdr)))
+				goto error;
+
+			cnt += fee_ev_store_extract(blk, hdr.n_ev, idx[i].first,
+						    frame,
+						    (ev    && cnt < n) ? &ev[cnt]    : NULL,
+						    (flags && cnt < n) ? &flags[cnt] : NULL,
+						    cnt < n ? n - cnt : 0);
+
+			last = idx[i].offset;
+		}
+	}
+
+	close(fd);
+	close(idx_fd);
+
+	free(blk);
+	free(idx);
+	free(idx_path);
+
+	return (ssize_t) cnt;
+
+error:
+	if (fd >= 0)
+		close(fd);
+
+	if (idx_fd >= 0)
+		close(idx_fd);
+
+	free(blk);
+	free(idx);
+	free(idx_path);
+
+	return -1;
+}
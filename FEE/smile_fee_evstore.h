@@ -0,0 +1,85 @@
+/**
+ * @file   smile_fee_evstore.h
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE columnar event store
+ *
+ */
+
+#ifndef SMILE_FEE_EVSTORE_H
+#define SMILE_FEE_EVSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <smile_fee.h>
+
+
+/* the event store is a sequence of blocks appended to a data file,
+ * each block starts with a header followed by the columns of its
+ * events; all columns start at a 4-byte boundary:
+ *
+ *	uint16_t frame[n]
+ *	uint8_t  ccd[n]
+ *	uint8_t  side[n]
+ *	uint16_t row[n]
+ *	uint16_t col[n]
+ *	uint16_t pix[FEE_EV_DET_PIXELS][n]	(one column per pixel index)
+ *	uint8_t  flags[n]			(FEE_EV_CLASS_*)
+ *
+ * a sidecar index file "<path>.idx" holds one struct fee_ev_store_idx
+ * for every frame counter that starts in a block
+ *
+ * @note all values are in the byte order of the writing machine, the
+ *	 block header magic may be used to detect a mismatch
+ */
+
+#define FEE_EV_STORE_MAGIC	0x46455642UL	/* "FEVB" */
+#define FEE_EV_STORE_BLK_EV	4096		/* default events per block */
+#define FEE_EV_STORE_IDX_SUFFIX	".idx"
+
+
+struct fee_ev_store_blk_hdr {
+	uint32_t magic;
+	uint32_t n_ev;		/* number of events in block */
+	uint32_t size;		/* block size in bytes, including header */
+	uint16_t frame_first;
+	uint16_t frame_last;
+};
+
+struct fee_ev_store_idx {
+	uint16_t frame;		/* frame counter */
+	uint16_t reserved;
+	uint32_t first;		/* first event of the frame in the block */
+	uint64_t offset;	/* file offset of the block */
+};
+
+
+struct fee_ev_store;
+
+
+struct fee_ev_store *fee_ev_store_create(const char *path, size_t blk_ev);
+int fee_ev_store_destroy(struct fee_ev_store *st);
+
+int fee_ev_store_add(struct fee_ev_store *st,
+		     const struct fee_event_detection *ev, uint8_t flags);
+int fee_ev_store_flush(struct fee_ev_store *st);
+
+ssize_t fee_ev_store_read_frame(const char *path, uint16_t frame,
+				struct fee_event_detection *ev,
+				uint8_t *flags, size_t n);
+
+
+#endif /* SMILE_FEE_EVSTORE_H */
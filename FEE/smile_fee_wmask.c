@@ -0,0 +1,379 @@
+/**
+ * @file   smile_fee_wmask.c
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE wandering mask tracker
+ *
+ * The tracker follows the wandering mask packets in the event stream
+ * and predicts the position of the mask in the next frame. A frame is
+ * flagged if the mask of a CCD side is missing or not at the predicted
+ * location. If an event was detected at the mask position, the FEE does
+ * not send the mask, this is flagged separately.
+ *
+ * The mean of the mask pixels is accumulated per position for bias
+ * monitoring. All memory is allocated on creation.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <smile_fee_wmask.h>
+
+
+/**
+ * @brief get the index of a mask position
+ *
+ * @returns the index or -1 if the location is not a mask position
+ */
+
+static int fee_wmask_pos_idx(uint16_t row, uint16_t col)
+{
+	if (row < FEE_WANDERING_MASK_ROW_START || row > FEE_WANDERING_MASK_ROW_END)
+		return -1;
+
+	if (col < FEE_WANDERING_MASK_COL_START || col > FEE_WANDERING_MASK_COL_END)
+		return -1;
+
+	row -= FEE_WANDERING_MASK_ROW_START;
+	col -= FEE_WANDERING_MASK_COL_START;
+
+	if ((row % FEE_WANDERING_MASK_STEP) || (col % FEE_WANDERING_MASK_STEP))
+		return -1;
+
+	return (row / FEE_WANDERING_MASK_STEP) * FEE_WMASK_POS_COLS
+		+ col / FEE_WANDERING_MASK_STEP;
+}
+
+
+/**
+ * @brief accumulate the mean of the mask pixels at a position
+ */
+
+static void fee_wmask_pos_stat_add(struct fee_wmask_pos_stat *ps,
+				   const struct fee_event_detection *ev)
+{
+	size_t i;
+	double x;
+	double d;
+	uint32_t sum = 0;
+
+
+	for (i = 0; i < FEE_EV_DET_PIXELS; i++)
+		sum += ev->pix[i];
+
+	x = (double) sum / (double) FEE_EV_DET_PIXELS;
+
+	/* Welford */
+	ps->n++;
+	d         = x - ps->mean;
+	ps->mean += d / (double) ps->n;
+	ps->m2   += d * (x - ps->mean);
+}
+
+
+/**
+ * @brief destroy a wandering mask tracker
+ */
+
+void fee_wmask_tracker_destroy(struct fee_wmask_tracker *tr)
+{
+	if (!tr)
+		return;
+
+	/* single allocation, see fee_wmask_tracker_create() */
+	free(tr->pos[0][0]);
+	free(tr);
+}
+
+
+/**
+ * @brief create a wandering mask tracker
+ *
+ * @returns the tracker or NULL on error
+ *
+ * @note the tracker locks on to the first mask it sees; only use it
+ *	 with the wandering mask enabled, otherwise no frame is checked
+ */
+
+struct fee_wmask_tracker *fee_wmask_tracker_create(void)
+{
+	struct fee_wmask_pos_stat *pos;
+	struct fee_wmask_tracker *tr;
+
+
+	tr = (struct fee_wmask_tracker *) calloc(1, sizeof(struct fee_wmask_tracker));
+	if (!tr)
+		return NULL;
+
+	pos = calloc(4 * FEE_WMASK_POSITIONS, sizeof(struct fee_wmask_pos_stat));
+	if (!pos) {
+		free(tr);
+		return NULL;
+	}
+
+	tr->pos[0][0] = &pos[0 * FEE_WMASK_POSITIONS];
+	tr->pos[0][1] = &pos[1 * FEE_WMASK_POSITIONS];
+	tr->pos[1][0] = &pos[2 * FEE_WMASK_POSITIONS];
+	tr->pos[1][1] = &pos[3 * FEE_WMASK_POSITIONS];
+
+	return tr;
+}
+
+
+/**
+ * @brief complete the current frame and check the mask
+ *
+ * @returns the FEE_WMASK_ flags of all CCD sides of the frame
+ *
+ * @note this is done implicitly by fee_wmask_tracker_update() when the
+ *	 frame counter changes; call this when the last packets of all
+ *	 sides of a readout cycle were received to check without delay
+ */
+
+uint8_t fee_wmask_tracker_frame_end(struct fee_wmask_tracker *tr)
+{
+	size_t i, j;
+	uint8_t f;
+	uint8_t ret = 0;
+	int resync = 0;
+
+
+	if (!tr)
+		return 0;
+
+	if (!tr->frame_valid)
+		return 0;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+
+			f = 0;
+
+			if (tr->misplaced[i][j]) {
+				f = FEE_WMASK_MISPOSITIONED;
+				resync = 1;
+			} else if (!tr->seen[i][j]) {
+				if (tr->event[i][j])
+					f = FEE_WMASK_COINCIDENT;
+				else
+					f = FEE_WMASK_MISSING;
+			}
+
+			if (!tr->check || !tr->active[i][j])
+				f = 0;
+
+			if (f & FEE_WMASK_MISSING)
+				tr->missing++;
+			if (f & FEE_WMASK_MISPOSITIONED)
+				tr->mispositioned++;
+			if (f & FEE_WMASK_COINCIDENT)
+				tr->coincident++;
+
+			tr->flags[i][j] = f;
+			ret |= f;
+		}
+	}
+
+	if (tr->check)
+		tr->frames++;
+
+	/* follow the mask if it was found elsewhere in two consecutive
+	 * frames, so a single corrupted mask will not throw us off
+	 */
+	if (resync) {
+		if (tr->drift && tr->obs_col == tr->drift_col
+			      && tr->obs_row == tr->drift_row) {
+			tr->col   = tr->obs_col;
+			tr->row   = tr->obs_row;
+			tr->drift = 0;
+		} else {
+			tr->drift_col = tr->obs_col;
+			tr->drift_row = tr->obs_row;
+			tr->drift     = 1;
+		}
+	} else {
+		tr->drift = 0;
+	}
+
+	if (tr->locked)
+		fee_wandering_mask_next(&tr->col, &tr->row);
+
+	if (tr->drift)
+		fee_wandering_mask_next(&tr->drift_col, &tr->drift_row);
+
+	memset(tr->active,    0, sizeof(tr->active));
+	memset(tr->seen,      0, sizeof(tr->seen));
+	memset(tr->event,     0, sizeof(tr->event));
+	memset(tr->misplaced, 0, sizeof(tr->misplaced));
+
+	tr->frame_valid = 0;
+
+	return ret;
+}
+
+
+/**
+ * @brief start a new frame
+ *
+ * @note if frames were skipped, the prediction is moved accordingly
+ */
+
+static void fee_wmask_tracker_frame_start(struct fee_wmask_tracker *tr,
+					  uint16_t frame)
+{
+	uint16_t skip;
+
+
+	if (tr->locked && frame != tr->frame) {
+		/* frame_end() already moved the mask by one */
+		skip = (uint16_t) (frame - tr->frame - 1);
+		skip %= FEE_WMASK_POSITIONS;
+
+		while (skip--) {
+			fee_wandering_mask_next(&tr->col, &tr->row);
+			if (tr->drift)
+				fee_wandering_mask_next(&tr->drift_col, &tr->drift_row);
+		}
+	}
+
+	tr->frame       = frame;
+	tr->frame_valid = 1;
+	tr->check       = tr->locked;
+}
+
+
+/**
+ * @brief update the tracker with an event or wandering mask packet
+ *
+ * @note the packet header and event fields must be in cpu endianess
+ * @note other packet types are ignored
+ */
+
+void fee_wmask_tracker_update(struct fee_wmask_tracker *tr,
+			      struct fee_data_pkt *pkt)
+{
+	int idx;
+	uint8_t id;
+	uint8_t side;
+
+	struct fee_event_detection *ev;
+
+
+	if (!tr)
+		return;
+
+	if (!fee_pkt_is_event(pkt) && !fee_pkt_is_wandering_mask(pkt))
+		return;
+
+	ev = (struct fee_event_detection *) pkt;
+
+	id   = ev->hdr.type.ccd_id;
+	side = ev->hdr.type.ccd_side;
+
+	if (side > FEE_CCD_SIDE_E)
+		return;
+
+	if (tr->frame_valid && tr->frame != ev->hdr.frame_cntr)
+		fee_wmask_tracker_frame_end(tr);
+
+	if (!tr->frame_valid)
+		fee_wmask_tracker_frame_start(tr, ev->hdr.frame_cntr);
+
+	tr->active[id][side] = 1;
+
+	if (fee_pkt_is_event(pkt)) {
+
+		/* last packet marker carries no event */
+		if (ev->hdr.type.last_pkt)
+			return;
+
+		if (!tr->locked)
+			return;
+
+		if (ev->col == tr->col && ev->row == tr->row)
+			tr->event[id][side] = 1;
+
+		return;
+	}
+
+	if (!tr->locked) {
+		tr->col    = ev->col;
+		tr->row    = ev->row;
+		tr->locked = 1;
+	}
+
+	if (ev->col == tr->col && ev->row == tr->row) {
+		tr->seen[id][side] = 1;
+	} else {
+		tr->misplaced[id][side] = 1;
+		tr->obs_col = ev->col;
+		tr->obs_row = ev->row;
+	}
+
+	idx = fee_wmask_pos_idx(ev->row, ev->col);
+	if (idx < 0)
+		return;
+
+	fee_wmask_pos_stat_add(&tr->pos[id][side][idx], ev);
+}
+
+
+/**
+ * @brief get the mask pixel statistics of a mask position
+ *
+ * @returns the statistics or NULL if the location is not a mask position
+ */
+
+const struct fee_wmask_pos_stat *fee_wmask_tracker_pos_stat(const struct fee_wmask_tracker *tr,
+							    uint8_t ccd_id,
+							    uint8_t ccd_side,
+							    uint16_t row,
+							    uint16_t col)
+{
+	int idx;
+
+
+	if (!tr)
+		return NULL;
+
+	if (ccd_id > FEE_CCD_ID_4)
+		return NULL;
+
+	if (ccd_side > FEE_CCD_SIDE_E)
+		return NULL;
+
+	idx = fee_wmask_pos_idx(row, col);
+	if (idx < 0)
+		return NULL;
+
+	return &tr->pos[ccd_id][ccd_side][idx];
+}
+
+
+/**
+ * @brief print a summary of the wandering mask checks
+ */
+
+void fee_wmask_tracker_show(const struct fee_wmask_tracker *tr)
+{
+	if (!tr)
+		return;
+
+	printf("\n\tWandering mask: %s, expected at col %d row %d\n",
+	       tr->locked ? "locked" : "not locked", tr->col, tr->row);
+	printf("\tFrames checked %u, missing %u, mispositioned %u, coincident %u\n\n",
+	       tr->frames, tr->missing, tr->mispositioned, tr->coincident);
+}
@@ -0,0 +1,99 @@
+/**
+ * @file   smile_fee_wmask.h
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2020
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE wandering mask tracker
+ *
+ */
+
+#ifndef SMILE_FEE_WMASK_H
+#define SMILE_FEE_WMASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <smile_fee.h>
+
+
+/* the number of mask positions in a row/column of the 6x6 binned frame */
+#define FEE_WMASK_POS_COLS	((FEE_WANDERING_MASK_COL_END - FEE_WANDERING_MASK_COL_START) \
+				 / FEE_WANDERING_MASK_STEP + 1)
+#define FEE_WMASK_POS_ROWS	((FEE_WANDERING_MASK_ROW_END - FEE_WANDERING_MASK_ROW_START) \
+				 / FEE_WANDERING_MASK_STEP + 1)
+#define FEE_WMASK_POSITIONS	(FEE_WMASK_POS_COLS * FEE_WMASK_POS_ROWS)
+
+/* frame check results */
+#define FEE_WMASK_MISSING	0x1	/* no mask, no event at the mask position */
+#define FEE_WMASK_MISPOSITIONED	0x2	/* mask not at the predicted position */
+#define FEE_WMASK_COINCIDENT	0x4	/* event at the mask position, no mask */
+
+
+/* running statistics of the mean of the 5x5 mask pixels at a position */
+struct fee_wmask_pos_stat {
+	uint32_t n;
+	double mean;
+	double m2;	/* sum of squared deviations, var = m2 / (n - 1) */
+};
+
+/* indexed by [ccd_id][ccd_side] where applicable */
+struct fee_wmask_tracker {
+
+	int locked;		/* set once the mask position is known */
+	uint16_t col;		/* predicted position in the current frame */
+	uint16_t row;
+
+	uint16_t obs_col;	/* last observed position */
+	uint16_t obs_row;
+
+	int drift;		/* set if the mask may have moved elsewhere */
+	uint16_t drift_col;	/* predicted position of the moved mask */
+	uint16_t drift_row;
+
+	uint16_t frame;		/* frame counter of the current frame */
+	int frame_valid;	/* set if a frame is in progress */
+	int check;		/* set if the current frame is checked */
+
+	uint8_t active[2][2];	/* side sent packets in the current frame */
+	uint8_t seen[2][2];	/* mask seen in the current frame */
+	uint8_t event[2][2];	/* event at the mask position seen */
+	uint8_t misplaced[2][2];	/* mask seen at a different position */
+
+	uint8_t flags[2][2];	/* FEE_WMASK_ flags of the last frame */
+
+	uint32_t frames;	/* number of checked frames */
+	uint32_t missing;
+	uint32_t mispositioned;
+	uint32_t coincident;
+
+	struct fee_wmask_pos_stat *pos[2][2];	/* FEE_WMASK_POSITIONS each */
+};
+
+
+void fee_wmask_tracker_destroy(struct fee_wmask_tracker *tr);
+struct fee_wmask_tracker *fee_wmask_tracker_create(void);
+
+void fee_wmask_tracker_update(struct fee_wmask_tracker *tr,
+			      struct fee_data_pkt *pkt);
+uint8_t fee_wmask_tracker_frame_end(struct fee_wmask_tracker *tr);
+
+const struct fee_wmask_pos_stat *fee_wmask_tracker_pos_stat(const struct fee_wmask_tracker *tr,
+							    uint8_t ccd_id,
+							    uint8_t ccd_side,
+							    uint16_t row,
+							    uint16_t col);
+
+void fee_wmask_tracker_show(const struct fee_wmask_tracker *tr);
+
+
+#endif /* SMILE_FEE_WMASK_H */
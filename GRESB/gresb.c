@@ -17,9 +17,22 @@
  *
  */
 
+#define _GNU_SOURCE	/* sendmmsg() */
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <gresb.h>
 
@@ -153,6 +166,31 @@ uint8_t *gresb_create_host_data_pkt(const uint8_t *data, uint32_t len)
 }
 
 
+/**
+ * @brief initialise a host-to-gresb data packet header in place
+ *
+ * @param buf a buffer with room for the header followed by len bytes of data
+ * @param len the length of the data following the header
+ *
+ * @returns 0 on success, -1 on error
+ */
+
+int gresb_set_host_data_pkt_hdr(uint8_t *buf, uint32_t len)
+{
+	struct host_to_gresb_pkt *pkt;
+
+
+	pkt = (struct host_to_gresb_pkt *) buf;
+	if (!pkt)
+		return -1;
+
+	if (gresb_host_pkt_set_protocol(pkt, GRESB_FROM_HOST_DATA))
+		return -1;
+
+	return gresb_host_pkt_set_data_size(pkt, len);
+}
+
+
 /**
  * @brief destroy a new host-to-gresb data packet
  */
@@ -317,3 +355,1031 @@ int test(void)
 
 	return 0;
 }
+
+
+/**
+ * @brief get the total size of a packet from its header
+ *
+ * @param buf the buffer holding at least the packet header
+ *
+ * @note this works for both directions, as the size field is located
+ *	 at the same offset in host-to-gresb and gresb-to-host packets
+ */
+
+static size_t gresb_pkt_get_size(const uint8_t *buf)
+{
+	size_t n;
+
+	n  = (buf[1] << 16) & 0xff0000;
+	n |= (buf[2] <<  8) & 0x00ff00;
+	n |= (buf[3] <<  0) & 0x0000ff;
+
+	return GRESB_PKT_HDR_SIZE + n;
+}
+
+
+/**
+ * @brief set up a UNIX socket address
+ *
+ * @returns 0 on success, -1 if the path is too long
+ */
+
+static int gresb_unix_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+
+/**
+ * @brief create a listening local packet socket
+ *
+ * @param path the file system path of the socket; an existing socket
+ *	  file is replaced
+ *
+ * @returns the socket or -1 on error
+ *
+ * @note this is a SOCK_SEQPACKET socket, packets are exchanged as one
+ *	 message each, but still carry the GRESB header, so the peers
+ *	 need not care about the transport
+ */
+
+int gresb_unix_listen(const char *path)
+{
+	int fd;
+
+	struct sockaddr_un addr;
+
+
+	if (gresb_unix_addr(&addr, path))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return -1;
+
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto error;
+
+	if (listen(fd, 0) < 0)
+		goto error;
+
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+
+/**
+ * @brief connect to a local packet socket
+ *
+ * @returns the socket or -1 on error
+ *
+ * @see gresb_unix_listen()
+ */
+
+int gresb_unix_connect(const char *path)
+{
+	int fd;
+
+	struct sockaddr_un addr;
+
+
+	if (gresb_unix_addr(&addr, path))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/**
+ * @brief check if a socket preserves message boundaries
+ *
+ * @returns 1 if packets are sent as individual messages, 0 otherwise
+ */
+
+int gresb_sock_is_msg(int fd)
+{
+	int type;
+	socklen_t len = sizeof(type);
+
+
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+		return 0;
+
+	return (type == SOCK_SEQPACKET || type == SOCK_DGRAM);
+}
+
+
+/**
+ * @brief initialise a streaming receive buffer
+ *
+ * @param rb the receive buffer
+ * @param size the initial size of the buffer
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note the buffer grows to fit packets larger than its initial size
+ */
+
+int gresb_rx_buf_init(struct gresb_rx_buf *rb, size_t size)
+{
+	if (!rb)
+		return -1;
+
+	if (size < GRESB_PKT_HDR_SIZE)
+		size = GRESB_RX_BUF_SIZE;
+
+	rb->buf = malloc(size);
+	if (!rb->buf)
+		return -1;
+
+	rb->size = size;
+	rb->head = 0;
+	rb->tail = 0;
+	rb->msg  = 0;
+
+	return 0;
+}
+
+
+/**
+ * @brief release the memory of a streaming receive buffer
+ */
+
+void gresb_rx_buf_free(struct gresb_rx_buf *rb)
+{
+	if (!rb)
+		return;
+
+	free(rb->buf);
+
+	rb->buf  = NULL;
+	rb->size = 0;
+	rb->head = 0;
+	rb->tail = 0;
+}
+
+
+/**
+ * @brief make room for more data in a streaming receive buffer
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note unconsumed data is moved to the start of the buffer; if the
+ *	 pending packet does not fit the buffer, the buffer is grown
+ */
+
+static int gresb_rx_buf_make_room(struct gresb_rx_buf *rb)
+{
+	size_t n;
+	size_t need;
+	uint8_t *buf;
+
+
+	n = rb->tail - rb->head;
+
+	if (rb->head) {
+		memmove(rb->buf, &rb->buf[rb->head], n);
+		rb->head = 0;
+		rb->tail = n;
+	}
+
+	if (n < GRESB_PKT_HDR_SIZE)
+		return 0;
+
+	need = gresb_pkt_get_size(rb->buf);
+	if (need <= rb->size)
+		return 0;
+
+	buf = realloc(rb->buf, need);
+	if (!buf)
+		return -1;
+
+	rb->buf  = buf;
+	rb->size = need;
+
+	return 0;
+}
+
+
+/**
+ * @brief make room for a message of a given size in a receive buffer
+ *
+ * @returns 0 on success, -1 on error
+ */
+
+static int gresb_rx_buf_reserve(struct gresb_rx_buf *rb, size_t len)
+{
+	size_t n;
+	uint8_t *buf;
+
+
+	if (rb->size - rb->tail >= len)
+		return 0;
+
+	n = rb->tail - rb->head;
+
+	if (rb->head) {
+		memmove(rb->buf, &rb->buf[rb->head], n);
+		rb->head = 0;
+		rb->tail = n;
+	}
+
+	if (rb->size - rb->tail >= len)
+		return 0;
+
+	buf = realloc(rb->buf, rb->tail + len);
+	if (!buf)
+		return -1;
+
+	rb->buf  = buf;
+	rb->size = rb->tail + len;
+
+	return 0;
+}
+
+
+/**
+ * @brief read a message from a socket into a receive buffer
+ *
+ * @note the size of the message is peeked first, so it is never
+ *	 truncated
+ */
+
+static ssize_t gresb_rx_buf_fill_msg(struct gresb_rx_buf *rb, int fd)
+{
+	ssize_t n;
+
+
+	do {
+		n = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	} while (n < 0 && errno == EINTR);
+
+	if (n <= 0)
+		return n;
+
+	if (gresb_rx_buf_reserve(rb, n)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	do {
+		n = recv(fd, &rb->buf[rb->tail], n, 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (n > 0)
+		rb->tail += n;
+
+	return n;
+}
+
+
+/**
+ * @brief read from a socket into a streaming receive buffer
+ *
+ * @param rb the receive buffer
+ * @param fd the socket to read from
+ *
+ * @returns the number of bytes read, 0 if the peer closed the connection,
+ *	    -1 on error (errno is EAGAIN or EWOULDBLOCK if a non-blocking
+ *	    socket has no data)
+ *
+ * @note this reads as much as fits in a single call, or a single message
+ *	 if the message flag of the buffer is set
+ */
+
+ssize_t gresb_rx_buf_fill(struct gresb_rx_buf *rb, int fd)
+{
+	ssize_t n;
+
+
+	if (!rb)
+		return -1;
+
+	if (rb->msg)
+		return gresb_rx_buf_fill_msg(rb, fd);
+
+	if (rb->tail == rb->size) {
+		if (gresb_rx_buf_make_room(rb)) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		/* a complete packet is still pending */
+		if (rb->tail == rb->size) {
+			errno = ENOBUFS;
+			return -1;
+		}
+	}
+
+	do {
+		n = recv(fd, &rb->buf[rb->tail], rb->size - rb->tail, 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (n > 0)
+		rb->tail += n;
+
+	return n;
+}
+
+
+/**
+ * @brief get the next complete packet in a streaming receive buffer
+ *
+ * @param rb the receive buffer
+ * @param[out] len the total size of the packet, including the header
+ *
+ * @returns a reference to the packet in the buffer or NULL if no complete
+ *	    packet is available
+ *
+ * @note the packet is not consumed, call gresb_rx_buf_pop_pkt() when done;
+ *	 the reference is valid until the next call to gresb_rx_buf_fill()
+ */
+
+uint8_t *gresb_rx_buf_peek_pkt(struct gresb_rx_buf *rb, size_t *len)
+{
+	size_t n;
+
+
+	if (!rb)
+		return NULL;
+
+	n = rb->tail - rb->head;
+
+	if (n < GRESB_PKT_HDR_SIZE)
+		return NULL;
+
+	if (gresb_pkt_get_size(&rb->buf[rb->head]) > n)
+		return NULL;
+
+	(*len) = gresb_pkt_get_size(&rb->buf[rb->head]);
+
+	return &rb->buf[rb->head];
+}
+
+
+/**
+ * @brief consume the next complete packet in a streaming receive buffer
+ */
+
+void gresb_rx_buf_pop_pkt(struct gresb_rx_buf *rb)
+{
+	size_t len;
+
+
+	if (!gresb_rx_buf_peek_pkt(rb, &len))
+		return;
+
+	rb->head += len;
+
+	if (rb->head == rb->tail) {
+		rb->head = 0;
+		rb->tail = 0;
+	}
+}
+
+
+/**
+ * @brief initialise a transmit queue
+ *
+ * @param q the transmit queue
+ * @param size the size of the queue in bytes, 0 for default
+ * @param rec_max the maximum number of packets in the queue, 0 for default
+ * @param dgram if set, packets are sent as individual messages
+ *
+ * @returns 0 on success, -1 on error
+ */
+
+int gresb_txq_init(struct gresb_txq *q, size_t size, size_t rec_max, int dgram)
+{
+	if (!q)
+		return -1;
+
+	if (!size)
+		size = GRESB_TXQ_SIZE;
+
+	if (!rec_max)
+		rec_max = GRESB_TXQ_RECORDS;
+
+	memset(q, 0, sizeof(struct gresb_txq));
+
+	q->buf = malloc(size);
+	q->rec = malloc(rec_max * sizeof(uint32_t));
+
+	if (!q->buf || !q->rec) {
+		free(q->buf);
+		free(q->rec);
+		return -1;
+	}
+
+	q->size    = size;
+	q->rec_max = rec_max;
+	q->dgram   = dgram;
+
+	return 0;
+}
+
+
+/**
+ * @brief release the memory of a transmit queue
+ */
+
+void gresb_txq_free(struct gresb_txq *q)
+{
+	if (!q)
+		return;
+
+	free(q->buf);
+	free(q->rec);
+
+	memset(q, 0, sizeof(struct gresb_txq));
+}
+
+
+/**
+ * @brief check if a packet can be added to a transmit queue
+ *
+ * @returns 1 if the packet fits, 0 otherwise
+ *
+ * @note a packet larger than the queue fits if the queue is empty
+ */
+
+int gresb_txq_fits(const struct gresb_txq *q, size_t len)
+{
+	if (!q)
+		return 0;
+
+	if (q->rec_cnt == q->rec_max)
+		return 0;
+
+	if (!q->used)
+		return 1;
+
+	return (q->size - q->used >= len);
+}
+
+
+/**
+ * @brief add a packet to a transmit queue
+ *
+ * @returns 0 on success, -1 if the queue is full
+ *
+ * @note if a packet is larger than the queue, the queue is enlarged
+ *	 once it is empty
+ */
+
+int gresb_txq_put(struct gresb_txq *q, const uint8_t *data, size_t len)
+{
+	size_t wr;
+	size_t n;
+
+	uint8_t *buf;
+
+
+	if (!gresb_txq_fits(q, len))
+		return -1;
+
+	if (len > q->size) {
+		buf = realloc(q->buf, len);
+		if (!buf)
+			return -1;
+
+		q->buf  = buf;
+		q->size = len;
+		q->head = 0;
+	}
+
+	wr = (q->head + q->used) % q->size;
+
+	/* may wrap */
+	n = q->size - wr;
+	if (n > len)
+		n = len;
+
+	memcpy(&q->buf[wr], data, n);
+	memcpy(q->buf, &data[n], len - n);
+
+	q->used += len;
+
+	q->rec[(q->rec_head + q->rec_cnt) % q->rec_max] = len;
+	q->rec_cnt++;
+
+	return 0;
+}
+
+
+/**
+ * @brief drop the oldest packet from a transmit queue
+ *
+ * @returns 0 on success, -1 if there is no packet that can be dropped
+ *
+ * @note a packet that was partially sent on a stream socket is kept,
+ *	 as the receiver would otherwise lose the packet framing
+ */
+
+int gresb_txq_drop(struct gresb_txq *q)
+{
+	size_t len;
+
+
+	if (!q)
+		return -1;
+
+	if (!q->rec_cnt)
+		return -1;
+
+	if (q->rec_sent)
+		return -1;
+
+	len = q->rec[q->rec_head];
+
+	q->head  = (q->head + len) % q->size;
+	q->used -= len;
+
+	q->rec_head = (q->rec_head + 1) % q->rec_max;
+	q->rec_cnt--;
+
+	if (!q->used)
+		q->head = 0;
+
+	return 0;
+}
+
+
+/**
+ * @brief remove sent bytes from a transmit queue
+ */
+
+static void gresb_txq_consume(struct gresb_txq *q, size_t n)
+{
+	size_t left;
+
+
+	q->head  = (q->head + n) % q->size;
+	q->used -= n;
+
+	while (n) {
+
+		left = q->rec[q->rec_head] - q->rec_sent;
+
+		if (n < left) {
+			q->rec_sent += n;
+			break;
+		}
+
+		n -= left;
+
+		q->rec_sent = 0;
+		q->rec_head = (q->rec_head + 1) % q->rec_max;
+		q->rec_cnt--;
+	}
+
+	if (!q->used)
+		q->head = 0;
+}
+
+
+/**
+ * @brief fill a vector with a range of the queue
+ *
+ * @returns the number of vector elements used (1 or 2)
+ */
+
+static int gresb_txq_iov(struct gresb_txq *q, size_t off, size_t len,
+			 struct iovec *iov)
+{
+	size_t pos;
+
+
+	pos = (q->head + off) % q->size;
+
+	iov[0].iov_base = &q->buf[pos];
+
+	if (q->size - pos >= len) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+
+	iov[0].iov_len  = q->size - pos;
+	iov[1].iov_base = q->buf;
+	iov[1].iov_len  = len - iov[0].iov_len;
+
+	return 2;
+}
+
+
+/**
+ * @brief send queued data on a stream socket in a single gathered write
+ */
+
+static ssize_t gresb_txq_flush_stream(struct gresb_txq *q, int fd)
+{
+	int cnt;
+	ssize_t n;
+
+	struct iovec iov[2];
+	struct msghdr msg;
+
+
+	cnt = gresb_txq_iov(q, 0, q->used, iov);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = cnt;
+
+	do {
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+
+	if (n > 0)
+		gresb_txq_consume(q, n);
+
+	return n;
+}
+
+
+/**
+ * @brief send queued packets as messages on a datagram socket
+ */
+
+static ssize_t gresb_txq_flush_dgram(struct gresb_txq *q, int fd)
+{
+	int i;
+	int cnt;
+	int ret;
+	size_t off = 0;
+	ssize_t n = 0;
+
+	struct iovec iov[GRESB_TXQ_BATCH][2];
+	struct mmsghdr msg[GRESB_TXQ_BATCH];
+
+
+	/* datagrams are never partially sent */
+	cnt = q->rec_cnt;
+	if (cnt > GRESB_TXQ_BATCH)
+		cnt = GRESB_TXQ_BATCH;
+
+	memset(msg, 0, sizeof(msg));
+
+	for (i = 0; i < cnt; i++) {
+		msg[i].msg_hdr.msg_iov    = iov[i];
+		msg[i].msg_hdr.msg_iovlen = gresb_txq_iov(q, off,
+							  q->rec[(q->rec_head + i) % q->rec_max],
+							  iov[i]);
+
+		off += q->rec[(q->rec_head + i) % q->rec_max];
+	}
+
+	do {
+		ret = sendmmsg(fd, msg, cnt, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < ret; i++)
+		n += msg[i].msg_len;
+
+	gresb_txq_consume(q, n);
+
+	return n;
+}
+
+
+/**
+ * @brief send as much of the queued data as the socket accepts
+ *
+ * @param q the transmit queue
+ * @param fd the socket to send on
+ *
+ * @returns the number of bytes sent, -1 on error (errno is EAGAIN or
+ *	    EWOULDBLOCK if the socket cannot take more data)
+ *
+ * @note this does not block; stream sockets are written with a single
+ *	 gathered write, datagram sockets with up to GRESB_TXQ_BATCH
+ *	 messages per call
+ */
+
+ssize_t gresb_txq_flush(struct gresb_txq *q, int fd)
+{
+	if (!q)
+		return -1;
+
+	if (!q->used)
+		return 0;
+
+	if (q->dgram)
+		return gresb_txq_flush_dgram(q, fd);
+
+	return gresb_txq_flush_stream(q, fd);
+}
+
+
+
+/* pcap file format, nanosecond timestamps */
+#define PCAP_MAGIC_NSEC		0xA1B23C4D
+#define PCAP_VERSION_MAJOR	2
+#define PCAP_VERSION_MINOR	4
+#define PCAP_DLT_USER0		147
+
+#define PCAP_IDLE_NS		1000000	/* writer poll period when idle */
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t  thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* the ring holds the records exactly as they are written to file,
+ * head and tail are free running, head is owned by the producer,
+ * tail by the writer thread
+ */
+struct gresb_pcap {
+	int fd;
+
+	uint8_t *ring;
+	size_t size;
+	size_t head;
+	size_t tail;
+
+	int stop;
+	unsigned long dropped;
+
+	pthread_t thread;
+};
+
+
+/**
+ * @brief the capture writer thread
+ */
+
+static void *gresb_pcap_writer(void *data)
+{
+	int stop;
+	size_t head;
+	size_t tail;
+	size_t pos;
+	size_t n;
+	ssize_t ret;
+
+	struct gresb_pcap *cap;
+	struct timespec idle = {0, PCAP_IDLE_NS};
+
+
+	cap = (struct gresb_pcap *) data;
+
+	while (1) {
+
+		/* load the stop flag first, so we see all records
+		 * added before the capture was closed
+		 */
+		stop = __atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&cap->head, __ATOMIC_ACQUIRE);
+		tail = cap->tail;
+
+		if (head == tail) {
+			if (stop)
+				break;
+
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		/* up to the end of the ring, the rest on the next pass */
+		pos = tail & (cap->size - 1);
+		n   = head - tail;
+		if (n > cap->size - pos)
+			n = cap->size - pos;
+
+		ret = write(cap->fd, &cap->ring[pos], n);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("pcap write");
+			ret = n;	/* discard */
+		}
+
+		__atomic_store_n(&cap->tail, tail + ret, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @brief open a capture file and start the writer thread
+ *
+ * @param path the file to write
+ * @param ring_size the size of the capture ring in bytes, 0 for default;
+ *	  rounded up to a power of two
+ *
+ * @returns the capture or NULL on error
+ */
+
+struct gresb_pcap *gresb_pcap_open(const char *path, size_t ring_size)
+{
+	size_t size = 1;
+
+	struct gresb_pcap *cap;
+	struct pcap_file_hdr fh;
+
+
+	if (!ring_size)
+		ring_size = GRESB_PCAP_RING_SIZE;
+
+	while (size < ring_size)
+		size <<= 1;
+
+	cap = (struct gresb_pcap *) calloc(1, sizeof(struct gresb_pcap));
+	if (!cap)
+		return NULL;
+
+	cap->ring = malloc(size);
+	if (!cap->ring)
+		goto error;
+
+	cap->size = size;
+
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cap->fd < 0)
+		goto error;
+
+	fh.magic         = PCAP_MAGIC_NSEC;
+	fh.version_major = PCAP_VERSION_MAJOR;
+	fh.version_minor = PCAP_VERSION_MINOR;
+	fh.thiszone      = 0;
+	fh.sigfigs       = 0;
+	fh.snaplen       = GRESB_PCAP_SNAPLEN;
+	fh.linktype      = PCAP_DLT_USER0;
+
+	if (write(cap->fd, &fh, sizeof(fh)) != sizeof(fh))
+		goto error_close;
+
+	if (pthread_create(&cap->thread, NULL, gresb_pcap_writer, cap))
+		goto error_close;
+
+	return cap;
+
+error_close:
+	close(cap->fd);
+error:
+	free(cap->ring);
+	free(cap);
+
+	return NULL;
+}
+
+
+/**
+ * @brief write the pending records and close a capture file
+ */
+
+void gresb_pcap_close(struct gresb_pcap *cap)
+{
+	if (!cap)
+		return;
+
+	__atomic_store_n(&cap->stop, 1, __ATOMIC_RELEASE);
+
+	pthread_join(cap->thread, NULL);
+
+	close(cap->fd);
+	free(cap->ring);
+	free(cap);
+}
+
+
+/**
+ * @brief copy data into the capture ring
+ */
+
+static void gresb_pcap_copy(struct gresb_pcap *cap, size_t head,
+			    const void *data, size_t len)
+{
+	size_t pos;
+	size_t n;
+
+
+	pos = head & (cap->size - 1);
+
+	n = cap->size - pos;
+	if (n > len)
+		n = len;
+
+	memcpy(&cap->ring[pos], data, n);
+	memcpy(cap->ring, (const uint8_t *) data + n, len - n);
+}
+
+
+/**
+ * @brief add a packet to a capture
+ *
+ * @param link the GRESB virtual link
+ * @param dir the direction, GRESB_PCAP_TO_SPW or GRESB_PCAP_FROM_SPW
+ * @param data the SpW data of the packet
+ * @param len the size of the SpW data
+ *
+ * @returns 0 on success, -1 if the packet was dropped
+ *
+ * @note this does not block and must only be called from a single thread;
+ *	 if the ring is full, the packet is dropped; packets exceeding the
+ *	 snap length are truncated
+ */
+
+int gresb_pcap_write(struct gresb_pcap *cap, uint8_t link, uint8_t dir,
+		     const uint8_t *data, size_t len)
+{
+	size_t n;
+	size_t rec;
+	size_t head;
+	size_t tail;
+
+	struct timespec ts;
+	struct pcap_rec_hdr rh;
+	struct gresb_pcap_spw_hdr sh;
+
+
+	if (!cap)
+		return -1;
+
+	n = len;
+	if (n > GRESB_PCAP_SNAPLEN - sizeof(sh))
+		n = GRESB_PCAP_SNAPLEN - sizeof(sh);
+
+	rec = sizeof(rh) + sizeof(sh) + n;
+
+	head = cap->head;
+	tail = __atomic_load_n(&cap->tail, __ATOMIC_ACQUIRE);
+
+	if (cap->size - (head - tail) < rec) {
+		__atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	rh.ts_sec   = ts.tv_sec;
+	rh.ts_nsec  = ts.tv_nsec;
+	rh.incl_len = sizeof(sh) + n;
+	rh.orig_len = sizeof(sh) + len;
+
+	sh.dir      = dir;
+	sh.link     = link;
+	sh.reserved = 0;
+
+	gresb_pcap_copy(cap, head, &rh, sizeof(rh));
+	gresb_pcap_copy(cap, head + sizeof(rh), &sh, sizeof(sh));
+	gresb_pcap_copy(cap, head + sizeof(rh) + sizeof(sh), data, n);
+
+	__atomic_store_n(&cap->head, head + rec, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/**
+ * @brief get the number of packets dropped from a capture
+ */
+
+unsigned long gresb_pcap_dropped(struct gresb_pcap *cap)
+{
+	if (!cap)
+		return 0;
+
+	return __atomic_load_n(&cap->dropped, __ATOMIC_RELAXED);
+}
@@ -20,6 +20,8 @@
 #define GRESB_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 
 /**
@@ -46,6 +48,9 @@
 #define GRESB_SPW_DATA_MAX_SIZE	0x8000000
 #define GRESB_PKT_SIZE_MAX	(GRESB_SPW_DATA_MAX_SIZE + GRESB_SNIFF_HDR_SIZE)
 
+/* the size of the header of host-to-gresb and gresb-to-host packets */
+#define GRESB_PKT_HDR_SIZE	4
+
 
 /**
  * host to GRESB protocol ids
@@ -91,9 +96,53 @@ struct gresb_to_host_pkt {
 }__attribute__((packed));
 
 
+/**
+ * streaming receive buffer, frames packets across arbitrary
+ * segment boundaries of a stream socket; on message based sockets,
+ * (see gresb_sock_is_msg()), each message holds one packet
+ */
+
+#define GRESB_RX_BUF_SIZE	0x10000	/* default initial size */
+
+struct gresb_rx_buf {
+	uint8_t *buf;
+	size_t size;	/* allocated size */
+	size_t head;	/* start of unconsumed data */
+	size_t tail;	/* end of valid data */
+	int msg;	/* set if the socket preserves message boundaries */
+};
+
+
+/**
+ * transmit queue, accumulates packets in a byte ring for batched
+ * transmission; record boundaries are kept so packets can be sent
+ * as individual messages on datagram sockets
+ */
+
+#define GRESB_TXQ_SIZE		0x40000	/* default size in bytes */
+#define GRESB_TXQ_RECORDS	1024	/* default max. number of packets */
+#define GRESB_TXQ_BATCH		64	/* max. packets per flush syscall */
+
+struct gresb_txq {
+	uint8_t *buf;
+	size_t size;
+	size_t head;		/* start of unsent data */
+	size_t used;		/* bytes in queue */
+
+	uint32_t *rec;		/* packet sizes */
+	size_t rec_max;
+	size_t rec_head;
+	size_t rec_cnt;
+	size_t rec_sent;	/* bytes of the head packet already sent */
+
+	int dgram;		/* send packets as messages */
+};
+
+
 
 uint8_t *gresb_create_host_data_pkt(const uint8_t *data, uint32_t len);
 void gresb_destroy_host_data_pkt(struct host_to_gresb_pkt *pkt);
+int gresb_set_host_data_pkt_hdr(uint8_t *buf, uint32_t len);
 size_t gresb_get_host_data_pkt_size(uint8_t *buf);
 
 const uint8_t *gresb_get_spw_data(const uint8_t *buf);
@@ -106,4 +155,50 @@ uint8_t gresb_get_spw_pkt_eeop(uint8_t *buf);
 int gresb_get_virtual_link_tx_port(unsigned int link);
 int gresb_get_virtual_link_rx_port(unsigned int link);
 
+/**
+ * packet capture in pcap format; packets are added to a lock-free ring
+ * by a single producer and written to file by a background thread
+ *
+ * The link type is DLT_USER0, each packet is preceded by a 4 byte
+ * SpaceWire pseudo header, followed by the SpW data, starting with the
+ * logical address. Timestamps have nanosecond resolution.
+ */
+
+#define GRESB_PCAP_RING_SIZE	0x400000	/* default, power of two */
+#define GRESB_PCAP_SNAPLEN	0x40000
+
+#define GRESB_PCAP_TO_SPW	0	/* host to GRESB */
+#define GRESB_PCAP_FROM_SPW	1	/* GRESB to host */
+
+struct gresb_pcap_spw_hdr {
+	uint8_t dir;		/* GRESB_PCAP_TO_SPW or GRESB_PCAP_FROM_SPW */
+	uint8_t link;		/* GRESB virtual link */
+	uint16_t reserved;
+}__attribute__((packed));
+
+struct gresb_pcap;
+
+struct gresb_pcap *gresb_pcap_open(const char *path, size_t ring_size);
+void gresb_pcap_close(struct gresb_pcap *cap);
+int gresb_pcap_write(struct gresb_pcap *cap, uint8_t link, uint8_t dir,
+		     const uint8_t *data, size_t len);
+unsigned long gresb_pcap_dropped(struct gresb_pcap *cap);
+
+int gresb_unix_listen(const char *path);
+int gresb_unix_connect(const char *path);
+int gresb_sock_is_msg(int fd);
+
+int gresb_rx_buf_init(struct gresb_rx_buf *rb, size_t size);
+void gresb_rx_buf_free(struct gresb_rx_buf *rb);
+ssize_t gresb_rx_buf_fill(struct gresb_rx_buf *rb, int fd);
+uint8_t *gresb_rx_buf_peek_pkt(struct gresb_rx_buf *rb, size_t *len);
+void gresb_rx_buf_pop_pkt(struct gresb_rx_buf *rb);
+
+int gresb_txq_init(struct gresb_txq *q, size_t size, size_t rec_max, int dgram);
+void gresb_txq_free(struct gresb_txq *q);
+int gresb_txq_fits(const struct gresb_txq *q, size_t len);
+int gresb_txq_put(struct gresb_txq *q, const uint8_t *data, size_t len);
+int gresb_txq_drop(struct gresb_txq *q);
+ssize_t gresb_txq_flush(struct gresb_txq *q, int fd);
+
 #endif /* GRESB_H */
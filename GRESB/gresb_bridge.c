@@ -3,16 +3,18 @@
 #include <string.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <linux/tcp.h>
 
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <netdb.h>
-#include <pthread.h>
 
 #include <gresb.h>
 
@@ -21,61 +23,163 @@
 #define DEFAULT_PORT 1234
 #define DEFAULT_ADDR "0.0.0.0"
 
+#define BRIDGE_EPOLL_EVENTS	16
+
+#define DEFAULT_LATENCY_US	0	/* flush when the GRESB link is drained */
+
+#define BRIDGE_LINKS		(GRESB_VLINK_MAX + 1)
+#define BRIDGE_POOL_BUFS	16	/* max. idle receive buffers kept */
+
+#define BRIDGE_LAT_BUCKETS	21	/* log2 usec, last is >= 2^19 usec */
+
+/* the counters may be read while the bridge is running */
+#define STAT_ADD(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_GET(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+
+/* connection types */
+enum conn_type {CONN_LISTEN, CONN_USER, CONN_GRESB, CONN_STATS};
+
+struct bridge_link;
+
+struct bridge_conn_stats {
+	unsigned long rx_pkts;		/* received from the peer */
+	unsigned long rx_bytes;
+	unsigned long tx_pkts;		/* queued for the peer */
+	unsigned long tx_bytes;
+	unsigned long syscalls;		/* send and receive calls */
+	unsigned long q_peak;		/* max. bytes in the send queue */
+};
+
+struct bridge_link_stats {
+	unsigned long to_spw_pkts;
+	unsigned long to_spw_bytes;
+	unsigned long from_spw_pkts;
+	unsigned long from_spw_bytes;
+	unsigned long pauses;		/* GRESB link paused by a user queue */
+	unsigned long usr_pauses;	/* user paused by the GRESB TX queue */
+
+	/* time from queuing a batch for a user until it was sent */
+	unsigned long latency[BRIDGE_LAT_BUCKETS];
+};
+
+struct bridge_conn {
+
+	int fd;
+	enum conn_type type;
+	struct bridge_link *link;
+
+	/* packet reassembly across segment boundaries; in raw mode,
+	 * user data is received in place behind a host-to-gresb header;
+	 * the buffer is taken from the pool while data is pending
+	 */
+	struct gresb_rx_buf rx;
+
+	/* packets accumulated for a user connection, flushed in batches,
+	 * or for the TX port of the GRESB
+	 */
+	struct gresb_txq tx;
+	struct timespec tx_first;	/* time the oldest packet was queued */
+	int tx_wait;			/* send buffer full, wait for EPOLLOUT */
+
+	int monitor;		/* read-only tap, drops packets if too slow */
+	uint32_t dropped;	/* packets dropped on a monitor connection */
+
+	int paused;		/* not read, the queue it feeds is full */
+
+	struct bridge_conn_stats stats;
+
+	int dead;		/* closed, release after event batch */
+	struct bridge_conn *next;
+};
+
+
+/* a GRESB virtual link and its users */
+struct bridge_link {
+
+	unsigned int id;
+
+	struct bridge_conn *listen;	/* server socket, if any */
+	struct bridge_conn *monitor;	/* monitor server socket, if any */
+	struct bridge_conn *gresb_tx;
+	struct bridge_conn *gresb_rx;
+	struct bridge_conn *usr;	/* user connections */
+
+	int resume;		/* queues drained, resume paused connections */
+
+	struct bridge_link_stats stats;
+};
+
+
+/* receive buffers shared by the connections of all links */
+struct bridge_pool {
+	uint8_t *buf[BRIDGE_POOL_BUFS];
+	size_t cnt;
+};
+
 
 struct bridge_cfg {
 
-	int socket;
+	int epoll_fd;
+
+	struct bridge_link link[BRIDGE_LINKS];
+	unsigned int n_links;
 
-	int n_fd;
-	fd_set set;
+	struct bridge_conn *dead;	/* closed connections */
 
-	pthread_t thread_accept;
-	pthread_t thread_poll;
+	struct bridge_pool pool;
 
-	struct bridge_cfg *bridge;
-	struct bridge_cfg *gresb_tx;
-	struct bridge_cfg *gresb_rx;
+	struct bridge_conn *stats;	/* stats server socket, if any */
 
 	int  raw;	/* if set, use raw bytes on user ports,
 			 * otherwise we expect gresb packet format
 			 */
+
+	long latency_us;	/* max. time packets are held for batching */
+
+	const char *unix_path;	/* if set, user ports are local packet sockets */
+
+	struct gresb_pcap *pcap;	/* if set, capture forwarded packets */
 };
 
 
+static volatile sig_atomic_t bridge_stop;
+static volatile sig_atomic_t bridge_dump;
+
 
 /**
- * @brief a sigint handler, should we ever need it
+ * @brief a sigint handler, stops the event loop
  */
 
 static void sigint_handler(__attribute__((unused)) int s)
 {
-	printf("\nCaught signal %d\n", s);
+	bridge_stop = 1;
 }
 
 
 /**
- * @brief transmits the contents of a buffer from a socket to its peer
+ * @brief a sigusr1 handler, requests a dump of the counters
  */
 
-static int send_all(int sock_fd, const unsigned char *buf, int len)
+static void sigusr1_handler(__attribute__((unused)) int s)
 {
-	int n;
+	bridge_dump = 1;
+}
 
 
-	while (len) {
+/**
+ * @brief get the time elapsed since a point in time in microseconds
+ */
 
-		n = send(sock_fd, buf, len, 0);
+static long elapsed_us(const struct timespec *t0)
+{
+	struct timespec t;
 
-		if (n == -1) {
-			perror("send_all");
-			return len;
-		}
 
-		len -= n;
-		buf += n;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &t);
 
-	return len;
+	return (t.tv_sec - t0->tv_sec) * 1000000L
+		+ (t.tv_nsec - t0->tv_nsec) / 1000L;
 }
 
 
@@ -104,404 +208,1304 @@ static struct sockaddr_in sockaddr_from_url(const char *url)
 	sockaddr.sin_family = AF_INET;
 	sockaddr.sin_port = htons(atoi(strtok(NULL, ":")));
 
-	free(str);
+	free(str);
+
+	return sockaddr;
+}
+
+
+/**
+ * @brief set a socket to non-blocking mode and disable Nagle's algorithm
+ */
+
+static void set_nonblock_nodelay(int fd)
+{
+	int flag = 1;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(int));
+}
+
+
+/**
+ * @brief attach a receive buffer from the pool to a connection
+ *
+ * @returns 0 on success, -1 on error
+ */
+
+static int conn_rx_attach(struct bridge_cfg *cfg, struct bridge_conn *conn)
+{
+	struct bridge_pool *pool = &cfg->pool;
+
+
+	if (conn->rx.buf)
+		return 0;
+
+	if (pool->cnt) {
+		conn->rx.buf = pool->buf[--pool->cnt];
+	} else {
+		conn->rx.buf = malloc(GRESB_RX_BUF_SIZE);
+		if (!conn->rx.buf)
+			return -1;
+	}
+
+	conn->rx.size = GRESB_RX_BUF_SIZE;
+	conn->rx.head = 0;
+	conn->rx.tail = 0;
+
+	return 0;
+}
+
+
+/**
+ * @brief return the receive buffer of a connection to the pool
+ *
+ * @param force release the buffer even if it holds unconsumed data
+ *
+ * @note buffers that were grown for a large packet are freed
+ */
+
+static void conn_rx_release(struct bridge_cfg *cfg, struct bridge_conn *conn,
+			    int force)
+{
+	struct bridge_pool *pool = &cfg->pool;
+
+
+	if (!conn->rx.buf)
+		return;
+
+	if (!force && conn->rx.head != conn->rx.tail)
+		return;
+
+	if (conn->rx.size == GRESB_RX_BUF_SIZE && pool->cnt < BRIDGE_POOL_BUFS) {
+		pool->buf[pool->cnt++] = conn->rx.buf;
+		conn->rx.buf = NULL;
+	}
+
+	gresb_rx_buf_free(&conn->rx);
+}
+
+
+/**
+ * @brief release the buffers in the pool
+ */
+
+static void bridge_pool_free(struct bridge_cfg *cfg)
+{
+	while (cfg->pool.cnt)
+		free(cfg->pool.buf[--cfg->pool.cnt]);
+}
+
+
+/**
+ * @brief create a connection and add it to the event loop
+ *
+ * @returns the connection or NULL on error
+ */
+
+static struct bridge_conn *conn_add(struct bridge_cfg *cfg,
+				    struct bridge_link *link,
+				    int fd, enum conn_type type)
+{
+	struct bridge_conn *conn;
+	struct epoll_event ev;
+
+
+	conn = (struct bridge_conn *) calloc(1, sizeof(struct bridge_conn));
+	if (!conn) {
+		perror("calloc");
+		return NULL;
+	}
+
+	conn->fd    = fd;
+	conn->type  = type;
+	conn->link  = link;
+
+	if (type == CONN_USER) {
+
+		/* one packet per message on local packet sockets */
+		conn->rx.msg = gresb_sock_is_msg(fd);
+
+		if (gresb_txq_init(&conn->tx, GRESB_TXQ_SIZE,
+				   GRESB_TXQ_RECORDS, conn->rx.msg)) {
+			perror("gresb_txq_init");
+			free(conn);
+			return NULL;
+		}
+	}
+
+	/* user and GRESB connections are also notified when their send
+	 * buffer has space again, so their queues are drained by the
+	 * event loop
+	 */
+	ev.events   = EPOLLIN | EPOLLET;
+	if (type == CONN_USER || type == CONN_GRESB)
+		ev.events |= EPOLLOUT;
+
+	ev.data.ptr = conn;
+
+	if (epoll_ctl(cfg->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		gresb_txq_free(&conn->tx);
+		free(conn);
+		return NULL;
+	}
+
+	if (type == CONN_USER) {
+		conn->next = link->usr;
+		link->usr  = conn;
+	}
+
+	return conn;
+}
+
+
+/**
+ * @brief remove a connection from the event loop and close it
+ *
+ * @note the connection is released by conn_release_dead(), as there may
+ *	 be further events pending for it in the current batch
+ */
+
+static void conn_close(struct bridge_cfg *cfg, struct bridge_conn *conn)
+{
+	struct bridge_conn **p;
+
+
+	if (!conn)
+		return;
+
+	if (conn->dead)
+		return;
+
+	epoll_ctl(cfg->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+
+	if (conn->monitor)
+		printf("Monitor dropped %u packets\n", conn->dropped);
+
+	/* the stats socket belongs to no link */
+	if (!conn->link)
+		goto dead;
+
+	/* a paused link may have been waiting for this connection */
+	conn->link->resume = 1;
+
+	for (p = &conn->link->usr; (*p); p = &(*p)->next) {
+		if ((*p) == conn) {
+			(*p) = conn->next;
+			break;
+		}
+	}
+
+dead:
+	conn->dead = 1;
+	conn->next = cfg->dead;
+	cfg->dead  = conn;
+}
+
+
+/**
+ * @brief release closed connections
+ */
+
+static void conn_release_dead(struct bridge_cfg *cfg)
+{
+	struct bridge_conn *conn;
+
+
+	while (cfg->dead) {
+		conn      = cfg->dead;
+		cfg->dead = conn->next;
+
+		conn_rx_release(cfg, conn, 1);
+		gresb_txq_free(&conn->tx);
+		free(conn);
+	}
+}
+
+
+/**
+ * @brief establish a client socket connection
+ */
+
+static int connect_client_socket(const char *url)
+{
+	int fd;
+	int ret;
+
+	struct sockaddr_in server;
+
+
+	server = sockaddr_from_url(url);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return fd;
+
+	ret = connect(fd, (struct sockaddr *) &server, sizeof(server));
+	if (ret < 0) {
+		close(fd);
+		return ret;
+	}
+
+	set_nonblock_nodelay(fd);
+
+	return fd;
+}
+
+
+/**
+ * @brief bind a socket for a listening server
+ *
+ * @note url expected to be <ip>:<port>
+ */
+
+static int bind_server_socket(const char* url)
+{
+	int fd;
+	int endpoint;
+	int optval = 1;
+
+	struct sockaddr_in server;
+
+
+	server = sockaddr_from_url(url);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		printf("Socket creation failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	endpoint = bind(fd, (struct sockaddr *) &server, sizeof(server));
+	if (endpoint < 0) {
+		close(fd);
+		printf("could not bind endpoint %s: %s\n", url, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (listen(fd, 0) < 0) {
+		close(fd);
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Listening on %s\n", url);
+
+	return fd;
+}
+
+
+/**
+ * @brief accept all pending incoming connections on a server socket
+ *
+ * @note connections accepted on the monitor socket are read-only taps
+ */
+
+static void accept_connections(struct bridge_cfg *cfg,
+			       struct bridge_conn *srv)
+{
+	struct bridge_conn *conn;
+
+	int fd;
+
+	struct sockaddr_storage client_addr;
+
+	socklen_t client_addr_len;
+
+
+	while (1) {
+
+		client_addr_len = sizeof(client_addr);
+
+		fd = accept(srv->fd, (struct sockaddr *) &client_addr,
+			    &client_addr_len);
+
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			perror("accept");
+			exit(EXIT_FAILURE);
+		}
+
+		set_nonblock_nodelay(fd);
+
+		conn = conn_add(cfg, srv->link, fd, CONN_USER);
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+
+		conn->monitor = (srv == srv->link->monitor);
+
+		if (conn->monitor)
+			printf("New incoming monitor connection on link %u\n",
+			       srv->link->id);
+		else
+			printf("New incoming connection on link %u\n",
+			       srv->link->id);
+	}
+}
+
+
+/**
+ * @brief send the packets queued for a connection
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note this does not block; if the send buffer of the socket is full,
+ *	 the remaining packets are sent when the event loop reports the
+ *	 socket as writable
+ */
+
+static int conn_flush(struct bridge_conn *conn)
+{
+	long us;
+	unsigned int i;
+
+
+	conn->tx_wait = 0;
+
+	if (!conn->tx.used)
+		return 0;
+
+	while (conn->tx.used) {
+
+		STAT_ADD(conn->stats.syscalls, 1);
+
+		if (gresb_txq_flush(&conn->tx, conn->fd) >= 0)
+			continue;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		conn->tx_wait = 1;
+		return 0;
+	}
+
+	/* the GRESB TX port is not batched */
+	if (conn->type != CONN_USER)
+		return 0;
+
+	/* the batch is out, account the time its oldest packet was held */
+	us = elapsed_us(&conn->tx_first);
+
+	for (i = 0; us > 0 && i < BRIDGE_LAT_BUCKETS - 1; i++)
+		us >>= 1;
+
+	STAT_ADD(conn->link->stats.latency[i], 1);
+
+	return 0;
+}
+
+
+/**
+ * @brief queue a packet for a connection
+ *
+ * @note if the queue of a monitor connection is full, the oldest packets
+ *	 are dropped; the caller must make sure that the packet fits into
+ *	 the queue of other connections
+ */
+
+static void conn_queue_pkt(struct bridge_conn *conn,
+			   const uint8_t *buf, size_t len)
+{
+	if (!conn->tx.used)
+		clock_gettime(CLOCK_MONOTONIC, &conn->tx_first);
+
+	if (conn->monitor) {
+		while (!gresb_txq_fits(&conn->tx, len)) {
+			if (gresb_txq_drop(&conn->tx))
+				break;
+			STAT_ADD(conn->dropped, 1);
+		}
+	}
+
+	if (gresb_txq_put(&conn->tx, buf, len)) {
+		STAT_ADD(conn->dropped, 1);
+		return;
+	}
+
+	STAT_ADD(conn->stats.tx_pkts, 1);
+	STAT_ADD(conn->stats.tx_bytes, len);
+
+	if (conn->tx.used > STAT_GET(conn->stats.q_peak))
+		__atomic_store_n(&conn->stats.q_peak, conn->tx.used,
+				 __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief queue a user packet for the GRESB
+ *
+ * @param buf a host-to-gresb packet
+ *
+ * @returns 0 on success, -1 if the packet does not fit into the queue of
+ *	    the TX port
+ *
+ * @note the queue is sent by bridge_flush_gresb(); if it is full, the
+ *	 caller pauses the user connection until it was drained
+ */
+
+static int usr_pkt_to_gresb(struct bridge_cfg *cfg, struct bridge_link *link,
+			    const uint8_t *buf, size_t len)
+{
+	/* we SEND to the TX port */
+	struct bridge_conn *conn = link->gresb_tx;
+
+
+#if DEBUG
+	{
+		printf("usr to GRESB [%lu]: ", len);
+		size_t i;
+		for (i = 0; i < len; i++)
+			printf("%02X:", buf[i]);
+		printf("\n");
+	}
+#endif
+
+	if (!gresb_txq_fits(&conn->tx, len)) {
+
+		/* errors are reported by bridge_flush_gresb() */
+		if (!conn->tx_wait)
+			conn_flush(conn);
+
+		if (!gresb_txq_fits(&conn->tx, len)) {
+			STAT_ADD(link->stats.usr_pauses, 1);
+			return -1;
+		}
+	}
+
+	gresb_pcap_write(cfg->pcap, link->id, GRESB_PCAP_TO_SPW,
+			 gresb_get_spw_data(buf), len - GRESB_PKT_HDR_SIZE);
+
+	STAT_ADD(link->stats.to_spw_pkts, 1);
+	STAT_ADD(link->stats.to_spw_bytes, len - GRESB_PKT_HDR_SIZE);
+
+	conn_queue_pkt(conn, buf, len);
+
+	return 0;
+}
+
+
+/**
+ * @brief flush the user connections whose packets are due
+ *
+ * @returns the time in milliseconds until the next connection is due,
+ *	    -1 if there are no pending packets
+ *
+ * @note with a latency cap of zero, all packets are flushed, i.e. they
+ *	 are batched only while data is pending on the GRESB link
+ */
+
+static int bridge_flush(struct bridge_cfg *cfg)
+{
+	long t;
+	long due = -1;
+	unsigned int i;
+
+	struct bridge_conn *conn;
+	struct bridge_conn *next;
+
+
+	for (i = 0; i < cfg->n_links; i++) {
+
+		for (conn = cfg->link[i].usr; conn; conn = next) {
+
+			next = conn->next;
+
+			if (!conn->tx.used)
+				continue;
+
+			if (conn->tx_wait)
+				continue;
+
+			t = cfg->latency_us - elapsed_us(&conn->tx_first);
+
+			if (t > 0) {
+				if (due < 0 || t < due)
+					due = t;
+				continue;
+			}
+
+			if (conn_flush(conn)) {
+				perror("send");
+				conn_close(cfg, conn);
+			}
+		}
+	}
+
+	if (due < 0)
+		return -1;
+
+	/* round up, so we don't wake before the packets are due */
+	return (int) ((due + 999) / 1000);
+}
+
+
+/**
+ * @brief send the user packets queued for the GRESB
+ *
+ * @returns 0 on success, -1 if the bridge cannot continue
+ *
+ * @note the uplink is flushed after every event batch, the latency cap
+ *	 does not apply
+ */
+
+static int bridge_flush_gresb(struct bridge_cfg *cfg)
+{
+	unsigned int i;
+
+	struct bridge_conn *conn;
+
+
+	for (i = 0; i < cfg->n_links; i++) {
+
+		conn = cfg->link[i].gresb_tx;
+
+		if (!conn->tx.used)
+			continue;
+
+		if (conn->tx_wait)
+			continue;
+
+		if (conn_flush(conn)) {
+			perror("send");
+			printf("GRESB connection lost on link %u\n",
+			       cfg->link[i].id);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#include <rmap.h>
+
+/**
+ * @brief forward a GRESB packet to all user connections of a link
+ *
+ * @param buf a gresb-to-host packet
+ *
+ * @returns 0 on success, -1 if the packet does not fit into the queue of
+ *	    a (non-monitor) user connection
+ *
+ * @note packets are queued per connection and sent in batches by
+ *	 bridge_flush()
+ */
+
+static int gresb_pkt_to_usr(struct bridge_cfg *cfg, struct bridge_link *link,
+			    uint8_t *buf, size_t len)
+{
+	uint8_t *pkt;
+
+	struct bridge_conn *conn;
+	struct bridge_conn *next;
+
+
+#if DEBUG
+	{
+		printf("GRESB to usr [%lu]: ",  gresb_get_spw_data_size(buf));
+		size_t i;
+		for (i = 0; i < gresb_get_spw_data_size(buf); i++)
+			printf("%02X:", gresb_get_spw_data(buf)[i]);
+		printf("\n");
+		rmap_parse_pkt((uint8_t *) gresb_get_spw_data(buf));
+	}
+#endif
+
+	pkt = buf;
+
+	if (cfg->raw) {
+		/* extract data */
+		len = gresb_get_spw_data_size(buf);
+		buf = (uint8_t *) gresb_get_spw_data(buf);
+	}
+
+	/* the link waits for the primary connections */
+	for (conn = link->usr; conn; conn = next) {
+
+		next = conn->next;
+
+		if (conn->monitor)
+			continue;
+
+		if (gresb_txq_fits(&conn->tx, len))
+			continue;
+
+		if (conn_flush(conn)) {
+			perror("send");
+			conn_close(cfg, conn);
+			continue;
+		}
+
+		if (!gresb_txq_fits(&conn->tx, len)) {
+			STAT_ADD(link->stats.pauses, 1);
+			return -1;
+		}
+	}
+
+	STAT_ADD(link->stats.from_spw_pkts, 1);
+	STAT_ADD(link->stats.from_spw_bytes, gresb_get_spw_data_size(pkt));
+
+	/* only once, the packet is offered again if the link was paused */
+	gresb_pcap_write(cfg->pcap, link->id, GRESB_PCAP_FROM_SPW,
+			 gresb_get_spw_data(pkt), gresb_get_spw_data_size(pkt));
+
+	for (conn = link->usr; conn; conn = conn->next)
+		conn_queue_pkt(conn, buf, len);
+
+	return 0;
+}
+
+
+/**
+ * @brief receive and discard data from a monitor connection
+ *
+ * @returns 0 when all pending data was read, -1 if the connection was
+ *	    closed or failed
+ */
+
+static int conn_recv_discard(struct bridge_cfg *cfg, struct bridge_conn *conn)
+{
+	ssize_t n;
+
+
+	if (conn_rx_attach(cfg, conn))
+		return -1;
+
+	do {
+		STAT_ADD(conn->stats.syscalls, 1);
+		n = recv(conn->fd, conn->rx.buf, conn->rx.size, 0);
+	} while (n > 0);
+
+	conn_rx_release(cfg, conn, 1);
+
+	if (!n)
+		return -1;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return 0;
+
+	return -1;
+}
+
+
+/**
+ * @brief receive GRESB-framed packets from a connection
+ *
+ * @returns 0 when all pending data was read, -1 if the connection was
+ *	    closed or failed
+ *
+ * @note the connection is edge-triggered, so we read until the socket
+ *	 would block; partial packets are kept in the receive buffer
+ *
+ * @note a GRESB connection is paused if a user connection cannot take
+ *	 more packets, a user connection if the GRESB TX port cannot; the
+ *	 data is then left in the socket
+ */
+
+static int conn_recv_pkts(struct bridge_cfg *cfg, struct bridge_conn *conn)
+{
+	int ret;
+	size_t len;
+	ssize_t n;
+	uint8_t *pkt;
+
+
+	if (conn_rx_attach(cfg, conn))
+		return -1;
+
+	while (1) {
+
+		while ((pkt = gresb_rx_buf_peek_pkt(&conn->rx, &len))) {
+
+			if (conn->type == CONN_USER)
+				ret = usr_pkt_to_gresb(cfg, conn->link, pkt, len);
+			else
+				ret = gresb_pkt_to_usr(cfg, conn->link, pkt, len);
+
+			if (ret) {
+				/* resumed by the event loop */
+				conn->paused = 1;
+				return 0;
+			}
+
+			STAT_ADD(conn->stats.rx_pkts, 1);
+			STAT_ADD(conn->stats.rx_bytes, len);
+
+			gresb_rx_buf_pop_pkt(&conn->rx);
+		}
+
+		STAT_ADD(conn->stats.syscalls, 1);
+
+		n = gresb_rx_buf_fill(&conn->rx, conn->fd);
+		if (n <= 0)
+			break;
+	}
+
+	if (!n)
+		return -1;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		/* idle connections hold no buffer */
+		conn_rx_release(cfg, conn, 0);
+		return 0;
+	}
+
+	return -1;
+}
+
+
+/**
+ * @brief receive raw data from a user connection
+ *
+ * @returns 0 when all pending data was read, -1 if the connection was
+ *	    closed or failed
+ *
+ * @note every chunk (or message) received is forwarded as a packet; the
+ *	 data is received behind the space for the host-to-gresb header,
+ *	 which is then filled in, so the packet is sent without copying
+ *
+ * @note the connection is paused if the GRESB TX port cannot take more
+ *	 packets, the packet is then kept in the receive buffer
+ */
+
+static int conn_recv_raw(struct bridge_cfg *cfg, struct bridge_conn *conn)
+{
+	ssize_t n;
+	uint8_t *buf;
+
+
+	if (conn_rx_attach(cfg, conn))
+		return -1;
+
+	while (1) {
+
+		/* a packet is pending, also if the connection was paused */
+		if (conn->rx.tail > GRESB_PKT_HDR_SIZE) {
+
+			if (usr_pkt_to_gresb(cfg, conn->link, conn->rx.buf,
+					     conn->rx.tail)) {
+				/* resumed by the event loop */
+				conn->paused = 1;
+				return 0;
+			}
+		}
+
+		conn->rx.head = 0;
+		conn->rx.tail = GRESB_PKT_HDR_SIZE;
+
+		STAT_ADD(conn->stats.syscalls, 1);
+
+		n = gresb_rx_buf_fill(&conn->rx, conn->fd);
+		if (n <= 0)
+			break;
+
+		STAT_ADD(conn->stats.rx_pkts, 1);
+		STAT_ADD(conn->stats.rx_bytes, n);
+
+		/* may have been enlarged for a message */
+		buf = conn->rx.buf;
+
+		gresb_set_host_data_pkt_hdr(buf, n);
+	}
+
+	conn_rx_release(cfg, conn, 1);
+
+	if (!n)
+		return -1;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+
+	return -1;
+}
+
+
+/**
+ * @brief print the counters of a connection
+ */
+
+static void conn_stats_show(const char *name, struct bridge_conn *conn, int fd)
+{
+	struct bridge_conn_stats *st = &conn->stats;
+
+
+	dprintf(fd, "  %-8s fd %3d: rx %lu pkts %lu bytes, tx %lu pkts %lu bytes, "
+		"syscalls %lu\n", name, conn->fd,
+		STAT_GET(st->rx_pkts), STAT_GET(st->rx_bytes),
+		STAT_GET(st->tx_pkts), STAT_GET(st->tx_bytes),
+		STAT_GET(st->syscalls));
+
+	if (!conn->tx.buf)
+		return;
+
+	dprintf(fd, "                   queued %lu pkts %lu bytes, peak %lu bytes, "
+		"dropped %u\n", (unsigned long) conn->tx.rec_cnt,
+		(unsigned long) conn->tx.used,
+		STAT_GET(st->q_peak), STAT_GET(conn->dropped));
+}
+
+
+/**
+ * @brief print the counters of all links and their connections
+ */
+
+static void bridge_stats_show(struct bridge_cfg *cfg, int fd)
+{
+	unsigned int i;
+	unsigned int j;
+
+	struct bridge_link *link;
+	struct bridge_conn *conn;
+	struct bridge_link_stats *st;
+
+
+	for (i = 0; i < cfg->n_links; i++) {
+
+		link = &cfg->link[i];
+		st   = &link->stats;
+
+		dprintf(fd, "link %u: to SpW %lu pkts %lu bytes, from SpW %lu pkts "
+			"%lu bytes, paused %lu times, users paused %lu times\n",
+			link->id,
+			STAT_GET(st->to_spw_pkts), STAT_GET(st->to_spw_bytes),
+			STAT_GET(st->from_spw_pkts), STAT_GET(st->from_spw_bytes),
+			STAT_GET(st->pauses), STAT_GET(st->usr_pauses));
+
+		conn_stats_show("GRESB TX", link->gresb_tx, fd);
+		conn_stats_show("GRESB RX", link->gresb_rx, fd);
+
+		for (conn = link->usr; conn; conn = conn->next)
+			conn_stats_show(conn->monitor ? "monitor" : "user",
+					conn, fd);
+
+		dprintf(fd, "  latency usec:");
+
+		for (j = 0; j < BRIDGE_LAT_BUCKETS; j++) {
+
+			if (!STAT_GET(st->latency[j]))
+				continue;
+
+			if (j == BRIDGE_LAT_BUCKETS - 1)
+				dprintf(fd, " >=%lu: %lu", 1UL << (j - 1),
+					STAT_GET(st->latency[j]));
+			else
+				dprintf(fd, " <%lu: %lu", 1UL << j,
+					STAT_GET(st->latency[j]));
+		}
 
-	return sockaddr;
+		dprintf(fd, "\n");
+	}
 }
 
 
 /**
- * @brief establish a client socket connection
+ * @brief send the counters to all pending connections on the stats socket
+ *
+ * @note the report is small, so it is written in one go and the
+ *	 connection is closed right away
  */
 
-static int connect_client_socket(const char *url, struct bridge_cfg *cfg)
+static void stats_connections(struct bridge_cfg *cfg, struct bridge_conn *srv)
 {
 	int fd;
-	int ret;
-
-	struct sockaddr_in server;
 
 
-	server = sockaddr_from_url(url);
+	while (1) {
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0)
-		return fd;
+		fd = accept(srv->fd, NULL, NULL);
 
-	ret = connect(fd, (struct sockaddr *) &server, sizeof(server));
-	if (ret < 0)
-		return ret;
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
 
-	FD_ZERO(&cfg->set);
-	FD_SET(fd, &cfg->set);
+			return;
+		}
 
-	/* update maximum file descriptor number */
-	if (fd > cfg->n_fd)
-		cfg->n_fd = fd;
+		bridge_stats_show(cfg, fd);
 
-	return fd;
+		close(fd);
+	}
 }
 
 
 /**
- * @brief bind a socket for a listening server
+ * @brief receive from a user connection
  *
- * @note url expected to be <ip>:<port>
+ * @returns 0 when all pending data was read, -1 if the connection was
+ *	    closed or failed
  */
 
-static int bind_server_socket(const char* url, struct bridge_cfg *cfg)
+static int conn_recv_usr(struct bridge_cfg *cfg, struct bridge_conn *conn)
 {
-	int fd;
-	int endpoint;
-	int optval = 1;
-
-	struct sockaddr_in server;
-
-
-	server = sockaddr_from_url(url);
+	if (conn->monitor)
+		return conn_recv_discard(cfg, conn);
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0) {
-		printf("Socket creation failed: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	if (cfg->raw)
+		return conn_recv_raw(cfg, conn);
 
-	FD_ZERO(&cfg->set);
+	return conn_recv_pkts(cfg, conn);
+}
 
-	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
-	endpoint = bind(fd, (struct sockaddr *) &server, sizeof(server));
-	if (endpoint < 0) {
-		close(fd);
-		printf("could not bind endpoint %s: %s\n", url, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+/**
+ * @brief close a user connection that was closed by its peer or failed
+ *
+ * @returns 0 on success, -1 if the bridge cannot continue
+ */
 
-	if (listen(fd, 0) < 0) {
-		close(fd);
-		perror("listen");
-		exit(EXIT_FAILURE);
-	}
+static int conn_usr_lost(struct bridge_cfg *cfg, struct bridge_conn *conn)
+{
+	printf("User connection closed\n");
+	conn_close(cfg, conn);
 
-	printf("Listening on %s\n", url);
+	/* in client mode, there is nothing left to do */
+	if (!conn->link->listen && !conn->monitor)
+		return -1;
 
-	return fd;
+	return 0;
 }
 
 
 /**
- * @brief thread function accepting incoming connections on a server socket
+ * @brief handle an event on a connection
+ *
+ * @returns 0 on success, -1 if the bridge cannot continue
  */
 
-static void *accept_connections(void *data)
+static int conn_handle_event(struct bridge_cfg *cfg, struct bridge_conn *conn,
+			     uint32_t events)
 {
-	int fd = 0;
+	int ret = 0;
 
-	struct bridge_cfg *cfg;
 
-	struct sockaddr_storage client_addr;
+	if (conn->dead)
+		return 0;
 
-	socklen_t client_addr_len;
+	switch (conn->type) {
+
+	case CONN_LISTEN:
+		accept_connections(cfg, conn);
+		return 0;
 
+	case CONN_STATS:
+		stats_connections(cfg, conn);
+		return 0;
 
-	cfg = (struct bridge_cfg *) data;
+	case CONN_USER:
+		if (events & EPOLLOUT) {
+			ret = conn_flush(conn);
+			if (!ret && !conn->tx.used)
+				conn->link->resume = 1;
+		}
 
-	client_addr_len = sizeof(client_addr);
+		if (!ret && !conn->paused &&
+		    (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			ret = conn_recv_usr(cfg, conn);
 
-	while(1) {
+		/* clean up disconnected socket */
+		if (ret)
+			return conn_usr_lost(cfg, conn);
 
-		fd = accept(cfg->socket, (struct sockaddr *) &client_addr,
-			    &client_addr_len);
+		return 0;
 
-		if (fd < 0) {
-			perror("accept");
-			exit(EXIT_FAILURE);
+	case CONN_GRESB:
+		if ((events & EPOLLOUT) && conn->tx.used) {
+
+			if (conn_flush(conn)) {
+				perror("send");
+				printf("GRESB connection lost on link %u\n",
+				       conn->link->id);
+				return -1;
+			}
+
+			if (!conn->tx.used)
+				conn->link->resume = 1;
 		}
 
-		printf("New incoming connection\n");
+		if (conn->paused)
+			return 0;
+
+		if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			return 0;
+
+		if (conn_recv_pkts(cfg, conn)) {
+			printf("GRESB connection lost on link %u\n",
+			       conn->link->id);
+			return -1;
+		}
 
-		FD_SET(fd, &cfg->set);
+		return 0;
 
-		/* update maximum file descriptor number */
-		if (fd > cfg->n_fd)
-			cfg->n_fd = fd;
+	default:
+		return -1;
 	}
 }
 
 
 /**
- * @brief send user packets to the GRESB
+ * @brief continue reading from connections that were paused
+ *
+ * @returns 0 on success, -1 if the bridge cannot continue
  */
 
-static int usr_pkt_to_gresb(int fd, struct bridge_cfg *cfg)
+static int bridge_resume(struct bridge_cfg *cfg)
 {
-	int ret;
-	ssize_t recv_bytes;
-	ssize_t recv_left;
-	uint8_t *gresb_pkt;
-	unsigned char *recv_buffer;
-	ssize_t pkt_size;
-
-	uint8_t gresb_hdr[4];	/* host-to-gresb header is 4 bytes */
-
+	unsigned int i;
+	unsigned int j;
 
-	if (cfg->raw) {
+	struct bridge_link *link;
+	struct bridge_conn *conn[2];
+	struct bridge_conn *usr;
+	struct bridge_conn *next;
 
-		recv_buffer = malloc(GRESB_PKT_SIZE_MAX);
 
-		recv_bytes  = recv(fd, recv_buffer, GRESB_PKT_SIZE_MAX, 0);
+	for (i = 0; i < cfg->n_links; i++) {
 
-	} else {
+		link = &cfg->link[i];
 
-		/* try to grab a header */
-		recv_bytes = recv(fd, gresb_hdr, 4, MSG_PEEK);
-		if (recv_bytes < 4)
-			return 0;
+		if (!link->resume)
+			continue;
 
-		/* we got at least a header, now allocate space for a host-to-gresb
-		 * packet (data + header) and start receiving
-		 * note the lack of basic sanity checks...
-		 */
-		pkt_size = gresb_get_spw_data_size(gresb_hdr) + 4;
-		recv_buffer = malloc(pkt_size);
-
-		recv_bytes = 0;
-		recv_left  = pkt_size;
-		while (recv_left) {
-			ssize_t rb;
-			rb = recv(fd, recv_buffer + recv_bytes, recv_left, 0);
-			recv_bytes += rb;
-			recv_left  -= rb;
-		}
-	}
+		link->resume = 0;
 
-	if (recv_bytes <= 0)
-		goto cleanup;
+		conn[0] = link->gresb_tx;
+		conn[1] = link->gresb_rx;
 
-#if DEBUG
-	{
-		printf("usr to GRESB [%lu]: ", recv_bytes);
-		int i;
-		for (i = 0; i < recv_bytes; i++)
-			printf("%02X:", recv_buffer[i]);
-		printf("\n");
-	}
-#endif
+		for (j = 0; j < 2; j++) {
 
-	if (cfg->raw) {
+			if (!conn[j]->paused)
+				continue;
 
-		gresb_pkt = gresb_create_host_data_pkt(recv_buffer, recv_bytes);
+			conn[j]->paused = 0;
 
-		if (!gresb_pkt) {
-			printf("error creating packet\n");
-			exit(EXIT_FAILURE);
+			if (conn_recv_pkts(cfg, conn[j])) {
+				printf("GRESB connection lost on link %u\n",
+				       link->id);
+				return -1;
+			}
 		}
 
-		/* we SEND to the TX port */
-		ret = send_all(cfg->gresb_tx->socket, gresb_pkt,
-			       gresb_get_host_data_pkt_size(gresb_pkt));
-		if (ret == -1)
-			perror("send");
+		for (usr = link->usr; usr; usr = next) {
 
+			next = usr->next;
 
-		gresb_destroy_host_data_pkt((struct host_to_gresb_pkt *) gresb_pkt);
+			if (!usr->paused)
+				continue;
 
-	} else {
+			usr->paused = 0;
 
-		ret = send_all(cfg->gresb_tx->socket, recv_buffer, recv_bytes);
-		if (ret == -1)
-			perror("send");
+			if (conn_recv_usr(cfg, usr) && conn_usr_lost(cfg, usr))
+				return -1;
+		}
 	}
 
-cleanup:
-	free(recv_buffer);
-
-	return recv_bytes;
+	return 0;
 }
 
 
 /**
- * @brief thread function polling a network socket
+ * @brief the bridge event loop
+ *
+ * @note returns when a SIGINT was caught or the bridge cannot continue
  */
 
-static void *poll_socket(void *data)
+static void bridge_run(struct bridge_cfg *cfg)
 {
-	int fd;
-
-	fd_set r_set;
-
-	struct timeval to;
+	int i;
+	int n;
+	int timeout = -1;
 
-	struct bridge_cfg *cfg;
+	struct epoll_event ev[BRIDGE_EPOLL_EVENTS];
 
 
-	if (!data)
-		return NULL;
+	while (!bridge_stop) {
 
-	cfg = (struct bridge_cfg *) data;
+		n = epoll_wait(cfg->epoll_fd, ev, BRIDGE_EPOLL_EVENTS, timeout);
 
-	/* wait 10 ms in select() */
-	to.tv_sec  = 0;
-	to.tv_usec = 10000;
+		if (bridge_dump) {
+			bridge_dump = 0;
+			fflush(stdout);
+			bridge_stats_show(cfg, STDOUT_FILENO);
+		}
 
-	while (1) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 
-		r_set = cfg->set;
+			perror("epoll_wait");
+			return;
+		}
 
-		/* select ready sockets */
-		if (select((cfg->n_fd + 1), &r_set, NULL, NULL, &to) <= 0) {
-			usleep(100);
-			continue;
+		for (i = 0; i < n; i++) {
+			if (conn_handle_event(cfg, (struct bridge_conn *) ev[i].data.ptr,
+					      ev[i].events))
+				return;
 		}
 
-		for (fd = 0; fd <= cfg->n_fd; fd++) {
+		if (bridge_resume(cfg))
+			return;
 
-			if (!FD_ISSET(fd, &r_set))
-				continue;
+		if (bridge_flush_gresb(cfg))
+			return;
 
-			/* clean up disconnected socket */
-			if (usr_pkt_to_gresb(fd, cfg) <= 0) {
-				FD_CLR(fd, &cfg->set);
-				close(fd);
-			}
-		}
-	}
+		timeout = bridge_flush(cfg);
 
-	return NULL;
+		conn_release_dead(cfg);
+	}
 }
-#include <rmap.h>
 
-static int gresb_pkt_to_usr(int fd, struct bridge_cfg *cfg)
-{
-	int fdc;
-	int ret;
-	ssize_t recv_bytes;
-	uint8_t *recv_buffer;
-	ssize_t pkt_size;
-
-	uint8_t gresb_hdr[4];	/* gresb-to-host header is 4 bytes */
 
 
+/**
+ * @brief connect a link to the GRESB and set up its user ports
+ *
+ * @param port the user port of the link
+ * @param mon_port the monitor port of the link, 0 for none
+ * @param client if set, connect to the user port on host, otherwise
+ *	  listen on it
+ *
+ * @note exits on error
+ */
 
-	/* try to grab a header */
-	recv_bytes = recv(fd, gresb_hdr, 4, MSG_PEEK);
-	if (recv_bytes < 4)
-		return 0;
+static void link_open(struct bridge_cfg *cfg, struct bridge_link *link,
+		      const char *gresb, const char *host,
+		      unsigned int port, unsigned int mon_port, int client)
+{
+	int fd;
+	char url[256];
+	char path[256];
 
-	/* we got at least a header, now allocate space for a gresb-to-host
-	 * packet (data + header) and start receiving
-	 * note the lack of basic sanity checks...
-	 */
-	pkt_size = gresb_get_spw_data_size(gresb_hdr) + 4;
-	recv_buffer = malloc(pkt_size);
 
-	recv_bytes  = recv(fd, recv_buffer, pkt_size, 0);
+	/* TX port on the GRESB (i.e. sent by us to NET routed to SPW) */
+	sprintf(url, "%s:%d", gresb, GRESB_VLINK_TX(link->id));
 
+	fd = connect_client_socket(url);
 
-#if DEBUG
-	{
-		printf("GRESB to usr [%lu]: ",  gresb_get_spw_data_size(recv_buffer));
-		size_t i;
-		for (i = 0; i < gresb_get_spw_data_size(recv_buffer); i++)
-			printf("%02X:", gresb_get_spw_data(recv_buffer)[i]);
-		printf("\n");
-		rmap_parse_pkt((uint8_t *) gresb_get_spw_data(recv_buffer));
+	if (fd < 0) {
+		printf("Failed to connect to %s\n", url),
+			exit(EXIT_FAILURE);
 	}
-#endif
 
-	if (recv_bytes <= 0)
-		goto cleanup;
+	/* the GRESB answers to configuration requests on the TX port */
+	link->gresb_tx = conn_add(cfg, link, fd, CONN_GRESB);
+	if (!link->gresb_tx)
+		exit(EXIT_FAILURE);
 
+	/* user packets are queued, see usr_pkt_to_gresb() */
+	if (gresb_txq_init(&link->gresb_tx->tx, GRESB_TXQ_SIZE,
+			   GRESB_TXQ_RECORDS, 0)) {
+		perror("gresb_txq_init");
+		exit(EXIT_FAILURE);
+	}
 
-	for(fdc = 0; fdc <= cfg->bridge->n_fd; fdc++) {
+	printf("Connected to GRESB TX of link %u\n", link->id);
 
-		if (!FD_ISSET(fdc, &cfg->bridge->set))
-			continue;
 
-		if (cfg->raw) {
-			/* extract data */
-			ret = send_all(fdc,
-				       gresb_get_spw_data(recv_buffer),
-				       gresb_get_spw_data_size(recv_buffer));
-		} else {
-			/* forward packet */
-			ret = send_all(fdc, recv_buffer, recv_bytes);
-		}
 
-		if (ret == -1) {
-			perror("send");
-			close(fdc);
-			FD_CLR(fdc, &cfg->bridge->set);
-		}
+	/* RX port on the GRESB (i.e. route from SPW to NET, received by us */
+	sprintf(url, "%s:%d", gresb, GRESB_VLINK_RX(link->id));
 
+	fd = connect_client_socket(url);
 
+	if (fd < 0) {
+		printf("Failed to connect to %s\n", url),
+			exit(EXIT_FAILURE);
 	}
 
-cleanup:
-	free(recv_buffer);
-
+	link->gresb_rx = conn_add(cfg, link, fd, CONN_GRESB);
+	if (!link->gresb_rx)
+		exit(EXIT_FAILURE);
 
-	return recv_bytes;
+	printf("Connected to GRESB RX of link %u\n", link->id);
 
-}
 
 
-/**
- * @brief thread function polling a GRESB network socket
- */
+	/* our network */
+	if (cfg->unix_path) {
 
-static void *poll_socket_gresb(void *data)
-{
-	int fd;
+		/* the first link uses the path, link N the path with N
+		 * appended
+		 */
+		if (link != &cfg->link[0])
+			snprintf(path, sizeof(path), "%s%u", cfg->unix_path, link->id);
+		else
+			snprintf(path, sizeof(path), "%s", cfg->unix_path);
 
-	fd_set r_set;
+		if (client)
+			fd = gresb_unix_connect(path);
+		else
+			fd = gresb_unix_listen(path);
 
-	struct timeval to;
+		if (fd < 0) {
+			printf("Failed to open %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 
-	struct bridge_cfg *cfg;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 
+	} else {
 
-	if (!data)
-		return NULL;
+		sprintf(url, "%s:%d", host, port);
 
-	cfg = (struct bridge_cfg *) data;
+		if (client)
+			fd = connect_client_socket(url);
+		else
+			fd = bind_server_socket(url);
 
-	/* wait 10 ms in select() */
-	to.tv_sec  = 0;
-	to.tv_usec = 10000;
+		if (fd < 0) {
+			printf("Failed to connect to %s\n", url),
+				exit(EXIT_FAILURE);
+		}
+	}
 
-	while (1) {
+	if (client) {
+		if (!conn_add(cfg, link, fd, CONN_USER))
+			exit(EXIT_FAILURE);
+	} else {
+		link->listen = conn_add(cfg, link, fd, CONN_LISTEN);
+		if (!link->listen)
+			exit(EXIT_FAILURE);
 
-		r_set = cfg->set;
+		if (cfg->unix_path)
+			printf("Listening on %s\n", path);
+	}
 
-		/* select ready sockets */
-		if (select((cfg->n_fd + 1), &r_set, NULL, NULL, &to) <= 0) {
-			usleep(1000);
-			continue;
-		}
+	if (mon_port) {
 
-		for (fd = 0; fd <= cfg->n_fd; fd++) {
+		sprintf(url, "%s:%d", host, mon_port);
 
-			if (!FD_ISSET(fd, &r_set))
-				continue;
+		fd = bind_server_socket(url);
 
-			/* clean up disconnected gresb socket */
-			if (gresb_pkt_to_usr(fd, cfg) < 0) {
-				FD_CLR(fd, &r_set);
-				close(fd);
-			}
-		}
+		link->monitor = conn_add(cfg, link, fd, CONN_LISTEN);
+		if (!link->monitor)
+			exit(EXIT_FAILURE);
 	}
-
-	return NULL;
 }
 
 
-static void set_tcp_nodelay(struct bridge_cfg *cfg)
+/**
+ * @brief close all connections of a link
+ */
+
+static void link_close(struct bridge_cfg *cfg, struct bridge_link *link)
 {
-	int flag = 1;
+	while (link->usr)
+		conn_close(cfg, link->usr);
 
-	setsockopt(cfg->socket, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(int));
+	conn_close(cfg, link->listen);
+	conn_close(cfg, link->monitor);
+	conn_close(cfg, link->gresb_rx);
+	conn_close(cfg, link->gresb_tx);
 }
 
 
@@ -517,41 +1521,44 @@ int main(int argc, char **argv)
 	unsigned int ret;
 	unsigned int port;
 	unsigned int link;
+	unsigned int first;
+	unsigned int mon_port;
+	unsigned int stats_port;
+
+	unsigned int n_use;
+	uint8_t use[BRIDGE_LINKS];
 
 	struct addrinfo *res;
 
 	struct sigaction SIGINT_handler;
+	struct sigaction SIGUSR1_handler;
 
 	enum {SERVER, CLIENT} mode;
 
 	struct bridge_cfg bridge;
-	struct bridge_cfg gresb_tx;
-	struct bridge_cfg gresb_rx;
 
 
 
 	bzero(&bridge,   sizeof(struct bridge_cfg));
-	bzero(&gresb_tx, sizeof(struct bridge_cfg));
-	bzero(&gresb_rx, sizeof(struct bridge_cfg));
 
 	/**
 	 * defaults
 	 */
 	gresb[0] = '\0';
-	link     = DEFAULT_LINK;
+	n_use    = 0;
+	bzero(use, sizeof(use));
 	mode     = SERVER;
 	port     = DEFAULT_PORT;
+	mon_port = 0;
+	stats_port = 0;
 	sprintf(url, "%s", DEFAULT_ADDR);
 	sprintf(host, "%s", DEFAULT_ADDR);
 
-	bridge.raw      = 0; /* expect gresb format */
-	bridge.gresb_tx = &gresb_tx;
-	bridge.gresb_rx = &gresb_rx;
-	gresb_tx.bridge = &bridge;
-	gresb_rx.bridge = &bridge;
+	bridge.raw        = 0; /* expect gresb format */
+	bridge.latency_us = DEFAULT_LATENCY_US;
 
 
-	while ((opt = getopt(argc, argv, "G:L:p:s:r:bh")) != -1) {
+	while ((opt = getopt(argc, argv, "G:L:ap:M:S:U:R:s:r:l:w:bh")) != -1) {
 		switch (opt) {
 
 		case 'G':
@@ -576,12 +1583,40 @@ int main(int argc, char **argv)
 
 		case 'L':
 			link = strtol(optarg, NULL, 0);
+			if (link > GRESB_VLINK_MAX) {
+				printf("GRESB link must be in range 0-%d\n", GRESB_VLINK_MAX);
+				exit(EXIT_FAILURE);
+			}
+			use[link] = 1;
+			n_use++;
+			break;
+
+		case 'a':
+			memset(use, 1, sizeof(use));
+			n_use = BRIDGE_LINKS;
 			break;
 
 		case 'p':
 			port = strtol(optarg, NULL, 0);
 			break;
 
+		case 'M':
+			mon_port = strtol(optarg, NULL, 0);
+			break;
+
+		case 'S':
+			stats_port = strtol(optarg, NULL, 0);
+			break;
+
+		case 'U':
+			bridge.unix_path = optarg;
+			break;
+
+		case 'R':
+			mode = CLIENT;
+			bridge.unix_path = optarg;
+			break;
+
 		case 's':
 			ret = getaddrinfo(optarg, NULL, NULL, &res);
 			if (ret) {
@@ -630,15 +1665,34 @@ int main(int argc, char **argv)
 			bridge.raw = 1;
 			break;
 
+		case 'l':
+			bridge.latency_us = strtol(optarg, NULL, 0);
+			break;
+
+		case 'w':
+			bridge.pcap = gresb_pcap_open(optarg, 0);
+			if (!bridge.pcap) {
+				perror("pcap");
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'h':
 		default:
 			printf("\nUsage: %s [OPTIONS]\n", argv[0]);
 			printf("  -G ADDRESS                address of the GRESP\n");
-			printf("  -L LINK_ID                link id to use on GRESP\n");
-			printf("  -p PORT                   local uplink port number (default %d)\n", port);
+			printf("  -L LINK_ID                link id to use on GRESP, may be repeated (default %d)\n", DEFAULT_LINK);
+			printf("  -a                        use all links on GRESP\n");
+			printf("  -p PORT                   local uplink port number of the first link, link N uses PORT + N - first (default %d)\n", port);
+			printf("  -M PORT                   local monitor port number of the first link, link N uses PORT + N - first; read-only, drops packets if too slow\n");
+			printf("  -S PORT                   local port reporting the bridge counters on connect, also dumped on SIGUSR1\n");
+			printf("  -U PATH                   use a local packet socket at PATH instead of the uplink port, further links N use PATHN\n");
 			printf("  -s ADDRESS                local source address (default: %s)\n", url);
 			printf("  -r ADDRESS:PORT           client mode: address and port of remote target\n");
+			printf("  -R PATH                   client mode: local packet socket of remote target, further links N use PATHN\n");
 			printf("  -b			    exchange raw binary data on uplink port (expect GRESB format otherwise)\n");
+			printf("  -l USEC                   max. time to hold packets for batched transmission (default %d)\n", DEFAULT_LATENCY_US);
+			printf("  -w FILE                   capture forwarded packets to FILE in pcap format (DLT_USER0)\n");
 			printf("  -h                        print this help and exit\n");
 			printf("\n");
 			exit(0);
@@ -649,7 +1703,7 @@ int main(int argc, char **argv)
 
 
     	/**
-	 * set up GRESB connection
+	 * set up GRESB connections
 	 */
 
 
@@ -658,106 +1712,58 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	if (link > GRESB_VLINK_MAX) {
-		printf("GRESB link must be in range 0-%d\n", GRESB_VLINK_MAX);
-		exit(EXIT_FAILURE);
-	}
-
-
-	/* TX port on the GRESB (i.e. sent by us to NET routed to SPW) */
-	sprintf(url, "%s:%d", gresb, GRESB_VLINK_TX(link));
-
-	gresb_tx.socket = connect_client_socket(url, &gresb_tx);
+	/* default to a single link */
+	if (!n_use)
+		use[DEFAULT_LINK] = 1;
 
-	if (gresb_tx.socket < 0) {
-		printf("Failed to connect to %s\n", url),
-			exit(EXIT_FAILURE);
-	}
 
-	/* the GRESB answers to configuration requests on the TX port */
-	ret = pthread_create(&gresb_tx.thread_poll, NULL,
-			     poll_socket_gresb, &gresb_tx);
-	if (ret) {
-		printf("Epic fail in pthread_create: %s\n", strerror(ret));
+	bridge.epoll_fd = epoll_create1(0);
+	if (bridge.epoll_fd < 0) {
+		perror("epoll_create1");
 		exit(EXIT_FAILURE);
 	}
 
-	printf("Connected to GRESB TX\n");
 
+	for (first = 0; !use[first]; first++);
 
+	/* the first link uses the user (and monitor) port, the others are
+	 * offset by the distance of their id, so a single link is served
+	 * on the port given
+	 */
+	for (link = first; link < BRIDGE_LINKS; link++) {
 
-	/* RX port on the GRESB (i.e. route from SPW to NET, received by us */
-	sprintf(url, "%s:%d", gresb, GRESB_VLINK_RX(link));
+		if (!use[link])
+			continue;
 
-	gresb_rx.socket = connect_client_socket(url, &gresb_rx);
+		bridge.link[bridge.n_links].id = link;
 
-	if (gresb_rx.socket < 0) {
-		printf("Failed to connect to %s\n", url),
-			exit(EXIT_FAILURE);
-	}
+		link_open(&bridge, &bridge.link[bridge.n_links], gresb, host,
+			  port + link - first,
+			  mon_port ? mon_port + link - first : 0,
+			  mode == CLIENT);
 
-	ret = pthread_create(&gresb_rx.thread_poll, NULL,
-			     poll_socket_gresb, &gresb_rx);
-	if (ret) {
-		printf("Epic fail in pthread_create: %s\n", strerror(ret));
-		exit(EXIT_FAILURE);
+		bridge.n_links++;
 	}
 
-	printf("Connected to GRESB RX\n");
-
-
-
-    	/**
-	 * set up our network
-	 */
-
-	sprintf(url, "%s:%d", host, port);
-
-	if (mode == SERVER) {
-
-		bridge.n_fd = 0;
-		bridge.socket = bind_server_socket(url, &bridge);
+	if (stats_port) {
 
-		ret = pthread_create(&bridge.thread_accept, NULL,
-				     accept_connections,
-				     &bridge);
-		if (ret) {
-			printf("Epic fail in pthread_create: %s\n", strerror(ret));
-			exit(EXIT_FAILURE);
-		}
+		sprintf(url, "%s:%d", host, stats_port);
 
-		ret = pthread_create(&bridge.thread_poll, NULL, poll_socket, &bridge);
-		if (ret) {
-			printf("Epic fail in pthread_create: %s\n", strerror(ret));
+		bridge.stats = conn_add(&bridge, NULL,
+					bind_server_socket(url), CONN_STATS);
+		if (!bridge.stats)
 			exit(EXIT_FAILURE);
-		}
+	}
 
+	if (mode == SERVER)
 		printf("Started in SERVER mode\n");
-
-	} else {
-
-		bridge.socket = connect_client_socket(url, &bridge);
-
-		if (bridge.socket < 0) {
-			printf("Failed to connect to %s\n", url),
-				exit(EXIT_FAILURE);
-		}
-
-		ret = pthread_create(&bridge.thread_poll, NULL, poll_socket, &bridge);
-		if (ret) {
-			printf("Epic fail in pthread_create: %s\n", strerror(ret));
-			exit(EXIT_FAILURE);
-		}
-
+	else
 		printf("Started in CLIENT mode\n");
-	}
-
-	set_tcp_nodelay(&bridge);
 
 
 
 	/**
-	 * catch ctrl+c
+	 * catch ctrl+c, dump counters on SIGUSR1
 	 */
 
 	SIGINT_handler.sa_handler = sigint_handler;
@@ -765,36 +1771,40 @@ int main(int argc, char **argv)
 	SIGINT_handler.sa_flags = 0;
 	sigaction(SIGINT, &SIGINT_handler, NULL);
 
+	SIGUSR1_handler.sa_handler = sigusr1_handler;
+	sigemptyset(&SIGUSR1_handler.sa_mask);
+	SIGUSR1_handler.sa_flags = 0;
+	sigaction(SIGUSR1, &SIGUSR1_handler, NULL);
+
 
 
 	/**
-	 *  wait for signal, then clean up
+	 *  run until signal, then clean up
 	 */
 
 	printf("Ready...\n");
 
-	pause();
+	bridge_run(&bridge);
 
-	if (bridge.thread_accept)
-		pthread_cancel(bridge.thread_accept);
+	if (bridge_stop)
+		printf("\nCaught signal %d\n", SIGINT);
 
-	if (bridge.thread_accept)
-		pthread_cancel(bridge.thread_accept);
+	for (link = 0; link < bridge.n_links; link++)
+		link_close(&bridge, &bridge.link[link]);
 
-	if (gresb_tx.thread_poll)
-		pthread_cancel(gresb_tx.thread_poll);
+	conn_close(&bridge, bridge.stats);
 
-	if (gresb_rx.thread_poll)
-		pthread_cancel(gresb_rx.thread_poll);
+	conn_release_dead(&bridge);
+	bridge_pool_free(&bridge);
 
-	if (bridge.socket)
-		close(bridge.socket);
-
-	if (gresb_rx.socket)
-		close(gresb_rx.socket);
+	if (bridge.pcap) {
+		if (gresb_pcap_dropped(bridge.pcap))
+			printf("Capture dropped %lu packets\n",
+			       gresb_pcap_dropped(bridge.pcap));
+		gresb_pcap_close(bridge.pcap);
+	}
 
-	if (gresb_tx.socket)
-		close(gresb_tx.socket);
+	close(bridge.epoll_fd);
 
 
 	return 0;
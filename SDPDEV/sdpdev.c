@@ -26,6 +26,10 @@
 #include <smile_fee_cfg.h>
 #include <smile_fee_ctrl.h>
 #include <smile_fee_rmap.h>
+#include <smile_fee_demux.h>
+#include <smile_fee_evstore.h>
+#include <smile_fee_evstat.h>
+#include <smile_fee_wmask.h>
 
 #ifdef SIM_DUMP_FITS
 #include <fitsio.h>
@@ -40,6 +44,9 @@
 
 int bridge_fd;
 
+/* the single reader of the bridge link */
+static struct fee_demux *demux;
+
 
 
 /**
@@ -100,87 +107,14 @@ static int32_t rmap_tx(const void *hdr,  uint32_t hdr_size,
 
 
 /**
- * dirty hack for packet reception, more or less a copy of rmap_rx()
+ * rx function for FEE data packets
+ *
+ * @note same semantics as rmap_rx()
  */
 
 static uint32_t pkt_rx(uint8_t *pkt)
 {
-	int recv_bytes;
-	int recv_left;
-	static uint32_t pkt_size; /* keep last packet size */
-
-	/* XXX: gresb-to-host header is just 4 bytes, but we need 2 extra in
-	 * order to be able to distinguish between rmap and non-rmap packets
-	 *
-	 *
-	 * NOTE THAT THIS IS A DIRTY HACK FOR THE DEMONSTRATOR ONLY, DO NOT DO
-	 * THIS IN PRODUCTION CODE! EVER!
-	 */
-
-	uint8_t gresb_hdr[4+2];
-
-	uint8_t *recv_buffer;
-
-	if (!pkt) {	/* next packet size requested */
-
-		/* try to grab a header */
-		recv_bytes = recv(bridge_fd, gresb_hdr, 6, MSG_PEEK | MSG_DONTWAIT);
-
-		/* we won't bother, this is a stupid demo, not production code */
-		if (recv_bytes <= 0)  {
-			return 0;
-		}
-
-		/* header is 4 bytes, but we need 6 */
-		if (recv_bytes < (4 + 2)) {
-			return 0;
-		}
-
-		/* XXX the protocol id is (or should be) in byte 6 */
-		if (gresb_hdr[5] == FEE_DATA_PROTOCOL)
-			pkt_size = gresb_get_spw_data_size(gresb_hdr);
-		else	/* not what we want, ignore */
-			pkt_size = 0;
-
-		/* tell caller about next packet */
-		return pkt_size;
-	}
-
-	/* we packet space, now start receiving
-	 * note the lack of basic sanity checks...
-	 */
-
-	/* buffer is payload + header */
-	recv_buffer = malloc(pkt_size + 4);
-
-	recv_bytes = 0;
-	recv_left  = pkt_size + 4;
-	while (recv_left) {
-		int rb;
-		rb = recv(bridge_fd, recv_buffer + recv_bytes, recv_left, 0);
-		recv_bytes += rb;
-		recv_left  -= rb;
-	}
-
-
-	if (0) {
-		int i;
-
-		printf("\nRAW DUMP (%d/%d bytes):\n", recv_bytes, pkt_size);
-
-		for (i=0 ;i < recv_bytes; i++)
-			printf("%02x ", recv_buffer[i]);
-		printf("END DUMP\n\n");
-	}
-
-
-
-	/* the caller supplied their own buffer */
-	memcpy(pkt, gresb_get_spw_data(recv_buffer), recv_bytes);
-	free(recv_buffer);
-
-	return pkt_size;
-
+	return fee_demux_rx(demux, FEE_DEMUX_DATA, pkt);
 }
 
 
@@ -196,68 +130,7 @@ static uint32_t pkt_rx(uint8_t *pkt)
 
 static uint32_t rmap_rx(uint8_t *pkt)
 {
-
-	int recv_bytes;
-	int recv_left;
-	static uint32_t pkt_size; /* keep last packet size */
-
-	/* XXX: gresb-to-host header is just 4 bytes, but we need 2 extra in
-	 * order to be able to distinguish between rmap and non-rmap packets
-	 *
-	 *
-	 * NOTE THAT THIS IS A DIRTY HACK FOR THE DEMONSTRATOR ONLY, DO NOT DO
-	 * THIS IN PRODUCTION CODE! EVER!
-	 */
-
-	uint8_t gresb_hdr[4+2];
-
-	uint8_t *recv_buffer;
-
-	if (!pkt) {	/* next packet size requested */
-
-		/* try to grab a header */
-		recv_bytes = recv(bridge_fd, gresb_hdr, 6, MSG_PEEK | MSG_DONTWAIT);
-
-		/* we won't bother, this is a stupid demo, not production code */
-		if (recv_bytes <= 0)
-			return 0;
-
-		/* header is 4 bytes, but we need 6 */
-		if (recv_bytes < (4 + 2))
-			return 0;
-
-		/* XXX the protocol id is (or should be) in byte 6 */
-		if (gresb_hdr[5] == RMAP_PROTOCOL_ID)
-			pkt_size = gresb_get_spw_data_size(gresb_hdr);
-		else
-			pkt_size = 0;
-
-		/* tell caller about next packet */
-		return pkt_size;
-	}
-
-	/* we packet space, now start receiving
-	 * note the lack of basic sanity checks...
-	 */
-
-	/* buffer is payload + header */
-	recv_buffer = malloc(pkt_size + 4);
-
-	recv_bytes = 0;
-	recv_left  = pkt_size + 4;
-	while (recv_left) {
-		int rb;
-		rb = recv(bridge_fd, recv_buffer + recv_bytes, recv_left, 0);
-		recv_bytes += rb;
-		recv_left  -= rb;
-	}
-
-
-	/* the caller supplied their own buffer */
-	memcpy(pkt, gresb_get_spw_data(recv_buffer), recv_bytes);
-	free(recv_buffer);
-
-	return recv_bytes;
+	return fee_demux_rx(demux, FEE_DEMUX_RMAP, pkt);
 }
 
 
@@ -283,6 +156,34 @@ static void sync_rmap(void)
 }
 
 
+/**
+ * @brief store an accepted event along with its classification
+ *
+ * @note the event fields must be in cpu endianess
+ *
+ * @note if the event cannot be stored, the store is closed and set to NULL,
+ *	 events are no longer stored from then on
+ */
+
+static void store_event(struct fee_ev_store **evs, struct fee_data_pkt *pkt)
+{
+	uint8_t flags = FEE_EV_CLASS_XRAY;
+
+
+	if (!(*evs))
+		return;
+
+	if (fee_event_pixel_is_bad(pkt))
+		flags |= FEE_EV_CLASS_BAD_PIXEL;
+
+	if (fee_ev_store_add((*evs), (struct fee_event_detection *) pkt, flags)) {
+		printf("Error storing event, no further events are stored\n");
+		fee_ev_store_destroy((*evs));
+		(*evs) = NULL;
+	}
+}
+
+
 
 
 #ifdef SIM_DUMP_FITS
@@ -680,7 +581,8 @@ static void smile_fee_test_ev_det_ft(void)
 	struct fee_ft_data *ft;
 	struct fee_data_pkt *pkt = NULL;
 	int ev_cnt = 0;
-	FILE *fd;
+	struct fee_ev_store *evs;
+	struct fee_ev_stat *stat;
 
 	printf("Test: FT mode + event detection\n");
 
@@ -774,7 +676,10 @@ static void smile_fee_test_ev_det_ft(void)
 	gettimeofday(&t0, NULL);
 
 	ft = fee_ft_aggregator_create();
-	fd = fopen("packets.dat", "w");
+	evs = fee_ev_store_create("events.dat", 0);
+	if (!evs)
+		printf("Could not create event store, events are not stored\n");
+	stat = fee_ev_stat_create(5000, 150*8, 200);
 	while (1) {
 
 		int n;
@@ -810,9 +715,10 @@ static void smile_fee_test_ev_det_ft(void)
 		fee_pkt_hdr_to_cpu(pkt);
 
 		if (fee_pkt_is_event(pkt)) {
-			if (fee_event_is_xray(pkt, 5000, 150*8, 200)) {
+			fee_pkt_event_to_cpu(pkt);
+			if (!fee_ev_stat_update(stat, pkt)) {
 				ev_cnt++;
-				fwrite((void *)pkt, n, 1, fd);
+				store_event(&evs, pkt);
 			}
 #if 1
 			fee_pkt_show_event(pkt);
@@ -826,8 +732,10 @@ static void smile_fee_test_ev_det_ft(void)
 			break;
 
 	}
-	fclose(fd);
+	fee_ev_store_destroy(evs);
 	printf("->>> %d x-ray events classified\n", ev_cnt);
+	fee_ev_stat_show(stat);
+	fee_ev_stat_destroy(stat);
 
 #ifdef SIM_DUMP_FITS
 	save_fits("!E2.fits", ft->E2, ft->rows, ft->cols);
@@ -855,8 +763,10 @@ static void smile_fee_test789(void)
 	struct fee_ft_data *ft;
 	struct fee_data_pkt *pkt = NULL;
 	int ev_cnt = 0;
-	FILE *fd;
 	size_t fsize;
+	struct fee_ev_store *evs;
+	struct fee_ev_stat *stat;
+	struct fee_wmask_tracker *wmask;
 
 
 	uint16_t *data;
@@ -867,6 +777,7 @@ static void smile_fee_test789(void)
 #define UPLOAD 0
 #if UPLOAD
 	/* setup ED sim data in local SRAM copy */
+	FILE *fd;
 
 
 	fd = fopen("../SIM/e_raw.dat", "r");
@@ -1072,7 +983,11 @@ static void smile_fee_test789(void)
 	gettimeofday(&t0, NULL);
 
 	ft = fee_ft_aggregator_create();
-	fd = fopen("packets.dat", "w");
+	evs = fee_ev_store_create("events.dat", 0);
+	if (!evs)
+		printf("Could not create event store, events are not stored\n");
+	stat = fee_ev_stat_create(5000, 150*8, 200);
+	wmask = fee_wmask_tracker_create();
 	while (1) {
 
 		int n;
@@ -1162,6 +1077,7 @@ static void smile_fee_test789(void)
 			fee_pkt_wandering_mask_to_cpu(pkt);
 			printf("WANDERING MASK!\n");
 			fee_pkt_show_wandering_mask(pkt);
+			fee_wmask_tracker_update(wmask, pkt);
 
 			continue; /* for EV_TEST_DIGITISE */
 		}
@@ -1169,8 +1085,9 @@ static void smile_fee_test789(void)
 
 		if (fee_pkt_is_event(pkt)) {
 			fee_pkt_event_to_cpu(pkt);
-			if (fee_event_is_xray(pkt, 5000, 150*8, 200)) {
-				fwrite((void *)pkt, n, 1, fd);
+			fee_wmask_tracker_update(wmask, pkt);
+			if (!fee_ev_stat_update(stat, pkt)) {
+				store_event(&evs, pkt);
 				ev_cnt++;
 #define SHOW_EVENTS 0
 #if SHOW_EVENTS
@@ -1178,6 +1095,12 @@ static void smile_fee_test789(void)
 				printf("ev_cnt %d\n", ev_cnt);
 #endif
 			}
+
+			if (pkt->hdr.type.last_pkt) {
+				fee_ev_stat_frame_end(stat);
+				fee_ev_stat_show(stat);
+				fee_wmask_tracker_show(wmask);
+			}
 #if 1
 #endif
 
@@ -1189,8 +1112,12 @@ static void smile_fee_test789(void)
 #endif
 
 	}
-	fclose(fd);
+	fee_ev_store_destroy(evs);
 	printf("->>> %d x-ray events classified\n", ev_cnt);
+	fee_ev_stat_show(stat);
+	fee_ev_stat_destroy(stat);
+	fee_wmask_tracker_show(wmask);
+	fee_wmask_tracker_destroy(wmask);
 
 #ifdef SIM_DUMP_FITS
 	save_fits("!E2.fits", ft->E2, ft->rows, ft->cols);
@@ -1227,16 +1154,30 @@ static void smile_fee_run_tests(void)
 
 
 
+/* define to connect to the bridge or simulator via a local packet
+ * socket rather than TCP, e.g. -DBRIDGE_UNIX_PATH=\"/tmp/smile_fee\"
+ */
+
 int main(void)
 {
 	uint8_t dpath[] = DPATH;
 	uint8_t rpath[] = RPATH;
 
 
+#ifndef BRIDGE_UNIX_PATH
 	int flag = 1;
 	struct sockaddr_in server;
+#endif
 
 
+#ifdef BRIDGE_UNIX_PATH
+	/* local packet socket of a bridge or simulator on this host */
+	bridge_fd = gresb_unix_connect(BRIDGE_UNIX_PATH);
+	if (bridge_fd < 0) {
+		perror("connect failed. Error");
+		return 1;
+	}
+#else
 	bridge_fd = socket(AF_INET, SOCK_STREAM, 0);
 
 	setsockopt(bridge_fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(int));
@@ -1251,10 +1192,17 @@ int main(void)
 		perror("connect failed. Error");
 		return 1;
 	}
+#endif
 
 	/* set non-blocking so we can recv() easily */
 	fcntl(bridge_fd, F_SETFL, fcntl(bridge_fd, F_GETFL, 0) | O_NONBLOCK);
 
+	demux = fee_demux_create(bridge_fd, 0, 0);
+	if (!demux) {
+		printf("Could not create link demultiplexer\n");
+		return 1;
+	}
+
 	/* initialise the libraries */
 	smile_fee_ctrl_init(NULL);
 	smile_fee_rmap_init(GRSPW2_DEFAULT_MTU, rmap_tx, rmap_rx);
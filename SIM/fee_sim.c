@@ -30,13 +30,17 @@
 #include <string.h>
 
 #include <fee_sim.h>
+#include <fee_sim_pool.h>
+#include <fee_sim_txq.h>
 #include <smile_fee.h>
+#include <smile_fee_bin.h>
 #include <smile_fee_cfg.h>
 #include <smile_fee_ctrl.h>
 #include <smile_fee_rmap.h>
 
 #include <byteorder.h>
 
+#include <time.h>
 #include <sys/time.h>
 
 #ifdef SIM_DUMP_FITS
@@ -53,16 +57,97 @@ static uint16_t *RDO;
 static uint16_t frame_cntr;
 
 
+/**
+ * the time spent in the stages of a readout cycle is accumulated for the
+ * timing report of the headless mode; binning and noise are done by the
+ * worker pool, so their times are summed over the workers, the event
+ * detection and packetisation times exclude the time spent sending, which
+ * is only accounted for in headless mode
+ */
+
+#define FEE_SIM_STAGE_REFRESH	0
+#define FEE_SIM_STAGE_BIN	1
+#define FEE_SIM_STAGE_NOISE	2
+#define FEE_SIM_STAGE_EVENT	3
+#define FEE_SIM_STAGE_PACKET	4
+#define FEE_SIM_STAGE_SEND	5
+#define FEE_SIM_STAGES		6
+
+static const char *fee_sim_stage_name[FEE_SIM_STAGES] = {
+	"refresh", "bin", "noise", "event", "packet", "send"
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int64_t ns[FEE_SIM_STAGES];
+	uint64_t pkts;		/* updated by the simulator thread only */
+	uint64_t bytes;
+} sim_stage = {PTHREAD_MUTEX_INITIALIZER, {0}, 0, 0};
+
+/* set in headless mode, suppresses the console output of a cycle */
+static int sim_quiet;
+
+#define SIM_INFO(...)	do { if (!sim_quiet) printf(__VA_ARGS__); } while (0)
+
+
+/**
+ * @brief get the CLOCK_MONOTONIC time in nanoseconds
+ */
+
+static int64_t sim_time_ns(void)
+{
+	struct timespec t;
+
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (int64_t) t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/**
+ * @brief add the time elapsed since t0 to a stage
+ *
+ * @returns the time elapsed in ns
+ */
+
+static int64_t fee_sim_stage_add(unsigned int stage, int64_t t0)
+{
+	int64_t dt;
+
+
+	dt = sim_time_ns() - t0;
+
+	pthread_mutex_lock(&sim_stage.lock);
+	sim_stage.ns[stage] += dt;
+	pthread_mutex_unlock(&sim_stage.lock);
+
+	return dt;
+}
+
+
+/**
+ * @brief get the accumulated time of a stage in ns
+ */
+
+static int64_t fee_sim_stage_get(unsigned int stage)
+{
+	int64_t ns;
+
+
+	pthread_mutex_lock(&sim_stage.lock);
+	ns = sim_stage.ns[stage];
+	pthread_mutex_unlock(&sim_stage.lock);
+
+	return ns;
+}
+
 
-#define SIM_WANDERING_MASK_COL_START	2
-#define SIM_WANDERING_MASK_ROW_START	2
-#define SIM_WANDERING_MASK_COL_END	(FEE_EDU_FRAME_6x6_COLS - 2)
-#define SIM_WANDERING_MASK_ROW_END	(FEE_EDU_FRAME_6x6_ROWS - 2)
 
 struct {
 	uint16_t col;
 	uint16_t row;
-} sim_w_mask = {SIM_WANDERING_MASK_COL_START, SIM_WANDERING_MASK_ROW_START};
+} sim_w_mask = {FEE_WANDERING_MASK_COL_START, FEE_WANDERING_MASK_ROW_START};
 
 struct fee_data_payload {
 	struct fee_data_pkt *pkt;
@@ -185,12 +270,8 @@ struct fee_data_payload {
 #define RUTHERFORD_SCATTER_ANGLE_MAX	90
 /* solar activity selector, range 0-1 */
 #define SOLAR_ACT		1.0
-/* number of pre-computed dark samples for faster simulation */
-#define DARK_SAMPLES		128
 /* simulate dark current (0/1) */
 #define CFG_SIM_DARK		0
-/* number of pre-computed readout noise samples for faster simulation */
-#define RD_NOISE_SAMPLES	128
 
 /* probability of charge transfer inefficiency occuring in a column */
 #define CTI_PROB		0.1
@@ -240,52 +321,279 @@ static void save_fits(const char *name, uint16_t *buf, long rows, long cols)
 #endif /* SIM_DUMP_FITS */
 
 /**
- * @brief get a random number between 0 and 1 following a logarithmic
- * distribution
- * @note the base resolution is fixed to 1/1000
+ * the random numbers are generated by xoshiro128** (Blackman & Vigna);
+ * each task of a refresh uses its own stream, derived from the seed, the
+ * refresh and the task index, so a run is reproducible for a given seed
+ * regardless of the number of threads
+ */
+
+#define SIM_RAND_MAX	0xFFFFFFFFUL
+
+struct ccd_sim_rng {
+	uint32_t s[4];		/* xoshiro128** state */
+	int gen;		/* box-muller: second value available */
+	float u, v;
+};
+
+/* the generator of the simulator thread, stream 0 */
+static struct ccd_sim_rng sim_rng;
+
+static uint64_t sim_seed;
+static uint64_t sim_refresh_cnt;
+static int sim_seeded;
+
+
+/**
+ * @brief the splitmix64 generator, used to expand a seed
+ */
+
+static uint64_t sim_splitmix64(uint64_t *x)
+{
+	uint64_t z;
+
+
+	(*x) += 0x9E3779B97F4A7C15ULL;
+
+	z = (*x);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+	return z ^ (z >> 31);
+}
+
+
+/**
+ * @brief seed a random number generator
+ *
+ * @param stream selects an independent sequence for the same seed
+ */
+
+static void ccd_sim_rng_seed(struct ccd_sim_rng *rng, uint64_t seed,
+			     uint64_t stream)
+{
+	uint64_t x;
+	uint64_t z;
+
+
+	x = seed ^ sim_splitmix64(&stream);
+
+	z = sim_splitmix64(&x);
+	rng->s[0] = (uint32_t) z;
+	rng->s[1] = (uint32_t) (z >> 32);
+
+	z = sim_splitmix64(&x);
+	rng->s[2] = (uint32_t) z;
+	rng->s[3] = (uint32_t) (z >> 32);
+
+	/* the all-zero state is invalid */
+	if (!(rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]))
+		rng->s[0] = 1;
+
+	rng->gen = 0;
+}
+
+
+static inline uint32_t sim_rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+
+/**
+ * @brief get a random number between 0 and SIM_RAND_MAX
  */
-static float sim_rand_log(void)
+
+static inline uint32_t sim_rand(struct ccd_sim_rng *rng)
 {
-#define LOG_RAND_RES 1000
-	float u;
-	const float res = 1.0 / LOG_RAND_RES;
+	uint32_t *s = rng->s;
+	uint32_t r;
+	uint32_t t;
 
-	u = 1.0 - res * (rand() % LOG_RAND_RES);
 
-	return log(u) / log(res);
+	r = sim_rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+
+	s[2] ^= t;
+
+	s[3] = sim_rotl(s[3], 11);
+
+	return r;
+}
+
+
+/**
+ * @brief set the seed of the simulator
+ *
+ * @note call before fee_sim_main()
+ */
+
+void fee_sim_seed(uint64_t seed)
+{
+	sim_seed        = seed;
+	sim_refresh_cnt = 0;
+	sim_seeded      = 1;
+
+	ccd_sim_rng_seed(&sim_rng, sim_seed, 0);
 }
 
 
+/**
+ * @brief get a uniformly distributed random number in [0, max)
+ */
+
+static float sim_rand_uniform(struct ccd_sim_rng *rng, double max)
+{
+	return (float) (sim_rand(rng) * (max / (SIM_RAND_MAX + 1.0)));
+}
+
 
 /**
  * @brief a box-muller gaussian-like distribution
  */
 
-static float sim_rand_gauss(void)
+static float sim_rand_gauss(struct ccd_sim_rng *rng)
+{
+	rng->gen = !rng->gen;
+
+	if (!rng->gen)
+		return sqrtf(- 2.0 * logf(rng->u)) * cosf(2.0 * M_PI * rng->v);
+
+	rng->u = (sim_rand(rng) + 1.0) / (SIM_RAND_MAX + 2.0);
+	rng->v =  sim_rand(rng)        / (SIM_RAND_MAX + 1.0);
+
+	return sqrtf(-2.0 * logf(rng->u)) * sinf(2.0 * M_PI * rng->v);
+}
+
+
+/**
+ * X-ray and particle events hit only a tiny fraction of the pixels of a CCD
+ * half at nominal rates, so the pixels hit in a refresh are recorded; the
+ * next refresh clears only these and the binned readout sums only these,
+ * while the CCD halves themselves remain valid for the unbinned readouts
+ */
+
+#define CCD_SIM_HITS_MIN	1024	/* initial size of a hit list */
+
+struct ccd_sim_hits {
+	uint32_t *pix;		/* indices of the pixels hit */
+	size_t cnt;
+	size_t size;
+	int overflow;		/* set if not all hits could be recorded */
+};
+
+
+/**
+ * @brief record a pixel in a hit list
+ */
+
+static void ccd_sim_hits_add(struct ccd_sim_hits *hits, size_t pix)
+{
+	size_t size;
+	uint32_t *p;
+
+
+	if (hits->cnt == hits->size) {
+
+		size = hits->size ? 2 * hits->size : CCD_SIM_HITS_MIN;
+
+		p = realloc(hits->pix, size * sizeof(uint32_t));
+		if (!p) {
+			hits->overflow = 1;
+			return;
+		}
+
+		hits->pix  = p;
+		hits->size = size;
+	}
+
+	hits->pix[hits->cnt++] = (uint32_t) pix;
+}
+
+
+/**
+ * @brief add charge to a pixel, saturating
+ *
+ * @note the pixels of a band may also be hit from a neighbouring band,
+ *	 so the update is atomic
+ *
+ * @note a pixel is added to the hit list by whoever charges it first, so
+ *	 each pixel hit is recorded exactly once
+ */
+
+static void ccd_sim_pix_add(struct ccd_sim_hits *hits, uint16_t *frame,
+			    size_t pix, float val)
 {
-	static int gen;
+	uint16_t old;
+	uint16_t new;
+	uint32_t sum;
+
+
+	if (pix >= FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS)
+		return;
+
+	if (val < 1.)
+		return;
+
+	old = __atomic_load_n(&frame[pix], __ATOMIC_RELAXED);
+
+	do {
+		if (val > (float) PIX_SATURATION)
+			sum = PIX_SATURATION;
+		else
+			sum = old + (uint32_t) val;
+
+		if (sum > PIX_SATURATION)
+			sum = PIX_SATURATION;
+
+		new = (uint16_t) sum;
+
+	} while (!__atomic_compare_exchange_n(&frame[pix], &old, new, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (!old)
+		ccd_sim_hits_add(hits, pix);
+}
+
+
+/**
+ * @brief get the number of events for a CCD half in the integration time
+ *
+ * @param rate the event rate in counts/CCD/s
+ */
 
-	static float u, v;
+static size_t ccd_sim_get_events(uint16_t tint_ms, float rate)
+{
+	const float sigma = 1.0;
+	float amp;
+	float tint = (float) tint_ms / 1000.0;
 
 
-	gen = !gen;
+	/* our event amplitude is the integration time for the configured
+	 * event rates
+	 */
+	amp = tint * rate;
 
-	if (!gen)
-		return sqrtf(- 2.0 * logf(u)) * cosf(2.0 * M_PI * v);
+	/* use the square of the amplitude to scale the noise */
+	amp = amp + sqrtf(amp) * sigma * sim_rand_gauss(&sim_rng);
 
-	u = (rand() + 1.0) / (RAND_MAX + 2.0);
-	v =  rand()        / (RAND_MAX + 1.0);
+	if (amp < 0.)
+		return 0;
 
-	return sqrtf(-2.0 * logf(u)) * sinf(2.0 * M_PI * v);
+	return (size_t) amp / 2;
 }
 
 
-static uint16_t ccd_sim_get_swcx_ray(void)
+static uint16_t ccd_sim_get_swcx_ray(struct ccd_sim_rng *rng)
 {
 	float p;
 
 	/* we assume the incident x-ray energy is uniformly distributed */
-	p = fmodf(rand(), (SWCX_PHOT_EV_MAX + 1 - SWCX_PHOT_EV_MIN) * 1000.) * 0.001;
+	p = fmodf(sim_rand(rng), (SWCX_PHOT_EV_MAX + 1 - SWCX_PHOT_EV_MIN) * 1000.) * 0.001;
         p += SWCX_PHOT_EV_MIN;
 	p *= e_PER_eV;
 	p *= CDD_RESP_uV_e;	/* scale to voltage-equivalent */
@@ -297,37 +605,35 @@ static uint16_t ccd_sim_get_swcx_ray(void)
 }
 
 
-static void ccd_sim_add_swcx(uint16_t *frame, uint16_t tint_ms)
+/**
+ * @brief add SWCX events to a band of rows of a CCD half
+ *
+ * @param row the first row of the band
+ * @param rows the number of rows in the band
+ * @param cnt the number of events
+ */
+
+static void ccd_sim_add_swcx(struct ccd_sim_rng *rng,
+			     struct ccd_sim_hits *hits, uint16_t *frame,
+			     size_t row, size_t rows, size_t cnt)
 {
 	size_t n = FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS;
-	const float sigma = 1.0;
-	float amp;
 	float ray;
-	float tint = (float) tint_ms / 1000.0;
 
 	size_t i;
 	size_t x, y;
 	size_t pix;
 
 
-	/* our event amplitude is the integration time for the configured
-	 * event rates
-	 */
-	amp = tint * (SWCX_CCD_RATE_MIN + SOLAR_ACT * (SWCX_CCD_RATE_MAX - SWCX_CCD_RATE_MIN));
-
-	/* use the square of the amplitude to scale the noise */
-	amp = amp + sqrtf(amp) * sigma * sim_rand_gauss();
-
-	printf("SWCX: %d rays produced\n", (int) amp/2);
+	for (i = 0; i < cnt; i++) {
 
-	for (i = 0; i < ((size_t) amp / 2); i++) {
-
-		ray = ccd_sim_get_swcx_ray();
-		pix = rand() % (n + 1);
+		ray = ccd_sim_get_swcx_ray(rng);
+		pix = row * FEE_CCD_IMG_SEC_COLS
+			+ sim_rand(rng) % (rows * FEE_CCD_IMG_SEC_COLS);
 
 		/* trigger on random occurence (retval != 0) */
-		if (rand() % ((int) (1. / MULTIPIX_HIT_PROB))) {
-			frame[pix] += ray;
+		if (sim_rand(rng) % ((int) (1. / MULTIPIX_HIT_PROB))) {
+			ccd_sim_pix_add(hits, frame, pix, ray);
 		} else {
 			float fray = (float) ray;
 			x = pix % FEE_CCD_IMG_SEC_COLS;
@@ -338,20 +644,20 @@ static void ccd_sim_add_swcx(uint16_t *frame, uint16_t tint_ms)
 			 * to adjacent pixels
 			 */
 			while (fray > 0.0) {
-				int yy = 1 - rand() % 2;
-				int xx = 1 - rand() % 2;
+				int yy = 1 - sim_rand(rng) % 2;
+				int xx = 1 - sim_rand(rng) % 2;
 				ssize_t pp = (yy + y) * FEE_CCD_IMG_SEC_COLS + (xx + x);
-				float bleedoff = ((float) (rand() % 100)) * 0.01 * fray;
+				float bleedoff = ((float) (sim_rand(rng) % 100)) * 0.01 * fray;
 
 				/* out of bounds? */
-				if (pp < 0 || pp > (ssize_t) n)
+				if (pp < 0 || pp >= (ssize_t) n)
 					continue;
 
 				/* make sure to reasonably abort the loop */
 				if (bleedoff < 0.05 * (float) ray)
 					bleedoff = fray;
 
-				frame[pp] += bleedoff;
+				ccd_sim_pix_add(hits, frame, pp, bleedoff);
 				fray -= bleedoff;
 			}
 		}
@@ -359,68 +665,153 @@ static void ccd_sim_add_swcx(uint16_t *frame, uint16_t tint_ms)
 }
 
 
+/**
+ * @brief add SXRB events to a band of rows of a CCD half
+ */
 
-static void ccd_sim_add_sxrb(uint16_t *frame, uint16_t tint_ms)
+static void ccd_sim_add_sxrb(struct ccd_sim_rng *rng,
+			     struct ccd_sim_hits *hits, uint16_t *frame,
+			     size_t row, size_t rows, size_t cnt)
 {
-	size_t n = FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS;
-	const float sigma = 1.0;
-	float amp;
-	float tint = (float) tint_ms / 1000.0;
-
 	size_t i;
+	size_t pix;
 
 	/* XXX add configurable CTI effect */
 
-	/* our event amplitude is the integration time for the configured
-	 * event rates
-	 */
-	amp = tint * SXRB_CCD_RATE;
-
-	/* use the square of the amplitude to scale the noise */
-	amp = amp + sqrtf(amp) * sigma * sim_rand_gauss();
 	/* we use the same energies as SWCX */
-	for (i = 0; i < ((size_t) amp / 2); i++)
-		frame[rand() % (n + 1)] += ccd_sim_get_swcx_ray();
+	for (i = 0; i < cnt; i++) {
+		pix = row * FEE_CCD_IMG_SEC_COLS
+			+ sim_rand(rng) % (rows * FEE_CCD_IMG_SEC_COLS);
+		ccd_sim_pix_add(hits, frame, pix, ccd_sim_get_swcx_ray(rng));
+	}
 }
 
 
 /**
- * @brief get a particle within the given energy range distribution
+ * the particle energies and the deflection angles are drawn from a fixed
+ * number of discrete values, so these and the angle-dependent term of the
+ * scattering cross section are tabulated once and the particle traces
+ * need no transcendental functions except for their direction
+ */
+
+/* the deflection angle resolution */
+#define CCD_SIM_DEFLECT_STEPS	1000
+
+/* the number of energy range exponents in steps of 1/1000, derived from the
+ * particle energy ranges in ccd_sim_particle_lut_init()
+ */
+static unsigned int ccd_sim_cosmic_steps;
+static unsigned int ccd_sim_solar_steps;
+
+static float *ccd_sim_cosmic_lut;
+static float ccd_sim_deflect_lut[CCD_SIM_DEFLECT_STEPS];
+static float ccd_sim_scatter_lut[CCD_SIM_DEFLECT_STEPS];
+static int ccd_sim_lut_ready;
+
+
+/**
+ * @brief get the number of energy range exponents of a particle energy range
+ *	  in steps of 1/1000
  */
 
-static float ccd_sim_get_cosmic_particle(void)
+static unsigned int ccd_sim_particle_steps(double ev_min, double ev_max)
 {
-	const float pmin = log10f(COSMIC_PARTICLE_EV_MIN);
-	const float pmax = log10f(COSMIC_PARTICLE_EV_MAX);
+	return (unsigned int) lround((log10(ev_max) + 1. - log10(ev_min)) * 1000.);
+}
 
-	float r, p;
 
-	/* get a energy range exponent */
-	r = fmodf(rand(), (pmax + 1. - pmin) * 1000.) * 0.001;
-	/* distribute to (logarithmic) particle rate */
-	r = PARTICLE_RATE_DROP(r);
+/**
+ * @brief fill the particle tables
+ *
+ * @note the scattering fraction of protons on Si atoms for a CCD pixel
+ *	 is approximated from the Rutherford cross section; this requires
+ *	 the target to only be a few µm thick and preferably uses alpha
+ *	 particles as projectiles. We're only interested in an approximate
+ *	 behaviour, so we can easily get away with any deviations.
+ */
 
-	/* get energy of the particle */
-	p = COSMIC_PARTICLE_EV_MIN + (COSMIC_PARTICLE_EV_MAX - COSMIC_PARTICLE_EV_MIN) * r;
-	p *= e_PER_eV;
+static void ccd_sim_particle_lut_init(void)
+{
+	size_t i;
 
-	return p;
+	double r;
+	double u;
+	double theta;
+	double sigma;
+
+	const double Z  = 14.;				/* atomic number of Si */
+	const double A  = 2.* Z;			/* mass number of  Si */
+	const double rho= 2.33 * 1000.;			/* density of Si (kg/m^3) */
+	const double k  = 8.9875517923e9;		/* Coloumb's constant */
+	const double e  = -1.602176634e-19;		/* electron charge */
+	const double eV = -e;				/* 1 eV in J */
+	const double NA = 6.02214076e23;		/* Avogadro's number */
+	const double L  = CCD_THICKNESS_um * 1e-6;	/* target thickness */
+
+	const double res = 1.0 / CCD_SIM_DEFLECT_STEPS;
+
+
+	if (ccd_sim_lut_ready)
+		return;
+
+	ccd_sim_solar_steps  = ccd_sim_particle_steps(SOLAR_PARTICLE_EV_MIN,
+						      SOLAR_PARTICLE_EV_MAX);
+	ccd_sim_cosmic_steps = ccd_sim_particle_steps(COSMIC_PARTICLE_EV_MIN,
+						      COSMIC_PARTICLE_EV_MAX);
+
+	ccd_sim_cosmic_lut = malloc(ccd_sim_cosmic_steps * sizeof(float));
+	if (!ccd_sim_cosmic_lut) {
+		perror("malloc");
+		exit(-1);
+	}
+
+	/* energy range exponent, distributed to (logarithmic) particle rate */
+	for (i = 0; i < ccd_sim_cosmic_steps; i++) {
+		r = PARTICLE_RATE_DROP(i * 0.001);
+		ccd_sim_cosmic_lut[i] = (COSMIC_PARTICLE_EV_MIN + (COSMIC_PARTICLE_EV_MAX - COSMIC_PARTICLE_EV_MIN) * r) * e_PER_eV;
+	}
+
+	for (i = 0; i < CCD_SIM_DEFLECT_STEPS; i++) {
+
+		/* log distribution */
+		u = 1.0 - res * i;
+		theta = log(u) / log(res) * (RUTHERFORD_SCATTER_ANGLE_MAX / 180. * M_PI);
+
+		/* the cross section without the projectile charge factor
+		 * and the energy, which are applied per particle; infinite
+		 * for theta = 0, i.e. the fraction saturates
+		 */
+		r = (1. + cos(theta)) / (1. - cos(theta));
+		sigma = M_PI * pow(Z, 2.) * pow(k * pow(e, 2.) / eV, 2.) * r;
+
+		ccd_sim_deflect_lut[i] = theta;
+		ccd_sim_scatter_lut[i] = (NA * L * rho * sigma) / (A * 1e-3);
+	}
+
+	ccd_sim_lut_ready = 1;
 }
 
 
 /**
- * @brief get a solar particle within the given energy range distribution
+ * @brief get a particle within the given energy range distribution
  */
 
-static float ccd_sim_get_solar_particle(void)
+static float ccd_sim_get_cosmic_particle(struct ccd_sim_rng *rng)
 {
-	const float pmin = log10f(SOLAR_PARTICLE_EV_MIN);
-	const float pmax = log10f(SOLAR_PARTICLE_EV_MAX);
+	return ccd_sim_cosmic_lut[sim_rand(rng) % ccd_sim_cosmic_steps];
+}
+
+
+/**
+ * @brief get a solar particle within the given energy range distribution
+ */
 
+static float ccd_sim_get_solar_particle(struct ccd_sim_rng *rng)
+{
 	float r, p;
 
 	/* get a energy range exponent */
-	r = fmodf(rand(), (pmax + 1. - pmin) * 1000.) * 0.001;
+	r = (sim_rand(rng) % ccd_sim_solar_steps) * 0.001;
 
 	/* we assume equal probability for solar wind components */
 
@@ -437,39 +828,24 @@ static float ccd_sim_get_solar_particle(void)
  *	  a CCD pixel
  *
  * @param p_eV the energy of the particle
- * @param theta the (minimum) scattering angle for the fraction scattered
+ * @param defl the index of the (minimum) scattering angle for the
+ *	  fraction scattered in ccd_sim_deflect_lut
  *
- * @note Rutherford scattering requires the target to only be a few µm thick
- *	 and preferably uses alpha particles as projectiles.
- *	 We're only interested in an approximate behaviour, so we can
- *	 easily get away with any deviations.
+ * @note see ccd_sim_particle_lut_init()
  */
 
-
-static float ccd_sim_get_scatter_fraction(float p_eV, float theta)
+static float ccd_sim_get_scatter_fraction(struct ccd_sim_rng *rng,
+					  float p_eV, unsigned int defl)
 {
-	float t, r;
-	float sigma;
 	float f;
 
-	/* we select between hydrogen and helium cores (~8%) */
-	const float zp = (float) ((rand() % 100) <= 8 ? 2 : 1);
-	const float Z  = 14.;				/* atomic number of Si */
-	const float A  = 2.* Z;				/* mass number of  Si */
-	const float rho= 2.33 * 1000.;			/* density of Si (kg/m^3) */
-	const float Zp = powf(zp, 2.) / 4.;		/* projectile charge factor */
-	const float k  = 8.9875517923e9;		/* Coloumb's constant */
-	const float e  = -1.602176634e-19;		/* electron charge */
-	const float eV = -e;				/* 1 eV in J */
-	const float NA = 6.02214076e23;			/* Avogadro's number */
-	const float L  = CCD_THICKNESS_um * 1e-6;	/* target thickness */
-
+	/* we select between hydrogen and helium cores (~8%), the
+	 * projectile charge factor is zp^2 / 4
+	 */
+	const float Zp = ((sim_rand(rng) % 100) <= 8) ? 1.0 : 0.25;
 
-	t = k * pow(e, 2.) / (p_eV * eV);
-	r = (1. + cosf(theta)) / (1. - cosf(theta));
-	sigma = M_PI * Zp * pow(Z, 2.) * pow(t, 2.) * r;
 
-	f = (NA * L * rho * sigma) / (A * 1e-3);
+	f = Zp * ccd_sim_scatter_lut[defl] / (p_eV * p_eV);
 
 	if (f > 1.0)
 		return 1.0;
@@ -480,18 +856,19 @@ static float ccd_sim_get_scatter_fraction(float p_eV, float theta)
 /**
  * @brief create particle traces in the CCD
  *
- * @param tint_ms the integration time in ms
+ * @param row the first row of the band the particles enter
+ * @param rows the number of rows in the band
+ * @param cnt the number of particles
  * @param solar 0 = cosmics, 1 = solar
  *
+ * @note traces may leave the band
  */
 
-static void ccd_sim_add_particles(uint16_t *frame, uint16_t tint_ms, int solar)
+static void ccd_sim_add_particles(struct ccd_sim_rng *rng,
+				  struct ccd_sim_hits *hits, uint16_t *frame,
+				  size_t row, size_t rows, size_t cnt,
+				  int solar)
 {
-	size_t n = FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS;
-	const float sigma = 1.0;
-	float amp;
-	float tint = (float) tint_ms / 1000.0;
-
 	size_t i;
 
 	float x, y;
@@ -501,57 +878,38 @@ static void ccd_sim_add_particles(uint16_t *frame, uint16_t tint_ms, int solar)
 	float dx, dy;
 	float d_ev;
 
-
-	float *ccd;
-
 	float deflection_angle;
+	unsigned int deflection;
 	unsigned int deflection_rate;
 
 
-	ccd = (float *) calloc(sizeof(float), n);
-	if (!ccd) {
-		perror("malloc");
-		exit(-1);
-	}
-
-	/* our event amplitude is the integration time for the configured
-	 * event rates
-	 */
-	if (solar)
-		amp = tint * (PB_CCD_RATE_MIN + (PB_CCD_RATE_MAX - PB_CCD_RATE_MIN) * SOLAR_ACT);
-	else
-		amp = tint * COSMIC_FLUX;
-
-	/* use the square of the amplitude to scale the noise */
-	amp = amp + sqrtf(amp) * sigma * sim_rand_gauss();
-
-	for (i = 0; i < ((size_t) amp / 2); i++) {
+	for (i = 0; i < cnt; i++) {
 
 
 		/* initial particle energy */
 		if (solar)
-			p_ev = ccd_sim_get_solar_particle();
+			p_ev = ccd_sim_get_solar_particle(rng);
 		else
-			p_ev = ccd_sim_get_cosmic_particle();
+			p_ev = ccd_sim_get_cosmic_particle(rng);
 
 
 
 		/* pixel of particle entry into CCD */
-		x = (float) (rand() % (FEE_CCD_IMG_SEC_COLS + 1));
-		y = (float) (rand() % (FEE_CCD_IMG_SEC_ROWS + 1));
+		x = (float) (sim_rand(rng) % (FEE_CCD_IMG_SEC_COLS + 1));
+		y = (float) (row + sim_rand(rng) % rows);
 
 
 		/* angle from CCD plane */
 		if (solar) /* shallow */
-			phi = fmod(rand(), SOLAR_WIND_EL_ANGLE_MAX * 1000.) * 0.001;
+			phi = sim_rand_uniform(rng, SOLAR_WIND_EL_ANGLE_MAX);
 		else
-			phi = fmod(rand(), M_PI_2 * 1000. ) * 0.001;
+			phi = sim_rand_uniform(rng, M_PI_2);
 
 		/* direction within plane */
 		if (solar) /* just one side */
-			theta = 0.5 * SOLAR_WIND_AZ_ANGLE_MAX - fmod(rand(),  SOLAR_WIND_AZ_ANGLE_MAX * 1000.) * 0.001;
+			theta = 0.5 * SOLAR_WIND_AZ_ANGLE_MAX - sim_rand_uniform(rng, SOLAR_WIND_AZ_ANGLE_MAX);
 		else	/* anywhere */
-			theta = M_PI - fmod(rand(), 2. * M_PI * 1000.) * 0.001;
+			theta = M_PI - sim_rand_uniform(rng, 2. * M_PI);
 
 
 restart:
@@ -559,17 +917,13 @@ restart:
 		d = CCD_THICKNESS_um / tanf(phi);
 
 		/* get a random deflection angle */
-#if 1
-		/* log distribution */
-		deflection_angle = sim_rand_log() * (RUTHERFORD_SCATTER_ANGLE_MAX / 180. * M_PI);
-#else
-		/* uniform */
-		deflection_angle = ((float) (1 + rand() % RUTHERFORD_SCATTER_ANGLE_MAX )) / 180. * M_PI;
-#endif
-		/* our rate for rand() */
-		deflection_rate =  (unsigned int) (1.0 / ccd_sim_get_scatter_fraction(p_ev, deflection_angle));
+		deflection = sim_rand(rng) % CCD_SIM_DEFLECT_STEPS;
+		deflection_angle = ccd_sim_deflect_lut[deflection];
+
+		/* our rate for sim_rand() */
+		deflection_rate =  (unsigned int) (1.0 / ccd_sim_get_scatter_fraction(rng, p_ev, deflection));
 #if 0
-		printf("deflection rate %u angle %g frac: %g ev %g\n", deflection_rate, deflection_angle / M_PI * 180., ccd_sim_get_scatter_fraction(p_ev, deflection_angle), p_ev);
+		printf("deflection rate %u angle %g frac: %g ev %g\n", deflection_rate, deflection_angle / M_PI * 180., ccd_sim_get_scatter_fraction(rng, p_ev, deflection), p_ev);
 #endif
 		/* step size in x and y direction, we compute
 		 * one pixel at a time and assume they are all cubes,
@@ -624,8 +978,9 @@ restart:
 			if (p_ev < 0.)
 				break;
 
+			/* saturates, TODO: bleed charges (maybe) */
 			pix = (size_t) y * FEE_CCD_IMG_SEC_COLS + (size_t) x;
-			ccd[pix] += d_ev * e_PER_eV * CDD_RESP_uV_e; // * (p_ev/p0) * logf(d/d0);
+			ccd_sim_pix_add(hits, frame, pix, d_ev * e_PER_eV * CDD_RESP_uV_e); // * (p_ev/p0) * logf(d/d0);
 
 			x += dx;
 			y += dy;
@@ -633,13 +988,13 @@ restart:
 			p_ev -= d_ev;
 			d -= r;
 
-			if (rand() % (deflection_rate + 1) == 0) {
-				float ratio = ((float) (rand(), 50)) * 0.01;
-				float sign = (rand() & 0x1 ? -1.0 : 1.0);
+			if (sim_rand(rng) % (deflection_rate + 1) == 0) {
+				float ratio = ((float) (sim_rand(rng), 50)) * 0.01;
+				float sign = (sim_rand(rng) & 0x1 ? -1.0 : 1.0);
 
 				/* deflect the sucker */
 				theta += sign * deflection_angle * ratio;
-				sign = (rand() & 0x1 ? -1.0 : 1.0);
+				sign = (sim_rand(rng) & 0x1 ? -1.0 : 1.0);
 				phi   += sign * deflection_angle * (1. - ratio);
 				goto restart;
 			}
@@ -647,37 +1002,170 @@ restart:
 		}
 
 	}
+}
+
+
+
+/**
+ * the noise is generated for SIM_NOISE_LANES pixels at a time by parallel
+ * xoshiro128** generators, which the compiler maps to SIMD registers; the
+ * gaussian is approximated by the sum of the 4 bytes of a uniform random
+ * number (Irwin-Hall), which needs neither a table nor any transcendental
+ * functions and is computed in fixed point
+ */
+
+#define SIM_NOISE_LANES		4	/* 128 bit vectors, e.g. SSE2 or NEON */
+
+#define SIM_IH_MEAN		510	/* 4 * 255 / 2 */
+#define SIM_IH_SIGMA		147.80	/* sqrt(4 * (256^2 - 1) / 12) */
+#define SIM_NOISE_FRAC		8	/* fixed point fractional bits */
+
+typedef uint32_t sim_v32 __attribute__((vector_size(SIM_NOISE_LANES * sizeof(uint32_t))));
+typedef int32_t sim_vs32 __attribute__((vector_size(SIM_NOISE_LANES * sizeof(int32_t))));
+typedef uint16_t sim_v16 __attribute__((vector_size(SIM_NOISE_LANES * sizeof(uint16_t))));
+
+struct ccd_sim_vrng {
+	sim_v32 s[4];
+};
+
+
+/**
+ * @brief seed the lanes of a vector generator from the simulator thread
+ */
+
+static void ccd_sim_vrng_seed(struct ccd_sim_vrng *v)
+{
+	int k;
+	int l;
+
+
+	for (l = 0; l < SIM_NOISE_LANES; l++) {
+
+		for (k = 0; k < 4; k++)
+			v->s[k][l] = sim_rand(&sim_rng);
+
+		/* the all-zero state is invalid */
+		if (!(v->s[0][l] | v->s[1][l] | v->s[2][l] | v->s[3][l]))
+			v->s[0][l] = 1;
+	}
+}
+
+
+/**
+ * @brief get SIM_NOISE_LANES random numbers, see sim_rand()
+ *
+ * @note returned via pointer, vectors are not passed by value, as that
+ *	 depends on the target's vector ABI
+ */
+
+static inline void sim_vrand(struct ccd_sim_vrng *v, sim_v32 *r)
+{
+	sim_v32 *s = v->s;
+	sim_v32 t;
+
+
+	/* multiplications as shifts, SSE2 has no 32 bit vector multiply */
+	(*r) = (s[1] << 2) + s[1];
+	(*r) = ((*r) << 7) | ((*r) >> 25);
+	(*r) = ((*r) << 3) + (*r);
+	t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+
+	s[2] ^= t;
+
+	s[3] = (s[3] << 11) | (s[3] >> 21);
+}
+
+
+/**
+ * @brief add gaussian noise to the pixels of a CCD half, saturating
+ *
+ * @param mean the mean of the noise in ADU
+ * @param sigma the standard deviation of the noise in ADU
+ *
+ * @note negative noise values are clipped to zero
+ */
+
+static void ccd_sim_add_noise(struct ccd_sim_vrng *v, uint16_t *ccd, size_t n,
+			      float mean, float sigma)
+{
+	size_t i;
+	size_t l;
+	size_t lanes;
+
+	int32_t m;
+	int32_t k;
+
+	sim_v32 r;
+	sim_v16 q;
+	sim_vs32 g;
+	sim_vs32 p;
+
+	/* a local copy is kept in registers */
+	struct ccd_sim_vrng lv = (*v);
 
-	for (i = 0; i < n; i++) {
 
-		float tot = frame[i] + ccd[i];
+	m = (int32_t) (mean * (1 << SIM_NOISE_FRAC));
+	k = (int32_t) (sigma / SIM_IH_SIGMA * (1 << SIM_NOISE_FRAC));
 
-		if (tot < (float) PIX_SATURATION)
-			frame[i] = (uint16_t) tot;
-		else /* else saturate, TODO: bleed charges (maybe) */
-			frame[i] = PIX_SATURATION;
+	for (i = 0; i < n; i += SIM_NOISE_LANES) {
+
+		sim_vrand(&lv, &r);
+
+		g = (sim_vs32) ((r & 0xff) + ((r >> 8) & 0xff)
+				+ ((r >> 16) & 0xff) + (r >> 24));
+
+		g = (m + (g - SIM_IH_MEAN) * k) >> SIM_NOISE_FRAC;
+		g &= (g > 0);
+
+		lanes = n - i;
+		if (lanes > SIM_NOISE_LANES)
+			lanes = SIM_NOISE_LANES;
+
+		/* the pixels may not be aligned to the vector size */
+		if (lanes == SIM_NOISE_LANES) {
+			memcpy(&q, &ccd[i], sizeof(q));
+		} else {
+			q = q ^ q;
+			for (l = 0; l < lanes; l++)
+				q[l] = ccd[i + l];
+		}
+
+		p = __builtin_convertvector(q, sim_vs32) + g;
+		p = (p & (p <= PIX_SATURATION)) | (PIX_SATURATION & (p > PIX_SATURATION));
+		q = __builtin_convertvector(p, sim_v16);
+
+		if (lanes == SIM_NOISE_LANES) {
+			memcpy(&ccd[i], &q, sizeof(q));
+		} else {
+			for (l = 0; l < lanes; l++)
+				ccd[i + l] = q[l];
+		}
 	}
 
-
-	free(ccd);
+	(*v) = lv;
 }
 
 
-
 /**
  * we don't really need a dark sim, the effective amplitude variation is way
  * to low to be significant
  */
+/* the deviation of the dark samples, i.e. (essentially) none */
+#define CCD_DARK_SIGMA	(0.001 * CDD_RESP_uV_e)
+
 __attribute__((unused))
 static void ccd_sim_add_dark(uint16_t tint_ms)
 {
-	float *noisearr;
 	size_t n = FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS;
 	float amp;
 	float tint = (float) tint_ms / 1000.0;
 
-	size_t i;
-
+	struct ccd_sim_vrng v;
 
 
 	/* total average accumulated dark current amplitude */
@@ -686,63 +1174,55 @@ static void ccd_sim_add_dark(uint16_t tint_ms)
 	/* use the square of the amplitude to scale the noise */
 	amp = amp + sqrtf(amp);
 
-	noisearr = (float *) calloc(sizeof(float), DARK_SAMPLES);
-	if (!noisearr) {
-		perror("malloc");
-		exit(-1);
-	}
-
-	for (i = 0; i < DARK_SAMPLES; i++) {
-		noisearr[i] =  amp + fmodf(sim_rand_gauss(), CCD_DAR_NONUNI * 1000.) * 0.001;
-		noisearr[i]*= CDD_RESP_uV_e;	/* scale to voltage-equivalent */
-	}
-
+	ccd_sim_vrng_seed(&v);
 
-	/* fill CCDs */
-	for (i = 0; i < n; i++) {
-		CCD2E[i] += noisearr[rand() % (DARK_SAMPLES + 1)];
-		CCD2F[i] += noisearr[rand() % (DARK_SAMPLES + 1)];
-		CCD4E[i] += noisearr[rand() % (DARK_SAMPLES + 1)];
-		CCD4F[i] += noisearr[rand() % (DARK_SAMPLES + 1)];
-	}
-
-	free(noisearr);
+	/* fill CCDs, scaled to voltage-equivalent */
+	ccd_sim_add_noise(&v, CCD2E, n, amp * CDD_RESP_uV_e, CCD_DARK_SIGMA);
+	ccd_sim_add_noise(&v, CCD2F, n, amp * CDD_RESP_uV_e, CCD_DARK_SIGMA);
+	ccd_sim_add_noise(&v, CCD4E, n, amp * CDD_RESP_uV_e, CCD_DARK_SIGMA);
+	ccd_sim_add_noise(&v, CCD4F, n, amp * CDD_RESP_uV_e, CCD_DARK_SIGMA);
 }
 
 
-static void ccd_sim_add_rd_noise(uint16_t *ccd, size_t n)
+/**
+ * @brief add readout noise to a frame using a given generator
+ */
+
+static void ccd_sim_add_readout_noise(struct ccd_sim_vrng *v, uint16_t *ccd,
+				      size_t n)
 {
-	float *noisearr;
 	const float sigma = 1.0;
 	float amp;
 
-	size_t i;
-
-	struct timeval t0, t;
-	double elapsed_time;
 
-	gettimeofday(&t0, NULL);
 	/* total average accumulated dark current amplitude */
 	amp = CCD_NOISE;
 
-	noisearr = (float *) calloc(sizeof(float), RD_NOISE_SAMPLES);
-	if (!noisearr) {
-		perror("malloc");
-		exit(-1);
-	}
+	/* use the square of the amplitude to scale the noise,
+	 * scaled to voltage-equivalent
+	 */
+	ccd_sim_add_noise(v, ccd, n, amp * CDD_RESP_uV_e,
+			  sqrtf(amp) * sigma * CDD_RESP_uV_e);
+}
 
-	for (i = 0; i < RD_NOISE_SAMPLES; i++) {
-		/* use the square of the amplitude to scale the noise */
-		noisearr[i] =  amp + sqrtf(amp) * sigma * sim_rand_gauss();
-		noisearr[i]*= CDD_RESP_uV_e;	/* scale to voltage-equivalent */
-	}
 
+/**
+ * @brief add readout noise to a frame
+ */
+
+__attribute__((unused))
+static void ccd_sim_add_rd_noise(uint16_t *ccd, size_t n)
+{
+	struct timeval t0, t;
+	double elapsed_time;
+
+	struct ccd_sim_vrng v;
 
-	/* add noise */
-	for (i = 0; i < n; i++)
-		ccd[i] += noisearr[rand() % (RD_NOISE_SAMPLES + 1)];
 
-	free(noisearr);
+	gettimeofday(&t0, NULL);
+
+	ccd_sim_vrng_seed(&v);
+	ccd_sim_add_readout_noise(&v, ccd, n);
 
 	/* time elapsed in ms */
 	gettimeofday(&t, NULL);
@@ -753,60 +1233,190 @@ static void ccd_sim_add_rd_noise(uint16_t *ccd, size_t n)
 
 
 
+/**
+ * the CCD halves are refreshed in parallel by the worker pool; each half is
+ * split into bands of rows, which are first cleared, then the events
+ * entering a band are generated; see ccd_sim_refresh()
+ */
+
+/* the number of row bands per CCD half */
+#define CCD_SIM_BANDS		8
+#define CCD_SIM_TASKS		(4 * CCD_SIM_BANDS)
+
+static struct fee_sim_pool *sim_pool;
+
+/* the hits of each task, i.e. of each band of a CCD half */
+static struct ccd_sim_hits ccd_sim_hits[CCD_SIM_TASKS];
+
+/* set if all pixels hit in a CCD half are known, otherwise it is dense */
+static int ccd_sim_sparse[4];
+
+struct ccd_sim_job {
+	uint16_t *frame[4];
+
+	/* the number of events per CCD half */
+	size_t swcx[4];
+	size_t sxrb[4];
+	size_t cosmic[4];
+	size_t solar[4];
+
+	uint64_t stream;	/* of the first task */
+};
+
+
+/**
+ * @brief get the first row of a band
+ */
+
+static size_t ccd_sim_band_row(unsigned int band)
+{
+	return (size_t) band * FEE_CCD_IMG_SEC_ROWS / CCD_SIM_BANDS;
+}
+
+
+/**
+ * @brief get the share of a band in a number of events
+ */
+
+static size_t ccd_sim_band_cnt(size_t cnt, unsigned int band)
+{
+	return cnt * (band + 1) / CCD_SIM_BANDS - cnt * band / CCD_SIM_BANDS;
+}
+
+
+/**
+ * @brief clear a band of rows of a CCD half
+ *
+ * @note if the CCD half is sparse, the pixels hit by the task of the band
+ *	 in the last refresh are cleared instead, these may be anywhere
+ */
+
+static void ccd_sim_clear_task(void *arg, unsigned int idx)
+{
+	size_t i;
+	size_t row;
+	size_t rows;
+	unsigned int half = idx / CCD_SIM_BANDS;
+	unsigned int band = idx % CCD_SIM_BANDS;
+
+	uint16_t *frame;
+	struct ccd_sim_hits *hits = &ccd_sim_hits[idx];
+	struct ccd_sim_job *job = (struct ccd_sim_job *) arg;
+
+
+	frame = job->frame[half];
+
+	if (ccd_sim_sparse[half]) {
+		for (i = 0; i < hits->cnt; i++)
+			frame[hits->pix[i]] = 0;
+	} else {
+		row  = ccd_sim_band_row(band);
+		rows = ccd_sim_band_row(band + 1) - row;
+
+		memset(&frame[row * FEE_CCD_IMG_SEC_COLS], 0,
+		       rows * FEE_CCD_IMG_SEC_COLS * sizeof(uint16_t));
+	}
+
+	hits->cnt      = 0;
+	hits->overflow = 0;
+}
+
+
+/**
+ * @brief generate the events entering a band of rows of a CCD half
+ */
 
-static void ccd_sim_clear(void)
+static void ccd_sim_event_task(void *arg, unsigned int idx)
 {
-	size_t n = FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS * sizeof(uint16_t);
+	size_t row;
+	size_t rows;
+	unsigned int half = idx / CCD_SIM_BANDS;
+	unsigned int band = idx % CCD_SIM_BANDS;
+
+	uint16_t *frame;
+	struct ccd_sim_rng rng;
+	struct ccd_sim_hits *hits = &ccd_sim_hits[idx];
+	struct ccd_sim_job *job = (struct ccd_sim_job *) arg;
+
+
+	ccd_sim_rng_seed(&rng, sim_seed, job->stream + idx);
 
-	memset(CCD2E, 0, n);
-	memset(CCD2F, 0, n);
-	memset(CCD4E, 0, n);
-	memset(CCD4F, 0, n);
+	frame = job->frame[half];
+	row   = ccd_sim_band_row(band);
+	rows  = ccd_sim_band_row(band + 1) - row;
+
+	ccd_sim_add_swcx(&rng, hits, frame, row, rows,
+			 ccd_sim_band_cnt(job->swcx[half], band));
+
+	ccd_sim_add_sxrb(&rng, hits, frame, row, rows,
+			 ccd_sim_band_cnt(job->sxrb[half], band));
+
+	/* solar and cosmic particles */
+	ccd_sim_add_particles(&rng, hits, frame, row, rows,
+			      ccd_sim_band_cnt(job->cosmic[half], band), 0);
+	ccd_sim_add_particles(&rng, hits, frame, row, rows,
+			      ccd_sim_band_cnt(job->solar[half], band), 1);
 }
 
+
 static void ccd_sim_refresh(void)
 {
-	struct timeval t0, t;
-	double elapsed_time;
+	int64_t t0, dt;
 
+	unsigned int i, j;
 	uint16_t tint_ms;
 
+	struct ccd_sim_job job;
 
 
-	gettimeofday(&t0, NULL);
 
-	ccd_sim_clear();
+	t0 = sim_time_ns();
+
+	ccd_sim_particle_lut_init();
 
 	tint_ms = smile_fee_get_int_sync_period();
 
+	job.frame[0] = CCD2E;
+	job.frame[1] = CCD2F;
+	job.frame[2] = CCD4E;
+	job.frame[3] = CCD4F;
+
+	for (i = 0; i < 4; i++) {
+		job.swcx[i]   = ccd_sim_get_events(tint_ms, SWCX_CCD_RATE_MIN + SOLAR_ACT * (SWCX_CCD_RATE_MAX - SWCX_CCD_RATE_MIN));
+		job.sxrb[i]   = ccd_sim_get_events(tint_ms, SXRB_CCD_RATE);
+		job.cosmic[i] = ccd_sim_get_events(tint_ms, COSMIC_FLUX);
+		job.solar[i]  = ccd_sim_get_events(tint_ms, PB_CCD_RATE_MIN + (PB_CCD_RATE_MAX - PB_CCD_RATE_MIN) * SOLAR_ACT);
+
+		SIM_INFO("SWCX: %lu rays produced\n", (unsigned long) job.swcx[i]);
+	}
+
+	/* stream 0 is the simulator thread */
+	sim_refresh_cnt++;
+	job.stream = sim_refresh_cnt * CCD_SIM_TASKS;
+
+	/* all bands must be clear before the events are added, as particle
+	 * traces may cross into neighbouring bands
+	 */
+	fee_sim_pool_run(sim_pool, ccd_sim_clear_task, &job, CCD_SIM_TASKS);
+
 	if (CFG_SIM_DARK)
 		ccd_sim_add_dark(tint_ms);
 
-	ccd_sim_add_swcx(CCD2E, tint_ms);
-	ccd_sim_add_swcx(CCD2F, tint_ms);
-	ccd_sim_add_swcx(CCD4E, tint_ms);
-	ccd_sim_add_swcx(CCD4F, tint_ms);
+	fee_sim_pool_run(sim_pool, ccd_sim_event_task, &job, CCD_SIM_TASKS);
 
-	ccd_sim_add_sxrb(CCD2E, tint_ms);
-	ccd_sim_add_sxrb(CCD2F, tint_ms);
-	ccd_sim_add_sxrb(CCD4E, tint_ms);
-	ccd_sim_add_sxrb(CCD4F, tint_ms);
+	for (i = 0; i < 4; i++) {
 
-	/* solar and cosmic particles */
-	ccd_sim_add_particles(CCD2E, tint_ms, 0);
-	ccd_sim_add_particles(CCD2E, tint_ms, 1);
-	ccd_sim_add_particles(CCD2F, tint_ms, 0);
-	ccd_sim_add_particles(CCD2F, tint_ms, 1);
-	ccd_sim_add_particles(CCD4E, tint_ms, 0);
-	ccd_sim_add_particles(CCD4E, tint_ms, 1);
-	ccd_sim_add_particles(CCD4F, tint_ms, 0);
-	ccd_sim_add_particles(CCD4F, tint_ms, 1);
+		ccd_sim_sparse[i] = !CFG_SIM_DARK;
 
-	/* time elapsed in ms */
-	gettimeofday(&t, NULL);
-	elapsed_time  = (t.tv_sec  - t0.tv_sec)  * 1000.0;
-	elapsed_time += (t.tv_usec - t0.tv_usec) / 1000.0;
-	printf("ccd refresh in %g ms\n", elapsed_time);
+		for (j = 0; j < CCD_SIM_BANDS; j++) {
+			if (ccd_sim_hits[i * CCD_SIM_BANDS + j].overflow)
+				ccd_sim_sparse[i] = 0;
+		}
+	}
+
+	dt = fee_sim_stage_add(FEE_SIM_STAGE_REFRESH, t0);
+
+	SIM_INFO("ccd refresh in %g ms\n", dt / 1e6);
 
 }
 /* end ccd sim */
@@ -819,14 +1429,7 @@ static void fee_sim_move_wandering_mask(void)
 
 
 	/* the mask always moves by 5 units (confirmed by test with FEE) */
-	sim_w_mask.col += 5;
-	if (sim_w_mask.col > SIM_WANDERING_MASK_COL_END) {
-		sim_w_mask.col = SIM_WANDERING_MASK_COL_START;
-
-		sim_w_mask.row += 5;
-		if (sim_w_mask.row > SIM_WANDERING_MASK_ROW_END)
-			sim_w_mask.row = SIM_WANDERING_MASK_ROW_START;
-	}
+	fee_wandering_mask_next(&sim_w_mask.col, &sim_w_mask.row);
 }
 
 
@@ -1098,6 +1701,56 @@ static struct fee_data_payload *fee_sim_create_data_payload(void)
 }
 
 
+/**
+ * the packets are sent by the thread of the transmit queue, so the paced
+ * transmission of a frame overlaps with the processing of the next
+ */
+
+static struct fee_sim_txq *sim_txq;
+
+
+/**
+ * @brief the transmit function of the queue
+ */
+
+static void fee_sim_tx(void *arg, uint8_t *buf, size_t n)
+{
+	fee_send_non_rmap((struct sim_net_cfg *) arg, buf, n);
+}
+
+
+/**
+ * @brief queue a packet for transmission
+ *
+ * @note without a queue, the packet is sent immediately
+ */
+
+static void fee_sim_send(struct sim_net_cfg *cfg, uint8_t *buf, size_t n)
+{
+	int64_t t0 = 0;
+
+
+	/* packets are only accounted for in the headless timing report */
+	if (sim_quiet)
+		t0 = sim_time_ns();
+
+	if (!sim_txq) {
+		fee_send_non_rmap(cfg, buf, n);
+	} else if (fee_sim_txq_put(sim_txq, buf, n)) {
+		perror("malloc");
+		exit(-1);
+	}
+
+	if (!sim_quiet)
+		return;
+
+	fee_sim_stage_add(FEE_SIM_STAGE_SEND, t0);
+
+	sim_stage.pkts++;
+	sim_stage.bytes += n;
+}
+
+
 /**
  * @brief send a data packet
  */
@@ -1111,7 +1764,7 @@ static void fee_sim_send_data_payload(struct sim_net_cfg *cfg,
 
 	/* send */
 	fee_sim_hdr_cpu_to_tgt(&pld->pkt->hdr);
-	fee_send_non_rmap(cfg, (uint8_t *) pld->pkt, n);
+	fee_sim_send(cfg, (uint8_t *) pld->pkt, n);
 	fee_sim_hdr_tgt_to_cpu(&pld->pkt->hdr);
 }
 
@@ -1139,7 +1792,7 @@ static void fee_sim_send_event_payload(struct sim_net_cfg *cfg,
 	/* swap header endianess for temporarily for transfer */
 	fee_sim_hdr_cpu_to_tgt(&pkt->hdr);
 
-	fee_send_non_rmap(cfg, (uint8_t *) pkt, sizeof(struct fee_event_detection));
+	fee_sim_send(cfg, (uint8_t *) pkt, sizeof(struct fee_event_detection));
 
 	fee_sim_hdr_tgt_to_cpu(&pkt->hdr);
 	fee_sim_hdr_inc_seq_cntr(&pkt->hdr);
@@ -1176,56 +1829,146 @@ void progress(double p)
 }
 
 /**
- * @brief send buffer in chunks according to the configuration
+ * @brief a payload generator, fills len bytes at offset off of a transfer
+ */
+
+typedef void (*fee_sim_pld_gen_t)(void *arg, uint8_t *dst,
+				  size_t off, size_t len);
+
+
+/**
+ * @brief payload generator of a linear buffer
+ */
+
+static void fee_sim_pld_gen_buf(void *arg, uint8_t *dst, size_t off, size_t len)
+{
+	memcpy(dst, &((uint8_t *) arg)[off], len);
+}
+
+
+/**
+ * @brief send a generated payload in chunks according to the configuration
+ *
+ * @param n the total number of payload bytes
+ * @param gen the generator filling the packet payloads
+ * @param arg the argument passed to the generator
  */
 #define LARGE 100000
-static void fee_sim_tx_payload_data(struct sim_net_cfg *cfg,
-				      struct fee_data_payload *pld,
-				      uint8_t *buf, size_t n)
+static void fee_sim_tx_payload_gen(struct sim_net_cfg *cfg,
+				   struct fee_data_payload *pld, size_t n,
+				   fee_sim_pld_gen_t gen, void *arg)
 {
 	size_t i = 0;
 	size_t tot = n;
+	int verbose;
+
+	int64_t t0, s0;
+
 
+	t0 = sim_time_ns();
+	s0 = fee_sim_stage_get(FEE_SIM_STAGE_SEND);
+
+	verbose = (tot > LARGE) && !sim_quiet;
 
 	fee_sim_hdr_set_last_pkt(&pld->pkt->hdr, 0);
 
 	fee_sim_hdr_set_data_len(&pld->pkt->hdr, pld->data_len_max);
 
-	if (tot > LARGE)
+	if (verbose)
 		printf("large transfer of %d bytes\n\n", n);
 
 	while (n) {
 
 		if (n > pld->data_len_max) {
-			memcpy(pld->pkt->data, &buf[i], pld->data_len_max);
+			gen(arg, pld->pkt->data, i, pld->data_len_max);
 			i += pld->data_len_max;
 			n -= pld->data_len_max;
 		} else {
 
-			memcpy(pld->pkt->data, &buf[i], n);
+			gen(arg, pld->pkt->data, i, n);
 			fee_sim_hdr_set_data_len(&pld->pkt->hdr, n);
 			fee_sim_hdr_set_last_pkt(&pld->pkt->hdr, 1);
 			n = 0;
 		}
-		/* send */
+		/* send, this is paced to the link rate */
 		fee_sim_send_data_payload(cfg, pld);
 		fee_sim_hdr_inc_seq_cntr(&pld->pkt->hdr);
 
-		/* XXX the link speed is 50 mbit and the ASW
-		 * ASW cannot pull packets fast enough to transfer everything
-		 * in one go, so  we'll sleep beetween transfers
-		 * this also stops the network buffers from overflowing
-		 */
-		if (tot > LARGE) {
-			usleep(5000000/8 /  (pld->pkt->hdr.data_len + sizeof(struct fee_data_pkt)));
+		if (verbose)
 			progress((double) i / (double) tot);
-		}
 	}
 
-	if (tot > LARGE)
+	if (verbose)
 		printf("\n");	/* for progress bar */
 
+	/* the time spent sending is accounted for separately */
+	t0 += fee_sim_stage_get(FEE_SIM_STAGE_SEND) - s0;
+	fee_sim_stage_add(FEE_SIM_STAGE_PACKET, t0);
+}
+
+
+/**
+ * @brief send buffer in chunks according to the configuration
+ */
+
+static void fee_sim_tx_payload_data(struct sim_net_cfg *cfg,
+				      struct fee_data_payload *pld,
+				      uint8_t *buf, size_t n)
+{
+	fee_sim_tx_payload_gen(cfg, pld, n, fee_sim_pld_gen_buf, buf);
+}
+
+
+/* the sides of a full frame */
+struct fee_sim_ff_src {
+	const uint16_t *E;
+	const uint16_t *F;
+};
+
+
+/**
+ * @brief payload generator of a full frame
+ *
+ * @note as per MSSL-IF-115 MSSL-SMILE-SXI-IRD-0001 Draft A0.14, full frame
+ *	 transfer pixels are ordered in pairs of FxEx; the pairs are
+ *	 assembled directly in the packet, so the frame is never copied
+ *	 as a whole
+ */
+
+static void fee_sim_pld_gen_ff(void *arg, uint8_t *dst, size_t off, size_t len)
+{
+	size_t i;
+	size_t o;
+	size_t n;
+
+	uint16_t pair[2];
 
+	struct fee_sim_ff_src *src = (struct fee_sim_ff_src *) arg;
+
+
+	i = off / sizeof(pair);
+	o = off % sizeof(pair);
+
+	while (len) {
+
+		pair[0] = src->F[i];
+		pair[1] = src->E[i];
+		i++;
+
+		n = sizeof(pair) - o;
+		if (n > len)
+			n = len;
+
+		/* packet payloads are a multiple of 4 bytes but for the last */
+		if (n == sizeof(pair))
+			memcpy(dst, pair, sizeof(pair));
+		else
+			memcpy(dst, &((uint8_t *) pair)[o], n);
+
+		dst += n;
+		len -= n;
+		o    = 0;
+	}
 }
 
 
@@ -1236,11 +1979,9 @@ static void fee_sim_exec_ff_mode(struct sim_net_cfg *cfg, uint8_t fee_mode)
 
 	uint8_t id;
 
-	uint16_t *E, *F;
-	uint16_t *frame = NULL;
+	size_t n;
 
-	size_t i;
-	size_t n ;
+	struct fee_sim_ff_src src;
 
 
 	/* FF modes read only one CCD at a time and
@@ -1248,31 +1989,17 @@ static void fee_sim_exec_ff_mode(struct sim_net_cfg *cfg, uint8_t fee_mode)
 	 * to read as CCD4
 	 */
 	if (smile_fee_get_ccd_readout(1)) {
-		E = CCD2E;
-		F = CCD2F;
+		src.E = CCD2E;
+		src.F = CCD2F;
 		id = FEE_CCD_ID_2;
 	} else {
-		E = CCD4E;
-		F = CCD4F;
+		src.E = CCD4E;
+		src.F = CCD4F;
 		id = FEE_CCD_ID_4;
 	}
 
 
 	n = FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS * sizeof(uint16_t);
-	frame = malloc(n);
-	if (!frame) {
-		perror("malloc");
-		exit(-1);
-	}
-
-	/* as per MSSL-IF-115 MSSL-SMILE-SXI-IRD-0001 Draft A0.14, full frame
-	 * transfer pixels are ordered in pairs of FxEx
-	 */
-	for (i = 0; i < FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS / 2; i++) {
-		frame[2 * i]     = F[i];
-		frame[2 * i + 1] = E[i];
-	}
-
 
 	pld = fee_sim_create_data_payload();
 
@@ -1298,12 +2025,10 @@ static void fee_sim_exec_ff_mode(struct sim_net_cfg *cfg, uint8_t fee_mode)
 	/* CCD side is unused in this mode */
 	fee_sim_hdr_set_ccd_id(&pld->pkt->hdr,   id);
 	fee_sim_hdr_set_fee_mode(&pld->pkt->hdr, fee_mode);
-	fee_sim_tx_payload_data(cfg, pld, (uint8_t *) frame, n);
+	fee_sim_tx_payload_gen(cfg, pld, n, fee_sim_pld_gen_ff, &src);
 
 
 	fee_sim_destroy_data_payload(pld);
-
-	free(frame);
 }
 
 
@@ -1408,116 +2133,165 @@ static void fee_sim_frame_transfer(struct sim_net_cfg *cfg,  uint8_t fee_mode,
 static uint16_t *fee_sim_get_ft_data(uint16_t *ccd, size_t rows, size_t cols,
 				     size_t bins)
 {
-	size_t i, j;
-	size_t x, y;
-	size_t rw, cl;
-
 	uint16_t *buf;
-	uint16_t *acc;
 
-	struct timeval t0, t;
-	double elapsed_time;
+	int64_t t0, dt;
 
-	/* we need a cleared buffer to accumulate the bins */
+	/* the binned data contain overscan in the real FEE, i.e. the "edge"
+	 * pixels contain CCD bias values, but we just ignore those
+	 * and round down to the next integer
+	 * note that we keep the nominal size, we just don't fill the
+	 * out-of-bounds samples with values
+	 */
 	buf = calloc(sizeof(uint16_t), rows * cols);
 	if (!buf) {
 		perror("malloc");
 		exit(-1);
 	}
 
-	if (bins == 1) {
-		memcpy(buf, ccd, rows * cols * sizeof(uint16_t));
-		return buf;
-	}
+	t0 = sim_time_ns();
 
-	/* our accumulator */
-	acc = malloc(FEE_CCD_IMG_SEC_COLS * sizeof(uint16_t));
-	if (!acc) {
-		perror("malloc");
+	if (fee_bin_frame(buf, rows, cols, ccd, FEE_CCD_IMG_SEC_ROWS,
+			  FEE_CCD_IMG_SEC_COLS, bins)) {
+		printf("Could not bin CCD data\n");
 		exit(-1);
 	}
 
-	gettimeofday(&t0, NULL);
+	dt = fee_sim_stage_add(FEE_SIM_STAGE_BIN, t0);
 
-	/* the binned data contain overscan in the real FEE, i.e. the "edge"
-	 * pixels contain CCD bias values, but we just ignore those
-	 * and round down to the next integer
-	 * note that we keep the nominal size, we just don't fill the
-	 * out-of-bounds samples with values
-	 */
+	if (bins > 1)
+		SIM_INFO("rebinned in %g ms\n", dt / 1e6);
+
+	return buf;
+}
+
+
+/**
+ * @brief extract binned ccd data for frame transfer mode from the pixels
+ *	  hit in a sparse CCD half
+ *
+ * @param half the index of the CCD half in the refresh
+ *
+ * @note the result is the same as that of fee_sim_get_ft_data()
+ */
+
+static uint16_t *fee_sim_get_ft_hits(uint16_t *ccd, unsigned int half,
+				     size_t rows, size_t cols, size_t bins)
+{
+	size_t i, j;
+	size_t x, y;
+	size_t rw, cl;
+	size_t n = 0;
+
+	uint32_t sum;
+	uint16_t *buf;
+
+	const struct ccd_sim_hits *hits;
+
+	int64_t t0, dt;
+
+
+	buf = calloc(sizeof(uint16_t), rows * cols);
+	if (!buf) {
+		perror("malloc");
+		exit(-1);
+	}
+
+	t0 = sim_time_ns();
+
+	/* see fee_sim_get_ft_data() */
 	rw = FEE_CCD_IMG_SEC_ROWS / bins;
 	cl = FEE_CCD_IMG_SEC_COLS / bins;
 
+	if (rw > rows)
+		rw = rows;
 
-	/* rebinned rows */
-	for (y = 0; y < rw; y++) {
-
-		/* clear line accumulator */
-		memset(acc, 0x0, FEE_CCD_IMG_SEC_COLS * sizeof(uint16_t));
+	if (cl > cols)
+		cl = cols;
 
-		/* accumulate the data lines in "blocks" of bins */
-		for (i = 0; i < bins; i++) {
+	for (i = 0; i < CCD_SIM_BANDS; i++) {
 
-			/* the offset into the buffer of the start of the
-			 * next row; note that the original number of rows
-			 * is required, otherwise the data would be skewed
-			 */
-			size_t y0 = (y * bins + i) * FEE_CCD_IMG_SEC_COLS;
+		hits = &ccd_sim_hits[half * CCD_SIM_BANDS + i];
 
-			for (j = 0; j < FEE_CCD_IMG_SEC_COLS; j++)
-				acc[j] += ccd[y0 + j];
+		for (j = 0; j < hits->cnt; j++) {
 
-		}
+			x = hits->pix[j] % FEE_CCD_IMG_SEC_COLS / bins;
+			y = hits->pix[j] / FEE_CCD_IMG_SEC_COLS / bins;
 
-		/* accumulate blocks of bins into columns */
-		for (x = 0; x < cl; x++) {
+			if (x >= cl || y >= rw)
+				continue;
 
-			for (i = 0; i < bins; i++)
-				buf[y * cols + x] += acc[x * bins + i];
+			/* the sum saturates regardless of the order */
+			sum = buf[y * cols + x] + ccd[hits->pix[j]];
+			if (sum > PIX_SATURATION)
+				sum = PIX_SATURATION;
 
+			buf[y * cols + x] = (uint16_t) sum;
 		}
 
+		n += hits->cnt;
 	}
 
-	/* time in ms  */
-	gettimeofday(&t, NULL);
-	elapsed_time  = (t.tv_sec  - t0.tv_sec)  * 1000.0;
-	elapsed_time += (t.tv_usec - t0.tv_usec) / 1000.0;
-	printf("rebinned in %g ms\n", elapsed_time);
+	dt = fee_sim_stage_add(FEE_SIM_STAGE_BIN, t0);
 
-	free(acc);
+	SIM_INFO("rebinned %lu hits in %g ms\n", (unsigned long) n, dt / 1e6);
 
 	return buf;
 }
 
 
 /**
- * comparsison function for qsort
+ * the event detection only computes the local background of pixels which
+ * pass a cheap pre-selection: a candidate must be a local maximum and
+ * exceed the bare threshold, since the background can only raise it
+ * the pre-selection is done for CCD_EV_LANES pixels of a row at a time
  */
 
-static int compar(const void *a, const void *b)
-{
-	return (*(uint16_t *) a - *(uint16_t *) b);
-}
+#define CCD_EV_LANES	8	/* 128 bit vectors, e.g. SSE2 or NEON */
+
+typedef uint16_t ccd_ev_v16 __attribute__((vector_size(CCD_EV_LANES * sizeof(uint16_t))));
+typedef int16_t ccd_ev_vs16 __attribute__((vector_size(CCD_EV_LANES * sizeof(int16_t))));
+typedef int8_t ccd_ev_vs8 __attribute__((vector_size(CCD_EV_LANES * sizeof(int8_t))));
+
+/* compare-exchange of a sorting network, branchless min/max */
+#define CCD_EV_CX(a, b)	do {					\
+		uint16_t __lo = (a) < (b) ? (a) : (b);		\
+		uint16_t __hi = (a) < (b) ? (b) : (a);		\
+		(a) = __lo;					\
+		(b) = __hi;					\
+	} while (0)
+
 
 /**
- * find the median (via qusort)
+ * @brief find the median of 11 values
+ *
+ * @note this is the median-of-11 subset (28 comparators) of a 35
+ *	 comparator sorting network, v is reordered
  */
 
-static uint16_t median(uint16_t *base, size_t nmemb)
+static uint16_t ccd_ev_median11(uint16_t *v)
 {
-	uint16_t med;
+	CCD_EV_CX(v[0], v[9]);  CCD_EV_CX(v[1], v[6]);  CCD_EV_CX(v[2], v[4]);
+	CCD_EV_CX(v[3], v[7]);  CCD_EV_CX(v[5], v[8]);
 
+	CCD_EV_CX(v[0], v[1]);  CCD_EV_CX(v[3], v[5]);  CCD_EV_CX(v[4], v[10]);
+	CCD_EV_CX(v[6], v[9]);  CCD_EV_CX(v[7], v[8]);
 
-	qsort(base, nmemb, sizeof(uint16_t), compar);
+	CCD_EV_CX(v[1], v[3]);  CCD_EV_CX(v[2], v[5]);  CCD_EV_CX(v[4], v[7]);
+	CCD_EV_CX(v[8], v[10]);
 
-	/* we use an approximated mean for even nmemb */
-	if (nmemb % 2)
-		med = base[nmemb / 2];
-	else
-		med = (base[nmemb / 2] + base[(nmemb / 2) + 1]) / 2;
+	CCD_EV_CX(v[0], v[4]);  CCD_EV_CX(v[1], v[2]);  CCD_EV_CX(v[3], v[7]);
+	CCD_EV_CX(v[5], v[9]);  CCD_EV_CX(v[6], v[8]);
+
+	CCD_EV_CX(v[2], v[6]);  CCD_EV_CX(v[4], v[5]);  CCD_EV_CX(v[7], v[8]);
+
+	CCD_EV_CX(v[2], v[4]);  CCD_EV_CX(v[3], v[6]);  CCD_EV_CX(v[5], v[7]);
+
+	CCD_EV_CX(v[3], v[4]);  CCD_EV_CX(v[5], v[6]);
 
-	return med;
+	CCD_EV_CX(v[4], v[5]);
+
+	return v[5];
 }
 
 
@@ -1530,30 +2304,48 @@ static uint16_t median(uint16_t *base, size_t nmemb)
 
 static uint16_t fee_sim_get_local_background(struct fee_event_detection *pkt)
 {
-	size_t cnt = 0;
 	uint16_t medpix[11];
 
 
-	medpix[cnt++] = pkt->pix[0];
-	medpix[cnt++] = pkt->pix[1];
-	medpix[cnt++] = pkt->pix[2];
-	medpix[cnt++] = pkt->pix[3];
-	medpix[cnt++] = pkt->pix[4];
-	medpix[cnt++] = pkt->pix[5];
-	medpix[cnt++] = pkt->pix[9];
-	medpix[cnt++] = pkt->pix[10];
-	medpix[cnt++] = pkt->pix[15];
-	medpix[cnt++] = pkt->pix[20];
-	medpix[cnt++] = pkt->pix[21];
+	medpix[0]  = pkt->pix[0];
+	medpix[1]  = pkt->pix[1];
+	medpix[2]  = pkt->pix[2];
+	medpix[3]  = pkt->pix[3];
+	medpix[4]  = pkt->pix[4];
+	medpix[5]  = pkt->pix[5];
+	medpix[6]  = pkt->pix[9];
+	medpix[7]  = pkt->pix[10];
+	medpix[8]  = pkt->pix[15];
+	medpix[9]  = pkt->pix[20];
+	medpix[10] = pkt->pix[21];
 
 
-	return median(medpix, cnt);
+	return ccd_ev_median11(medpix);
 }
 
 
 /**
- *
- * @brief check pixel for event and if so, send it
+ * @brief collect the 5x5 event area around a pixel into a packet
+ */
+
+static void fee_sim_get_event_area(struct fee_event_detection *pkt,
+				   uint16_t *frame, size_t idx, size_t cols)
+{
+	ssize_t i, j;
+
+	size_t cnt = 0;
+
+
+	for (i = 2; i >= -2; i--) {
+		for (j = -2; j <= 2; j++) {
+			pkt->pix[cnt++] = frame[idx + j * cols + i];
+		}
+	}
+}
+
+
+/**
+ * @brief select the event candidates in a row of a frame
  *
  * 9 Event detection algorithm
  *
@@ -1568,49 +2360,90 @@ static uint16_t fee_sim_get_local_background(struct fee_event_detection *pkt)
  *
  * (from: SMILE SXI CCD Testing and Calibration Event Detection Methodology issue 2 rev 0)
  *
+ * @param cand set non-zero for the candidates in columns 2...cols - 3
+ *
+ * @returns the number of candidates in the row
+ *
+ * @note this checks 2. and the threshold without the local background
  */
 
-static int fee_sim_check_event_pixel(struct sim_net_cfg *cfg,
-				     struct fee_event_detection *pkt, uint16_t *frame,
-				     size_t idx, size_t cols, uint16_t threshold)
+static size_t fee_sim_get_event_candidates(uint16_t *frame, size_t row,
+					   size_t cols, uint16_t threshold,
+					   int8_t *cand)
 {
+	size_t c;
+	size_t i;
+	size_t n = 0;
+
 	uint16_t pix;
+	uint16_t *up, *mid, *dn;
 
-	ssize_t i, j;
+	ccd_ev_v16 p, v;
+	ccd_ev_v16 thr;
+	ccd_ev_vs16 m;
+	ccd_ev_vs8 m8;
 
-	size_t cnt = 0;
-	size_t ev  = 0;
 
+	up  = &frame[(row - 1) * cols];
+	mid = &frame[row * cols];
+	dn  = &frame[(row + 1) * cols];
 
-	/* central pixel */
-	pix = frame[idx];
+	for (i = 0; i < CCD_EV_LANES; i++)
+		thr[i] = threshold;
 
-	/* collect event area into packet */
-	for (i = 2; i >= -2; i--) {
-		for (j = -2; j <= 2; j++) {
-			pkt->pix[cnt++] = frame[idx + j * cols + i];
-		}
+	for (c = 2; c + CCD_EV_LANES <= cols - 2; c += CCD_EV_LANES) {
+
+		memcpy(&p, &mid[c], sizeof(p));
+		m = p >= thr;
+
+		memcpy(&v, &mid[c - 1], sizeof(v)); m &= p > v;
+		memcpy(&v, &mid[c + 1], sizeof(v)); m &= p > v;
+		memcpy(&v, &up[c - 1],  sizeof(v)); m &= p > v;
+		memcpy(&v, &up[c],      sizeof(v)); m &= p > v;
+		memcpy(&v, &up[c + 1],  sizeof(v)); m &= p > v;
+		memcpy(&v, &dn[c - 1],  sizeof(v)); m &= p > v;
+		memcpy(&v, &dn[c],      sizeof(v)); m &= p > v;
+		memcpy(&v, &dn[c + 1],  sizeof(v)); m &= p > v;
+
+		m8 = __builtin_convertvector(m, ccd_ev_vs8);
+		memcpy(&cand[c], &m8, sizeof(m8));
+
+		for (i = 0; i < CCD_EV_LANES; i++)
+			n += !!m8[i];
 	}
 
-	/* below threshold, no point in doing other checks */
-	if ( pix < threshold + fee_sim_get_local_background(pkt))
-		return 0;
+	for (; c < cols - 2; c++) {
 
+		pix = mid[c];
 
-	/* since this is a ring of only 8 pixels, we unroll this here
-	 * to avoid dealing with nasty indexing
-	 */
+		cand[c] = pix >= threshold
+			&& pix > mid[c - 1] && pix > mid[c + 1]
+			&& pix > up[c - 1]  && pix > up[c]  && pix > up[c + 1]
+			&& pix > dn[c - 1]  && pix > dn[c]  && pix > dn[c + 1];
+
+		n += cand[c];
+	}
+
+	return n;
+}
 
-	if (pkt->pix[ 6] < pix) ev++;
-	if (pkt->pix[ 7] < pix) ev++;
-	if (pkt->pix[ 8] < pix) ev++;
-	if (pkt->pix[11] < pix) ev++;
-	if (pkt->pix[13] < pix) ev++;
-	if (pkt->pix[16] < pix) ev++;
-	if (pkt->pix[17] < pix) ev++;
-	if (pkt->pix[18] < pix) ev++;
 
-	if (ev != 8)	/* no event */
+/**
+ *
+ * @brief check an event candidate against the local background and if it
+ *	  is an event, send it
+ *
+ * @note the pixel must have passed fee_sim_get_event_candidates()
+ */
+
+static int fee_sim_check_event_pixel(struct sim_net_cfg *cfg,
+				     struct fee_event_detection *pkt, uint16_t *frame,
+				     size_t idx, size_t cols, uint16_t threshold)
+{
+	/* collect event area into packet */
+	fee_sim_get_event_area(pkt, frame, idx, cols);
+
+	if (frame[idx] < threshold + fee_sim_get_local_background(pkt))
 		return 0;
 
 	fee_sim_send_event_payload(cfg, pkt);
@@ -1631,15 +2464,20 @@ static size_t fee_sim_detect_events(struct sim_net_cfg *cfg,
 				    uint16_t threshold)
 {
 	size_t r, c;
+	size_t n;
+	int wmask;
+	int8_t *cand = NULL;
 
-	struct timeval t0, t;
-	double elapsed_time;
+	int64_t t0, s0, dt;
 
 
 	/* unused sides are NULL */
 	if (!frame)
 		return 0;
 
+	t0 = sim_time_ns();
+	s0 = fee_sim_stage_get(FEE_SIM_STAGE_SEND);
+
 	/* available event packets for this ccd may be used up */
 	if (!ev_max)
 		goto exit;
@@ -1648,7 +2486,13 @@ static size_t fee_sim_detect_events(struct sim_net_cfg *cfg,
 	if (!smile_fee_get_event_detection())
 		return 0;
 
-	gettimeofday(&t0, NULL);
+	cand = calloc(cols, sizeof(int8_t));
+	if (!cand) {
+		perror("malloc");
+		exit(-1);
+	}
+
+	wmask = smile_fee_get_edu_wandering_mask_en();
 
 	/* the event detection window is a fixed 5x5 imagette with the
 	 * "event" pixel being in the centre, hence we have to shrink
@@ -1659,6 +2503,17 @@ static size_t fee_sim_detect_events(struct sim_net_cfg *cfg,
 
 		size_t c0 = r * cols;
 
+		/* were all event packets used for this CCD ? */
+		if (ev_max == 0)
+			break;
+
+		n = fee_sim_get_event_candidates(frame, r, cols, threshold,
+						 cand);
+
+		/* the wandering mask may still be in this row */
+		if (!n && !wmask)
+			continue;
+
 		for (c = 2; c < (cols - 2); c++) {
 
 			size_t idx = c0 + c;
@@ -1672,27 +2527,30 @@ static size_t fee_sim_detect_events(struct sim_net_cfg *cfg,
 			pkt->row = r;
 			pkt->col = c;
 
-			if (fee_sim_check_event_pixel(cfg, pkt, frame, idx, cols, threshold)) {
-				ev_max--;
-				continue;
+			if (cand[c]) {
+				if (fee_sim_check_event_pixel(cfg, pkt, frame, idx, cols, threshold)) {
+					ev_max--;
+					continue;
+				}
 			}
 
 			/* The wandering mask for a particular frame is only sent
 			 * when it does not coincide with an event in that location.
 			 */
 
-			if (!smile_fee_get_edu_wandering_mask_en())
+			if (!wmask)
 				continue;
 
-			 /* The content was already filled in fee_sim_check_event_pixel()
-			 * we just have to send it as  wandering mask type if.
-			 */
-			if (fee_sim_pix_is_wandering_mask(c, r))
-				fee_sim_send_wmask_payload(cfg, pkt);
+			if (!fee_sim_pix_is_wandering_mask(c, r))
+				continue;
 
+			fee_sim_get_event_area(pkt, frame, idx, cols);
+			fee_sim_send_wmask_payload(cfg, pkt);
 		}
 	}
 
+	free(cand);
+
 exit:
 	/* send last packet marker for this side */
 	pkt->row = 0;
@@ -1702,15 +2560,70 @@ exit:
 	fee_sim_send_event_payload(cfg, pkt);
 	fee_sim_hdr_set_last_pkt(&pkt->hdr, 0);
 
-	gettimeofday(&t, NULL);
-	elapsed_time  = (t.tv_sec  - t0.tv_sec)  * 1000.0;
-	elapsed_time += (t.tv_usec - t0.tv_usec) / 1000.0;
-	printf("event detection in %g ms\n", elapsed_time);
+	/* the time spent sending is accounted for separately */
+	t0 += fee_sim_stage_get(FEE_SIM_STAGE_SEND) - s0;
+	dt  = fee_sim_stage_add(FEE_SIM_STAGE_EVENT, t0);
+
+	SIM_INFO("event detection in %g ms\n", dt / 1e6);
 
 	/* event packets remainig */
 	return ev_max;
 }
 
+/**
+ * the readout nodes of a frame are extracted from the CCD halves and
+ * noised in parallel by the worker pool, in order E2, F2, E4, F4
+ */
+
+struct fee_sim_ft_job {
+	uint16_t *ccd[4];	/* NULL if the node is not read out */
+	uint16_t *node[4];
+
+	size_t rows;
+	size_t cols;
+	size_t bins;
+
+	/* seeded in node order, so the noise does not depend on the
+	 * execution order of the tasks
+	 */
+	struct ccd_sim_vrng v[4];
+};
+
+
+/**
+ * @brief extract and noise a readout node
+ */
+
+static void fee_sim_ft_node_task(void *arg, unsigned int idx)
+{
+	int64_t t0;
+
+	struct fee_sim_ft_job *job;
+
+
+	job = (struct fee_sim_ft_job *) arg;
+
+	if (!job->ccd[idx])
+		return;
+
+	/* the node order is that of the CCD halves in ccd_sim_refresh() */
+	if (job->bins > 1 && ccd_sim_sparse[idx])
+		job->node[idx] = fee_sim_get_ft_hits(job->ccd[idx], idx,
+						     job->rows, job->cols,
+						     job->bins);
+	else
+		job->node[idx] = fee_sim_get_ft_data(job->ccd[idx], job->rows,
+						     job->cols, job->bins);
+
+	t0 = sim_time_ns();
+
+	ccd_sim_add_readout_noise(&job->v[idx], job->node[idx],
+				  job->rows * job->cols);
+
+	fee_sim_stage_add(FEE_SIM_STAGE_NOISE, t0);
+}
+
+
 static void fee_sim_exec_ft_mode(struct sim_net_cfg *cfg)
 {
 	uint16_t *E2 = NULL;
@@ -1718,9 +2631,12 @@ static void fee_sim_exec_ft_mode(struct sim_net_cfg *cfg)
 	uint16_t *E4 = NULL;
 	uint16_t *F4 = NULL;
 
+	unsigned int i;
 	size_t rows, cols, bins;
 	uint16_t readout;
 
+	struct fee_sim_ft_job job = {0};
+
 	size_t CCD2_ev_cnt = smile_fee_get_event_pkt_limit();
 	size_t CCD4_ev_cnt = smile_fee_get_event_pkt_limit();
 
@@ -1768,11 +2684,36 @@ static void fee_sim_exec_ft_mode(struct sim_net_cfg *cfg)
 
 	readout = smile_fee_get_readout_node_sel();
 
+	if (readout & FEE_READOUT_NODE_E2)
+		job.ccd[0] = CCD2E;
+	if (readout & FEE_READOUT_NODE_F2)
+		job.ccd[1] = CCD2F;
+	if (readout & FEE_READOUT_NODE_E4)
+		job.ccd[2] = CCD4E;
+	if (readout & FEE_READOUT_NODE_F4)
+		job.ccd[3] = CCD4F;
+
+	job.rows = rows;
+	job.cols = cols;
+	job.bins = bins;
 
-	if (readout & FEE_READOUT_NODE_E2) {
-		E2 = fee_sim_get_ft_data(CCD2E, rows, cols, bins);
-		ccd_sim_add_rd_noise(E2, rows * cols);
+	for (i = 0; i < 4; i++) {
+		if (job.ccd[i])
+			ccd_sim_vrng_seed(&job.v[i]);
+	}
+
+	fee_sim_pool_run(sim_pool, fee_sim_ft_node_task, &job, 4);
+
+	E2 = job.node[0];
+	F2 = job.node[1];
+	E4 = job.node[2];
+	F4 = job.node[3];
+
+	/* the events are detected in order, the packets of a node are
+	 * transmitted while the next one is processed
+	 */
 
+	if (readout & FEE_READOUT_NODE_E2) {
 		/* event detection is only done for 6x binning */
 		if (smile_fee_get_ccd_mode2_config() == FEE_MODE2_BIN6) {
 			fee_sim_hdr_set_ccd_side(&ev_pkt.hdr, FEE_CCD_SIDE_E);
@@ -1783,9 +2724,6 @@ static void fee_sim_exec_ft_mode(struct sim_net_cfg *cfg)
 	}
 
 	if (readout & FEE_READOUT_NODE_F2) {
-		F2 = fee_sim_get_ft_data(CCD2F, rows, cols, bins);
-		ccd_sim_add_rd_noise(F2, rows * cols);
-
 		/* event detection is only done for 6x binning */
 		if (smile_fee_get_ccd_mode2_config() == FEE_MODE2_BIN6) {
 			fee_sim_hdr_set_ccd_side(&ev_pkt.hdr, FEE_CCD_SIDE_F);
@@ -1795,9 +2733,6 @@ static void fee_sim_exec_ft_mode(struct sim_net_cfg *cfg)
 	}
 
 	if (readout & FEE_READOUT_NODE_E4) {
-		E4 = fee_sim_get_ft_data(CCD4E, rows, cols, bins);
-		ccd_sim_add_rd_noise(E4, rows * cols);
-
 		/* event detection is only done for 6x binning */
 		if (smile_fee_get_ccd_mode2_config() == FEE_MODE2_BIN6) {
 			fee_sim_hdr_set_ccd_side(&ev_pkt.hdr, FEE_CCD_SIDE_E);
@@ -1807,9 +2742,6 @@ static void fee_sim_exec_ft_mode(struct sim_net_cfg *cfg)
 	}
 
 	if (readout & FEE_READOUT_NODE_F4) {
-		F4 = fee_sim_get_ft_data(CCD4F, rows, cols, bins);
-		ccd_sim_add_rd_noise(F4, rows * cols);
-
 		/* event detection is only done for 6x binning */
 		if (smile_fee_get_ccd_mode2_config() == FEE_MODE2_BIN6) {
 			fee_sim_hdr_set_ccd_side(&ev_pkt.hdr, FEE_CCD_SIDE_F);
@@ -1834,11 +2766,13 @@ static void fee_sim_exec_ft_mode(struct sim_net_cfg *cfg)
 		memset(&ev_pkt.pix, 0, FEE_EV_DET_PIXELS * sizeof(uint16_t));
 		fee_sim_hdr_set_last_pkt(&ev_pkt.hdr, 1);
 		fee_sim_hdr_cpu_to_tgt(&ev_pkt.hdr);
-		fee_send_non_rmap(cfg, (uint8_t *) &ev_pkt, sizeof(struct fee_event_detection));
+		fee_sim_send(cfg, (uint8_t *) &ev_pkt, sizeof(struct fee_event_detection));
 	}
 
 #ifdef SIM_DUMP_FITS
 	/* for testing */
+	ccd_sim_sparse[0] = 0;
+	ccd_sim_sparse[1] = 0;
 	ccd_sim_add_rd_noise(CCD2E, FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS);
 	save_fits("!CCD2E.fits", CCD2E, FEE_CCD_IMG_SEC_ROWS, FEE_CCD_IMG_SEC_COLS);
 	save_fits("!E2.fits", E2, rows, cols);
@@ -2079,7 +3013,7 @@ static void fee_sim_exec_evsim_mode(struct sim_net_cfg *cfg)
 	memset(&ev_pkt.pix, 0, FEE_EV_DET_PIXELS * sizeof(uint16_t));
 	fee_sim_hdr_set_last_pkt(&ev_pkt.hdr, 1);
 	fee_sim_hdr_cpu_to_tgt(&ev_pkt.hdr);
-	fee_send_non_rmap(cfg, (uint8_t *) &ev_pkt, sizeof(struct fee_event_detection));
+	fee_sim_send(cfg, (uint8_t *) &ev_pkt, sizeof(struct fee_event_detection));
 
 
 
@@ -2094,11 +3028,23 @@ static void fee_sim_exec_evsim_mode(struct sim_net_cfg *cfg)
 
 
 
+/* a frame transfer pattern of a readout node, kept across readout cycles */
+struct fee_sim_pat_cache {
+	struct fee_pattern *buf;
+	size_t rows;
+	size_t cols;
+	uint8_t time_code;
+};
+
+static struct fee_sim_pat_cache fee_sim_pat[4];
+
+
 /**
  * @brief generate a pattern for frame transfer pattern mode
  */
 
 static struct fee_pattern *fee_sim_gen_ft_pat(uint8_t ccd_side, uint8_t ccd_id,
+					      uint8_t time_code,
 					      size_t rows, size_t cols)
 {
 	size_t i, j;
@@ -2115,7 +3061,7 @@ static struct fee_pattern *fee_sim_gen_ft_pat(uint8_t ccd_side, uint8_t ccd_id,
 
 	pix.side = ccd_side;
 	pix.ccd  = ccd_id;
-	pix.time_code = fee_get_spw_time_code() & 0x7;
+	pix.time_code = time_code;
 
 	for (i = 0; i < rows; i++) {
 
@@ -2137,6 +3083,81 @@ static struct fee_pattern *fee_sim_gen_ft_pat(uint8_t ccd_side, uint8_t ccd_id,
 }
 
 
+/**
+ * @brief replace the time code in a frame transfer pattern
+ *
+ * @note the pattern is patched four pixels per 64 bit word
+ */
+
+static void fee_sim_patch_ft_pat(struct fee_pattern *buf, size_t n,
+				 uint8_t time_code)
+{
+	size_t i;
+	uint16_t tc;
+	uint16_t mask;
+	uint64_t w, wtc, wmask;
+
+	struct fee_pattern pix;
+
+
+	pix.field = 0;
+	pix.time_code = 0x7;
+	mask = pix.field;
+
+	pix.time_code = time_code;
+	tc = pix.field;
+
+	wmask = mask * 0x0001000100010001ULL;
+	wtc   = tc   * 0x0001000100010001ULL;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		memcpy(&w, &buf[i], sizeof(w));
+		w = (w & ~wmask) | wtc;
+		memcpy(&buf[i], &w, sizeof(w));
+	}
+
+	for (; i < n; i++)
+		buf[i].field = (buf[i].field & ~mask) | tc;
+}
+
+
+/**
+ * @brief get the frame transfer pattern of a readout node
+ *
+ * @note the pattern is only generated if the frame size changed, i.e. the
+ *	 binning mode was reconfigured; otherwise only the time code, which
+ *	 is the sole varying part of the pattern, is updated if needed
+ */
+
+static struct fee_pattern *fee_sim_get_ft_pat(struct fee_sim_pat_cache *pat,
+					      uint8_t ccd_side, uint8_t ccd_id,
+					      size_t rows, size_t cols)
+{
+	uint8_t time_code;
+
+
+	time_code = fee_get_spw_time_code() & 0x7;
+
+	if (pat->buf && pat->rows == rows && pat->cols == cols) {
+
+		if (pat->time_code != time_code) {
+			fee_sim_patch_ft_pat(pat->buf, rows * cols, time_code);
+			pat->time_code = time_code;
+		}
+
+		return pat->buf;
+	}
+
+	free(pat->buf);
+
+	pat->buf  = fee_sim_gen_ft_pat(ccd_side, ccd_id, time_code, rows, cols);
+	pat->rows = rows;
+	pat->cols = cols;
+	pat->time_code = time_code;
+
+	return pat->buf;
+}
+
 
 static void fee_sim_exec_ft_pat_mode(struct sim_net_cfg *cfg)
 {
@@ -2178,16 +3199,20 @@ static void fee_sim_exec_ft_pat_mode(struct sim_net_cfg *cfg)
 
 
 	if (readout & FEE_READOUT_NODE_E2)
-		E2 = fee_sim_gen_ft_pat(FEE_CCD_SIDE_E, FEE_CCD_ID_2, rows, cols);
+		E2 = fee_sim_get_ft_pat(&fee_sim_pat[0], FEE_CCD_SIDE_E,
+					FEE_CCD_ID_2, rows, cols);
 
 	if (readout & FEE_READOUT_NODE_F2)
-		F2 = fee_sim_gen_ft_pat(FEE_CCD_SIDE_F, FEE_CCD_ID_2, rows, cols);
+		F2 = fee_sim_get_ft_pat(&fee_sim_pat[1], FEE_CCD_SIDE_F,
+					FEE_CCD_ID_2, rows, cols);
 
 	if (readout & FEE_READOUT_NODE_E4)
-		E4 = fee_sim_gen_ft_pat(FEE_CCD_SIDE_E, FEE_CCD_ID_4, rows, cols);
+		E4 = fee_sim_get_ft_pat(&fee_sim_pat[2], FEE_CCD_SIDE_E,
+					FEE_CCD_ID_4, rows, cols);
 
 	if (readout & FEE_READOUT_NODE_F4)
-		F4 = fee_sim_gen_ft_pat(FEE_CCD_SIDE_F, FEE_CCD_ID_4, rows, cols);
+		F4 = fee_sim_get_ft_pat(&fee_sim_pat[3], FEE_CCD_SIDE_F,
+					FEE_CCD_ID_4, rows, cols);
 
 
 	/* transfer only when digitise is enabled */
@@ -2197,11 +3222,6 @@ static void fee_sim_exec_ft_pat_mode(struct sim_net_cfg *cfg)
 				       (uint8_t *) E4, (uint8_t *) F4,
 				       sizeof(struct fee_pattern) * rows * cols);
 	}
-
-	free(E2);
-	free(F2);
-	free(E4);
-	free(F4);
 }
 
 
@@ -2220,34 +3240,34 @@ static void fee_sim_exec(struct sim_net_cfg *cfg)
 
 	case FEE_MODE_ID_ON:
 		/* the thing is switched on */
-		printf("We're switched on, cool!\n");
+		SIM_INFO("We're switched on, cool!\n");
 		break;
 	case FEE_MODE_ID_FTP:
 		/* frame transfer pattern */
-		printf("Frame Transfer Pattern Mode\n");
+		SIM_INFO("Frame Transfer Pattern Mode\n");
 		fee_sim_exec_ft_pat_mode(cfg);
 		break;
 	case FEE_MODE_ID_STBY:
 		/* stand-by-mode */
-		printf("We're in stand-by, no idea what that does\n");
+		SIM_INFO("We're in stand-by, no idea what that does\n");
 		break;
 	case FEE_MODE_ID_FT:
 		/* frame transfer */
-		printf("Frame Transfer Mode\n");
+		SIM_INFO("Frame Transfer Mode\n");
 		fee_sim_exec_ft_mode(cfg);
 		break;
 	case FEE_MODE_ID_FF:
 		/* full frame */
-		printf("Full Frame Mode\n");
+		SIM_INFO("Full Frame Mode\n");
 		fee_sim_exec_ff_mode(cfg, FEE_MODE_ID_FF);
 		break;
 	case FEE_CMD__ID_IMM_ON:
 		/* immediate on-mode, this is a command, not a mode */
-		printf("Immediate ON\n");
+		SIM_INFO("Immediate ON\n");
 		break;
 
 	case FEE_MODE_ID_EVSIM:
-		printf("Event detection simulation\n");
+		SIM_INFO("Event detection simulation\n");
 		fee_sim_exec_evsim_mode(cfg);
 		break;
 	case FEE_MODE_ID_PTP1:
@@ -2274,10 +3294,10 @@ static void fee_sim_exec(struct sim_net_cfg *cfg)
 
 
 /**
- * @brief sim main loop
+ * @brief allocate the CCDs and the worker pool
  */
 
-void fee_sim_main(struct sim_net_cfg *cfg)
+static void fee_sim_init(void)
 {
 	/* we have 2 ccds, each with 2 sides (E&F) */
 	const size_t img_side_pix = FEE_CCD_IMG_SEC_ROWS * FEE_CCD_IMG_SEC_COLS;
@@ -2314,6 +3334,60 @@ void fee_sim_main(struct sim_net_cfg *cfg)
 	}
 
 
+	if (!sim_seeded)
+		fee_sim_seed(FEE_SIM_SEED);
+
+	/* the pool is used for the CCD refresh, run serially without it */
+	sim_pool = fee_sim_pool_create(0);
+	if (!sim_pool)
+		printf("Could not create worker pool, continuing serially\n");
+}
+
+
+/**
+ * @brief release the CCDs, the worker pool and the transmit queue
+ */
+
+static void fee_sim_exit(void)
+{
+	size_t i;
+
+
+	free(CCD2E);
+	free(CCD2F);
+	free(CCD4E);
+	free(CCD4F);
+	free(RDO);
+
+	free(ccd_sim_cosmic_lut);
+	ccd_sim_cosmic_lut = NULL;
+	ccd_sim_lut_ready  = 0;
+
+	/* the patterns are regenerated on the next run */
+	for (i = 0; i < sizeof(fee_sim_pat) / sizeof(fee_sim_pat[0]); i++) {
+		free(fee_sim_pat[i].buf);
+		memset(&fee_sim_pat[i], 0, sizeof(struct fee_sim_pat_cache));
+	}
+
+	fee_sim_txq_destroy(sim_txq);
+	fee_sim_pool_destroy(sim_pool);
+}
+
+
+/**
+ * @brief sim main loop
+ */
+
+void fee_sim_main(struct sim_net_cfg *cfg)
+{
+	fee_sim_init();
+
+	/* packets are sent immediately without the queue */
+	sim_txq = fee_sim_txq_create(0, fee_sim_tx, cfg);
+	if (!sim_txq)
+		printf("Could not create transmit queue, sending directly\n");
+
+
 	/* simulator main loop */
 	while (1) {
 start:
@@ -2387,9 +3461,83 @@ start:
 		} while (smile_fee_get_sync_sel());
 	}
 
-	free(CCD2E);
-	free(CCD2F);
-	free(CCD4E);
-	free(CCD4F);
-	free(RDO);
+	fee_sim_exit();
+}
+
+
+/**
+ * @brief run the simulator for a number of readout cycles as fast as possible
+ *
+ * @param cycles the number of readout cycles to run
+ *
+ * @note the cycles are run back to back in the configured FEE mode, without
+ *	 waiting for execute_op or the integration period and without the
+ *	 console output of a cycle; packets are sent directly, so that the
+ *	 stage times add up to the cycle time
+ *
+ * @note a timing report is printed as CSV, one line per cycle with the
+ *	 time spent in each stage in ns, followed by the totals
+ */
+
+void fee_sim_headless(struct sim_net_cfg *cfg, unsigned long cycles)
+{
+	unsigned long i;
+	unsigned int j;
+
+	int64_t t0, dt;
+	int64_t tot = 0;
+	int64_t ns[FEE_SIM_STAGES];
+	int64_t sum[FEE_SIM_STAGES] = {0};
+	uint64_t pkts, bytes;
+
+
+	sim_quiet = 1;
+
+	fee_sim_init();
+
+	printf("cycle");
+	for (j = 0; j < FEE_SIM_STAGES; j++)
+		printf(",%s_ns", fee_sim_stage_name[j]);
+	printf(",total_ns,pkts,bytes\n");
+
+	for (i = 0; i < cycles; i++) {
+
+		for (j = 0; j < FEE_SIM_STAGES; j++)
+			ns[j] = fee_sim_stage_get(j);
+
+		pkts  = sim_stage.pkts;
+		bytes = sim_stage.bytes;
+
+		t0 = sim_time_ns();
+
+		fee_sim_exec(cfg);
+		fee_sim_move_wandering_mask();
+
+		dt   = sim_time_ns() - t0;
+		tot += dt;
+
+		printf("%lu", i);
+
+		for (j = 0; j < FEE_SIM_STAGES; j++) {
+			ns[j] = fee_sim_stage_get(j) - ns[j];
+			sum[j] += ns[j];
+			printf(",%lld", (long long) ns[j]);
+		}
+
+		printf(",%lld,%llu,%llu\n", (long long) dt,
+		       (unsigned long long) (sim_stage.pkts - pkts),
+		       (unsigned long long) (sim_stage.bytes - bytes));
+	}
+
+	printf("all");
+	for (j = 0; j < FEE_SIM_STAGES; j++)
+		printf(",%lld", (long long) sum[j]);
+
+	printf(",%lld,%llu,%llu\n", (long long) tot,
+	       (unsigned long long) sim_stage.pkts,
+	       (unsigned long long) sim_stage.bytes);
+
+	fflush(stdout);
+
+	fee_sim_exit();
 }
@@ -21,25 +21,62 @@
 #define SIM_H
 
 
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/select.h>
 
 
+#define SIM_LINK_RATE		50000000	/* default SpW link rate, bit/s */
+#define SIM_LINK_BURST		8192		/* default burst size, bytes */
+
+#define FEE_SIM_SEED		1		/* default random seed */
+
+struct sim_client;
+
+/* a token bucket pacing the packets sent to the DPU at the SpW link rate;
+ * the bucket is expressed as the time the link becomes idle, so the
+ * packets are released on absolute deadlines
+ */
+struct sim_shaper {
+	pthread_mutex_t lock;
+	double rate;		/* link signalling rate in bit/s, 0 disables */
+	uint32_t overhead;	/* extra bytes per packet, e.g. path address */
+	uint32_t burst;		/* bytes that may be sent back-to-back */
+	int64_t idle;		/* CLOCK_MONOTONIC ns when the link is idle */
+};
+
 struct sim_net_cfg {
 
 	int socket;
+	int socket_mon;	/* monitor server socket, -1 if none */
 
 	int n_fd;
 	fd_set set;
 
 	pthread_t thread_accept;
 	pthread_t thread_poll;
+	pthread_t thread_tx;
+
+	/* per-client send queues, indexed by socket; the lock protects
+	 * the queues, the client table and the fd set
+	 */
+	pthread_mutex_t tx_lock;
+	pthread_cond_t  tx_space;
+	int tx_wake;	/* eventfd, signals new packets to the tx thread */
+	struct sim_client *client[FD_SETSIZE];
+
+	struct sim_shaper shaper;
 
 	int  raw;	/* if set, use raw bytes on user ports,
 			 * otherwise we expect gresb packet format
 			 */
+
+	int  headless;	/* if set, packets are framed but not sent */
 };
 
+void fee_sim_seed(uint64_t seed);
 void fee_sim_main(struct sim_net_cfg *cfg);
+void fee_sim_headless(struct sim_net_cfg *cfg, unsigned long cycles);
 void fee_send_non_rmap(struct sim_net_cfg *cfg, uint8_t *buf, size_t n);
 
 #endif /* SIM_H */
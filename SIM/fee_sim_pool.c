@@ -0,0 +1,214 @@
+/**
+ * @file   fee_sim_pool.c
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2022
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE simulator worker pool
+ *
+ * A fixed set of threads, created once, executes the tasks of a run in
+ * parallel. The tasks of a run are identified by their index only, the
+ * calling thread takes part in the run and returns once all of them
+ * were completed.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include <fee_sim_pool.h>
+
+
+/**
+ * @brief execute tasks of the current run until none are left
+ *
+ * @note call with the pool lock held
+ */
+
+static void fee_sim_pool_work(struct fee_sim_pool *pool)
+{
+	unsigned int idx;
+
+
+	while (pool->next < pool->n_tasks) {
+
+		idx = pool->next++;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->task(pool->arg, idx);
+		pthread_mutex_lock(&pool->lock);
+
+		if (!--pool->pending)
+			pthread_cond_broadcast(&pool->done);
+	}
+}
+
+
+/**
+ * @brief the worker thread
+ */
+
+static void *fee_sim_pool_thread(void *data)
+{
+	unsigned long run = 0;
+
+	struct fee_sim_pool *pool;
+
+
+	pool = (struct fee_sim_pool *) data;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (1) {
+
+		while (!pool->stop && pool->run == run)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->stop)
+			break;
+
+		run = pool->run;
+
+		fee_sim_pool_work(pool);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/**
+ * @brief create a worker pool
+ *
+ * @param n_threads the number of worker threads, 0 for one per online cpu
+ *
+ * @returns the pool or NULL on error
+ *
+ * @note the calling thread also executes tasks, so one thread less than
+ *	 requested is started
+ */
+
+struct fee_sim_pool *fee_sim_pool_create(unsigned int n_threads)
+{
+	long n;
+	unsigned int i;
+
+	struct fee_sim_pool *pool;
+
+
+	if (!n_threads) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = (n > 0) ? (unsigned int) n : 1;
+	}
+
+	pool = (struct fee_sim_pool *) calloc(1, sizeof(struct fee_sim_pool));
+	if (!pool)
+		return NULL;
+
+	pool->thread = (pthread_t *) calloc(n_threads, sizeof(pthread_t));
+	if (!pool->thread) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 1; i < n_threads; i++) {
+
+		if (pthread_create(&pool->thread[pool->n_threads], NULL,
+				   fee_sim_pool_thread, pool)) {
+			perror("pthread_create");
+			break;
+		}
+
+		pool->n_threads++;
+	}
+
+	return pool;
+}
+
+
+/**
+ * @brief stop the threads of a worker pool and destroy it
+ */
+
+void fee_sim_pool_destroy(struct fee_sim_pool *pool)
+{
+	unsigned int i;
+
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->thread[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->thread);
+	free(pool);
+}
+
+
+/**
+ * @brief execute a set of tasks in parallel
+ *
+ * @param task the function to call for each task
+ * @param arg the argument passed to each task
+ * @param n_tasks the number of tasks, called with index 0 to n_tasks - 1
+ *
+ * @note returns when all tasks were completed; without a pool, the tasks
+ *	 are executed by the caller
+ */
+
+void fee_sim_pool_run(struct fee_sim_pool *pool, fee_sim_task_t task,
+		      void *arg, unsigned int n_tasks)
+{
+	unsigned int i;
+
+
+	if (!pool) {
+		for (i = 0; i < n_tasks; i++)
+			task(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	pool->task    = task;
+	pool->arg     = arg;
+	pool->n_tasks = n_tasks;
+	pool->next    = 0;
+	pool->pending = n_tasks;
+	pool->run++;
+
+	pthread_cond_broadcast(&pool->work);
+
+	fee_sim_pool_work(pool);
+
+	while (pool->pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,57 @@
+/**
+ * @file   fee_sim_pool.h
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2022
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE simulator worker pool
+ *
+ */
+
+#ifndef FEE_SIM_POOL_H
+#define FEE_SIM_POOL_H
+
+#include <pthread.h>
+
+
+/* a task is called with the argument of the run and its index */
+typedef void (*fee_sim_task_t)(void *arg, unsigned int idx);
+
+struct fee_sim_pool {
+
+	pthread_t *thread;
+	unsigned int n_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  work;	/* a new run was started */
+	pthread_cond_t  done;	/* all tasks of the run completed */
+
+	/* the current run */
+	fee_sim_task_t task;
+	void *arg;
+	unsigned int n_tasks;
+	unsigned int next;	/* next task to execute */
+	unsigned int pending;	/* tasks not yet completed */
+	unsigned long run;	/* incremented for each run */
+
+	int stop;
+};
+
+
+struct fee_sim_pool *fee_sim_pool_create(unsigned int n_threads);
+void fee_sim_pool_destroy(struct fee_sim_pool *pool);
+
+void fee_sim_pool_run(struct fee_sim_pool *pool, fee_sim_task_t task,
+		      void *arg, unsigned int n_tasks);
+
+
+#endif /* FEE_SIM_POOL_H */
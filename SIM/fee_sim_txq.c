@@ -0,0 +1,186 @@
+/**
+ * @file   fee_sim_txq.c
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2022
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE simulator packet transmit queue
+ *
+ * Packets produced by the simulator are copied into a bounded queue and
+ * handed to the transmit function by a separate sender thread, so the
+ * (paced) transmission of a frame overlaps with the computation of the
+ * next one. If the queue is full, the producer waits for the sender.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fee_sim_txq.h>
+
+
+/**
+ * @brief the sender thread
+ *
+ * @note remaining packets are sent before the thread exits
+ */
+
+static void *fee_sim_txq_thread(void *data)
+{
+	struct fee_sim_txq *q;
+	struct fee_sim_txq_pkt pkt;
+
+
+	q = (struct fee_sim_txq *) data;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (1) {
+
+		while (!q->stop && !q->cnt)
+			pthread_cond_wait(&q->data, &q->lock);
+
+		if (!q->cnt)
+			break;
+
+		pkt = q->pkt[q->head];
+
+		q->head = (q->head + 1) % FEE_SIM_TXQ_PKTS;
+		q->cnt--;
+
+		pthread_mutex_unlock(&q->lock);
+		q->tx(q->arg, pkt.buf, pkt.n);
+		free(pkt.buf);
+		pthread_mutex_lock(&q->lock);
+
+		q->used -= pkt.n;
+		pthread_cond_broadcast(&q->space);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+
+/**
+ * @brief create a transmit queue and start its sender thread
+ *
+ * @param size the max. number of bytes in the queue, 0 for default
+ * @param tx the function sending a packet
+ * @param arg the argument passed to tx
+ *
+ * @returns the queue or NULL on error
+ */
+
+struct fee_sim_txq *fee_sim_txq_create(size_t size, fee_sim_tx_t tx, void *arg)
+{
+	struct fee_sim_txq *q;
+
+
+	if (!tx)
+		return NULL;
+
+	if (!size)
+		size = FEE_SIM_TXQ_SIZE;
+
+	q = (struct fee_sim_txq *) calloc(1, sizeof(struct fee_sim_txq));
+	if (!q)
+		return NULL;
+
+	q->tx   = tx;
+	q->arg  = arg;
+	q->size = size;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->data, NULL);
+	pthread_cond_init(&q->space, NULL);
+
+	if (pthread_create(&q->thread, NULL, fee_sim_txq_thread, q)) {
+		perror("pthread_create");
+		pthread_cond_destroy(&q->space);
+		pthread_cond_destroy(&q->data);
+		pthread_mutex_destroy(&q->lock);
+		free(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+
+/**
+ * @brief send the remaining packets, stop the sender thread and destroy
+ *	  a transmit queue
+ */
+
+void fee_sim_txq_destroy(struct fee_sim_txq *q)
+{
+	if (!q)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->data);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_join(q->thread, NULL);
+
+	pthread_cond_destroy(&q->space);
+	pthread_cond_destroy(&q->data);
+	pthread_mutex_destroy(&q->lock);
+
+	free(q);
+}
+
+
+/**
+ * @brief add a copy of a packet to a transmit queue
+ *
+ * @returns 0 on success, -1 on error
+ *
+ * @note waits until there is space in the queue; a packet larger than the
+ *	 queue is accepted once the queue is empty
+ */
+
+int fee_sim_txq_put(struct fee_sim_txq *q, const uint8_t *buf, size_t n)
+{
+	struct fee_sim_txq_pkt pkt;
+
+
+	if (!q)
+		return -1;
+
+	pkt.buf = malloc(n);
+	if (!pkt.buf)
+		return -1;
+
+	memcpy(pkt.buf, buf, n);
+	pkt.n = n;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (q->cnt == FEE_SIM_TXQ_PKTS
+	       || (q->used && q->used + n > q->size))
+		pthread_cond_wait(&q->space, &q->lock);
+
+	q->pkt[(q->head + q->cnt) % FEE_SIM_TXQ_PKTS] = pkt;
+	q->cnt++;
+	q->used += n;
+
+	pthread_cond_signal(&q->data);
+
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
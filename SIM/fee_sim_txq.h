@@ -0,0 +1,67 @@
+/**
+ * @file   fee_sim_txq.h
+ * @author Armin Luntzer (armin.luntzer@univie.ac.at),
+ * @date   2022
+ *
+ * @copyright GPLv2
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * @brief SMILE FEE simulator packet transmit queue
+ *
+ */
+
+#ifndef FEE_SIM_TXQ_H
+#define FEE_SIM_TXQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+#define FEE_SIM_TXQ_SIZE	0x400000	/* default, bytes */
+#define FEE_SIM_TXQ_PKTS	4096		/* max. number of packets */
+
+/* called by the sender thread for each packet in order of submission */
+typedef void (*fee_sim_tx_t)(void *arg, uint8_t *buf, size_t n);
+
+struct fee_sim_txq_pkt {
+	uint8_t *buf;
+	size_t n;
+};
+
+struct fee_sim_txq {
+
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  data;	/* a packet was added */
+	pthread_cond_t  space;	/* a packet was sent */
+
+	fee_sim_tx_t tx;
+	void *arg;
+
+	struct fee_sim_txq_pkt pkt[FEE_SIM_TXQ_PKTS];
+	size_t head;
+	size_t cnt;		/* packets in queue */
+
+	size_t size;		/* max. bytes in queue */
+	size_t used;		/* bytes queued or in transmission */
+
+	int stop;
+};
+
+
+struct fee_sim_txq *fee_sim_txq_create(size_t size, fee_sim_tx_t tx, void *arg);
+void fee_sim_txq_destroy(struct fee_sim_txq *q);
+
+int fee_sim_txq_put(struct fee_sim_txq *q, const uint8_t *buf, size_t n);
+
+
+#endif /* FEE_SIM_TXQ_H */
@@ -19,6 +19,7 @@
 #include <string.h>
 
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -28,8 +29,11 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <signal.h>
+#include <poll.h>
 
+#include <time.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include <gresb.h>
 
@@ -65,6 +69,17 @@ static struct smile_fee_mirror smile_fee_mem;
 #define DEFAULT_PORT 1234
 #define DEFAULT_ADDR "0.0.0.0"
 
+/* FEE configuration of the headless mode */
+#define HEADLESS_MODE		FEE_MODE_ID_FT
+#define HEADLESS_MODE2		FEE_MODE2_BIN6
+#define HEADLESS_PKT_SIZE	0x030A	/* bytes, as used in the demo */
+#define HEADLESS_TINT		1000	/* ms, integration period */
+#define HEADLESS_EV_PKT_LIMIT	0xFFFFFFFF
+
+/* SpW data characters are 10 bits on the wire, an end of packet is 4 */
+#define SPW_CHAR_BITS	10
+#define SPW_EOP_BITS	4
+
 
 
 static void rmap_sim_rx(uint8_t *pkt, size_t len, struct sim_net_cfg *cfg);
@@ -89,67 +104,307 @@ static void set_tcp_nodelay(struct sim_net_cfg *cfg)
 }
 
 
+/* a connected client and its send queue */
+struct sim_client {
+	int fd;
+	int monitor;		/* read-only tap, drops packets if too slow */
+	int dead;		/* send failed, removed by the poll thread */
+	uint32_t dropped;	/* packets dropped on a monitor connection */
+	struct gresb_txq tx;
+};
+
+
+/**
+ * @brief add a client connection
+ *
+ * @returns 0 on success, -1 on error
+ */
+
+static int sim_client_add(struct sim_net_cfg *cfg, int fd, int monitor)
+{
+	struct sim_client *c;
+
+
+	if (fd >= FD_SETSIZE)
+		return -1;
+
+	c = (struct sim_client *) calloc(1, sizeof(struct sim_client));
+	if (!c)
+		return -1;
+
+	/* one packet per message on local packet sockets */
+	if (gresb_txq_init(&c->tx, GRESB_TXQ_SIZE, GRESB_TXQ_RECORDS,
+			   gresb_sock_is_msg(fd))) {
+		free(c);
+		return -1;
+	}
+
+	c->fd      = fd;
+	c->monitor = monitor;
+
+	pthread_mutex_lock(&cfg->tx_lock);
+
+	cfg->client[fd] = c;
+	FD_SET(fd, &cfg->set);
+
+	/* update maximum file descriptor number */
+	if (fd > cfg->n_fd)
+		cfg->n_fd = fd;
+
+	pthread_mutex_unlock(&cfg->tx_lock);
+
+	return 0;
+}
+
+
+/**
+ * @brief remove a client connection and close its socket
+ *
+ * @note only call this from the poll thread
+ */
+
+static void sim_client_remove(struct sim_net_cfg *cfg, int fd)
+{
+	struct sim_client *c;
+
+
+	pthread_mutex_lock(&cfg->tx_lock);
+
+	c = cfg->client[fd];
+
+	cfg->client[fd] = NULL;
+	FD_CLR(fd, &cfg->set);
+	close(fd);
+
+	/* producers may be waiting for this client */
+	pthread_cond_broadcast(&cfg->tx_space);
+
+	pthread_mutex_unlock(&cfg->tx_lock);
+
+	if (!c)
+		return;
+
+	if (c->monitor)
+		printf("Monitor dropped %u packets\n", c->dropped);
+
+	gresb_txq_free(&c->tx);
+	free(c);
+}
+
+
 /**
- * @brief transmits the contents of a buffer from a socket to its peer
+ * @brief thread function draining the client send queues
+ *
+ * @note a client that cannot take more data is polled for POLLOUT, so
+ *	 a slow client does not hold up the others
  */
 
-static int send_all(int sock_fd, const unsigned char *buf, int len)
+static void *sim_tx(void *data)
 {
+	int fd;
 	int n;
+	int sent;
+	uint64_t cnt;
+
+	struct sim_client *c;
+	struct sim_net_cfg *cfg;
+	struct pollfd pfd[FD_SETSIZE + 1];
 
 
-	while (len) {
+	cfg = (struct sim_net_cfg *) data;
 
-		n = send(sock_fd, buf, len, 0);
+	while (1) {
 
-		if (n == -1) {
-			perror("send_all");
-			return len;
+		pfd[0].fd     = cfg->tx_wake;
+		pfd[0].events = POLLIN;
+		n = 1;
+
+		sent = 0;
+
+		pthread_mutex_lock(&cfg->tx_lock);
+
+		for (fd = 0; fd <= cfg->n_fd; fd++) {
+
+			c = cfg->client[fd];
+			if (!c || c->dead)
+				continue;
+
+			while (c->tx.used) {
+
+				if (gresb_txq_flush(&c->tx, fd) >= 0) {
+					sent = 1;
+					continue;
+				}
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					pfd[n].fd     = fd;
+					pfd[n].events = POLLOUT;
+					n++;
+					break;
+				}
+
+				/* the poll thread will see the disconnect */
+				perror("send");
+				c->dead = 1;
+				shutdown(fd, SHUT_RDWR);
+				sent = 1;	/* wake up waiting producers */
+				break;
+			}
 		}
 
-		len -= n;
-		buf += n;
+		if (sent)
+			pthread_cond_broadcast(&cfg->tx_space);
+
+		pthread_mutex_unlock(&cfg->tx_lock);
+
+		/* the time out covers sockets closed while we wait */
+		if (poll(pfd, n, 10) <= 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN) {
+			if (read(cfg->tx_wake, &cnt, sizeof(cnt)) < 0)
+				perror("read");
+		}
 	}
 
-	return len;
+	return NULL;
 }
 
 
 
+/**
+ * @brief get the CLOCK_MONOTONIC time in nanoseconds
+ */
+
+static int64_t sim_time_ns(void)
+{
+	struct timespec t;
+
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (int64_t) t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/**
+ * @brief wait until a packet may be sent on the simulated SpW link
+ *
+ * @param len the size of the SpW packet in bytes
+ *
+ * @note each packet occupies the link for the transmission time of its
+ *	 characters and the end of packet marker; after an idle period,
+ *	 up to burst bytes are released at once, as the network buffers
+ *	 of the real link would
+ *
+ * @note the time slot is reserved under the lock, so concurrent callers
+ *	 are serialised on the link, but sleep without holding the lock
+ */
+
+static void sim_shaper_wait(struct sim_shaper *sh, size_t len)
+{
+	int64_t now;
+	int64_t due;
+	int64_t burst;
+	int64_t cost;
+
+	struct timespec t;
+
+
+	if (sh->rate <= 0.)
+		return;
+
+	cost  = (int64_t) (((len + sh->overhead) * SPW_CHAR_BITS + SPW_EOP_BITS)
+			   * 1e9 / sh->rate);
+	burst = (int64_t) (sh->burst * SPW_CHAR_BITS * 1e9 / sh->rate);
+
+	pthread_mutex_lock(&sh->lock);
+
+	now = sim_time_ns();
+
+	/* the bucket is full */
+	if (sh->idle < now - burst)
+		sh->idle = now - burst;
+
+	sh->idle += cost;
+	due = sh->idle;
+
+	pthread_mutex_unlock(&sh->lock);
+
+	if (due <= now)
+		return;
+
+	t.tv_sec  = due / 1000000000LL;
+	t.tv_nsec = due % 1000000000LL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
+}
+
+
 /**
  * @brief push buffer to anyone connected
+ *
+ * @note the packet is added to the send queue of each client; if the queue
+ *	 of a monitor client is full, its oldest packets are dropped,
+ *	 otherwise we wait for the client to catch up
  */
 
 static void distribute_tx(struct sim_net_cfg *cfg, uint8_t *buf, int len)
 {
 	int fdc;
-	int ret;
+	uint64_t cnt = 1;
+
+	struct sim_client *c;
 
 
+	sim_shaper_wait(&cfg->shaper, gresb_get_spw_data_size(buf));
+
+	if (cfg->raw) {
+		/* extract data */
+		len = gresb_get_spw_data_size(buf);
+		buf = (uint8_t *) gresb_get_spw_data(buf);
+	}
+
+	pthread_mutex_lock(&cfg->tx_lock);
+
 	for(fdc = 0; fdc <= cfg->n_fd; fdc++) {
 
-		if (!FD_ISSET(fdc, &cfg->set))
+		c = cfg->client[fdc];
+		if (!c || c->dead)
 			continue;
 
-		if (cfg->raw) {
-			/* extract data */
-			ret = send_all(fdc,
-				       gresb_get_spw_data(buf),
-				       gresb_get_spw_data_size(buf));
+		if (c->monitor) {
+
+			while (!gresb_txq_fits(&c->tx, len)) {
+				if (gresb_txq_drop(&c->tx))
+					break;
+				c->dropped++;
+			}
+
 		} else {
-			/* forward packet */
-			ret = send_all(fdc, buf, len);
-		}
 
-		if (ret == -1) {
-			perror("send");
-			close(fdc);
-			FD_CLR(fdc, &cfg->set);
-		}
+			/* the client may be removed while we wait */
+			while (!gresb_txq_fits(&c->tx, len)) {
+
+				pthread_cond_wait(&cfg->tx_space, &cfg->tx_lock);
+
+				c = cfg->client[fdc];
+				if (!c || c->dead)
+					break;
+			}
 
+			if (!c || c->dead)
+				continue;
+		}
 
+		if (gresb_txq_put(&c->tx, buf, len))
+			c->dropped++;
 	}
 
+	pthread_mutex_unlock(&cfg->tx_lock);
+
+	if (write(cfg->tx_wake, &cnt, sizeof(cnt)) < 0)
+		perror("write");
 }
 
 
@@ -233,12 +488,16 @@ static int bind_server_socket(const char* url, struct sim_net_cfg *cfg)
 
 
 /**
- * @brief thread function accepting incoming connections on a server socket
+ * @brief thread function accepting incoming connections on the server sockets
+ *
+ * @note connections accepted on the monitor socket are read-only taps
  */
 
 static void *accept_connections(void *data)
 {
 	int fd = 0;
+	int n;
+	int i;
 
 	struct sim_net_cfg *cfg;
 
@@ -246,28 +505,49 @@ static void *accept_connections(void *data)
 
 	socklen_t client_addr_len;
 
+	struct pollfd pfd[2];
+
 
 	cfg = (struct sim_net_cfg *) data;
 
-	client_addr_len = sizeof(client_addr);
+	pfd[0].fd     = cfg->socket;
+	pfd[0].events = POLLIN;
+	pfd[1].fd     = cfg->socket_mon;
+	pfd[1].events = POLLIN;
+
+	n = (cfg->socket_mon < 0) ? 1 : 2;
 
 	while(1) {
 
-		fd = accept(cfg->socket, (struct sockaddr *) &client_addr,
-			    &client_addr_len);
+		if (poll(pfd, n, -1) <= 0)
+			continue;
+
+		for (i = 0; i < n; i++) {
 
-		if (fd < 0) {
-			perror("accept");
-			exit(EXIT_FAILURE);
-		}
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+
+			client_addr_len = sizeof(client_addr);
 
-		printf("New incoming connection\n");
+			fd = accept(pfd[i].fd, (struct sockaddr *) &client_addr,
+				    &client_addr_len);
 
-		FD_SET(fd, &cfg->set);
+			if (fd < 0) {
+				perror("accept");
+				exit(EXIT_FAILURE);
+			}
 
-		/* update maximum file descriptor number */
-		if (fd > cfg->n_fd)
-			cfg->n_fd = fd;
+			if (sim_client_add(cfg, fd, i)) {
+				printf("Cannot accept connection\n");
+				close(fd);
+				continue;
+			}
+
+			if (i)
+				printf("New incoming monitor connection\n");
+			else
+				printf("New incoming connection\n");
+		}
 	}
 }
 
@@ -288,7 +568,7 @@ static int sim_rx(int fd, struct sim_net_cfg *cfg)
 	uint8_t gresb_hdr[4];	/* host-to-gresb header is 4 bytes */
 
 
-	if (cfg->raw) {
+	if (cfg->raw || cfg->client[fd]->monitor) {
 
 		recv_buffer = malloc(GRESB_PKT_SIZE_MAX);
 
@@ -324,6 +604,10 @@ static int sim_rx(int fd, struct sim_net_cfg *cfg)
 	if (recv_bytes <= 0)
 		goto cleanup;
 
+	/* monitors are read-only */
+	if (cfg->client[fd]->monitor)
+		goto cleanup;
+
 #if DEBUG
 	{
 		printf("RX [%lu]: ", recv_bytes);
@@ -378,7 +662,9 @@ static void *poll_socket(void *data)
 
 	while (1) {
 
+		pthread_mutex_lock(&cfg->tx_lock);
 		r_set = cfg->set;
+		pthread_mutex_unlock(&cfg->tx_lock);
 
 		/* select ready sockets */
 		if (select((cfg->n_fd + 1), &r_set, NULL, NULL, &to) <= 0) {
@@ -392,10 +678,8 @@ static void *poll_socket(void *data)
 				continue;
 
 			/* clean up disconnected socket */
-			if (sim_rx(fd, cfg) <= 0) {
-				FD_CLR(fd, &cfg->set);
-				close(fd);
-			}
+			if (sim_rx(fd, cfg) <= 0)
+				sim_client_remove(cfg, fd);
 		}
 	}
 
@@ -660,6 +944,8 @@ static void rmap_sim_rx(uint8_t *pkt, size_t len, struct sim_net_cfg *cfg)
 
 /**
  * @brief function to send non-rmap data packets going to the DPU
+ *
+ * @note in headless mode, the packets are framed, but dropped
  */
 
 void fee_send_non_rmap(struct sim_net_cfg *cfg, uint8_t *buf, size_t n)
@@ -669,7 +955,9 @@ void fee_send_non_rmap(struct sim_net_cfg *cfg, uint8_t *buf, size_t n)
 
 	gresb_pkt = gresb_create_host_data_pkt(buf, n);
 
-	distribute_tx(cfg, gresb_pkt, gresb_get_host_data_pkt_size(gresb_pkt));
+	if (!cfg->headless)
+		distribute_tx(cfg, gresb_pkt,
+			      gresb_get_host_data_pkt_size(gresb_pkt));
 
 	gresb_destroy_host_data_pkt((struct host_to_gresb_pkt *) gresb_pkt);
 }
@@ -685,6 +973,13 @@ int main(int argc, char **argv)
 	int opt;
 	unsigned int ret;
 	unsigned int port;
+	unsigned int mon_port;
+	const char *unix_path = NULL;
+
+	unsigned long cycles = 0;
+	uint8_t mode  = HEADLESS_MODE;
+	uint8_t mode2 = HEADLESS_MODE2;
+	long ev_thr = -1;
 
 	struct addrinfo *res;
 
@@ -692,6 +987,15 @@ int main(int argc, char **argv)
 
 	struct sim_net_cfg sim_net;
 
+	static const struct option long_opts[] = {
+		{"seed",     required_argument, NULL, 'S'},
+		{"headless", required_argument, NULL, 'H'},
+		{"mode",     required_argument, NULL, 'm'},
+		{"mode2",    required_argument, NULL, 'n'},
+		{"ed",       required_argument, NULL, 'e'},
+		{NULL,   0,                 NULL, 0}
+	};
+
 
 
 	bzero(&sim_net,  sizeof(struct sim_net_cfg));
@@ -700,19 +1004,33 @@ int main(int argc, char **argv)
 	 * defaults
 	 */
 	port     = DEFAULT_PORT;
+	mon_port = 0;
 	sprintf(url, "%s", DEFAULT_ADDR);
 	sprintf(host, "%s", DEFAULT_ADDR);
 
 	sim_net.raw      = 0; /* expect gresb format */
 
+	sim_net.shaper.rate     = SIM_LINK_RATE;
+	sim_net.shaper.overhead = 0;
+	sim_net.shaper.burst    = SIM_LINK_BURST;
+
 
-	while ((opt = getopt(argc, argv, "p:s:bh")) != -1) {
+	while ((opt = getopt_long(argc, argv, "p:M:U:s:R:O:B:S:H:m:n:e:bh",
+				  long_opts, NULL)) != -1) {
 		switch (opt) {
 
 		case 'p':
 			port = strtol(optarg, NULL, 0);
 			break;
 
+		case 'M':
+			mon_port = strtol(optarg, NULL, 0);
+			break;
+
+		case 'U':
+			unix_path = optarg;
+			break;
+
 		case 's':
 			ret = getaddrinfo(optarg, NULL, NULL, &res);
 			if (ret) {
@@ -733,6 +1051,38 @@ int main(int argc, char **argv)
 			break;
 
 
+		case 'R':
+			sim_net.shaper.rate = strtod(optarg, NULL) * 1e6;
+			break;
+
+		case 'O':
+			sim_net.shaper.overhead = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'B':
+			sim_net.shaper.burst = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'S':
+			fee_sim_seed(strtoull(optarg, NULL, 0));
+			break;
+
+		case 'H':
+			cycles = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'm':
+			mode = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'n':
+			mode2 = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'e':
+			ev_thr = strtol(optarg, NULL, 0);
+			break;
+
 		case 'b':
 			sim_net.raw = 1;
 			break;
@@ -741,7 +1091,18 @@ int main(int argc, char **argv)
 		default:
 			printf("\nUsage: %s [OPTIONS]\n", argv[0]);
 			printf("  -p PORT                   local uplink port number (default %d)\n", port);
+			printf("  -M PORT                   local monitor port number, read-only, drops packets if too slow\n");
+			printf("  -U PATH                   use a local packet socket at PATH instead of the uplink port\n");
 			printf("  -s ADDRESS                local source address (default: %s)\n", url);
+			printf("  -R MBIT                   SpW link rate to simulate in Mbit/s, 0 for unlimited (default %g)\n", SIM_LINK_RATE / 1e6);
+			printf("  -O BYTES                  extra bytes per SpW packet, e.g. path address (default 0)\n");
+			printf("  -B BYTES                  bytes sent back-to-back after the link was idle (default %d)\n", SIM_LINK_BURST);
+			printf("  -S, --seed SEED           seed of the CCD simulation, runs are reproducible for a given seed (default %d)\n", FEE_SIM_SEED);
+			printf("  -H, --headless CYCLES     run CYCLES readout cycles as fast as possible without network, pacing and console output,\n"
+			       "                            then print a CSV timing report and exit\n");
+			printf("  -m, --mode MODE           FEE mode of the headless cycles (default %d)\n", HEADLESS_MODE);
+			printf("  -n, --mode2 MODE2         binning mode of the headless cycles (default %d)\n", HEADLESS_MODE2);
+			printf("  -e, --ed THRESHOLD        enable event detection in the headless cycles at the given pixel threshold\n");
 			printf("  -b			    exchange raw binary data on uplink port (expect GRESB format otherwise)\n");
 			printf("  -h                        print this help and exit\n");
 			printf("\n");
@@ -751,6 +1112,38 @@ int main(int argc, char **argv)
 	}
 
 
+	if (cycles) {
+
+		/* we are our own DPU */
+		smile_fee_ctrl_init(&smile_fee_mem);
+
+		smile_fee_set_ccd_mode_config(mode);
+		smile_fee_set_ccd_mode2_config(mode2);
+		smile_fee_set_readout_node_sel(FEE_READOUT_NODE_E2 |
+					       FEE_READOUT_NODE_F2 |
+					       FEE_READOUT_NODE_E4 |
+					       FEE_READOUT_NODE_F4);
+		smile_fee_set_digitise_en(1);
+		smile_fee_set_packet_size(HEADLESS_PKT_SIZE);
+		smile_fee_set_int_sync_period(HEADLESS_TINT);
+
+		if (ev_thr >= 0) {
+			smile_fee_set_event_detection(1);
+			smile_fee_set_event_pkt_limit(HEADLESS_EV_PKT_LIMIT);
+			smile_fee_set_ccd2_e_pix_threshold(ev_thr);
+			smile_fee_set_ccd2_f_pix_threshold(ev_thr);
+			smile_fee_set_ccd4_e_pix_threshold(ev_thr);
+			smile_fee_set_ccd4_f_pix_threshold(ev_thr);
+		}
+
+		sim_net.headless = 1;
+
+		fee_sim_headless(&sim_net, cycles);
+
+		return 0;
+	}
+
+
     	/**
 	 * set up our network
 	 */
@@ -759,7 +1152,40 @@ int main(int argc, char **argv)
 
 
 	sim_net.n_fd = 0;
-	sim_net.socket = bind_server_socket(url, &sim_net);
+
+	if (unix_path) {
+		sim_net.socket = gresb_unix_listen(unix_path);
+		if (sim_net.socket < 0) {
+			printf("could not bind endpoint %s: %s\n", unix_path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		printf("Listening on %s\n", unix_path);
+	} else {
+		sim_net.socket = bind_server_socket(url, &sim_net);
+	}
+
+	sim_net.socket_mon = -1;
+	if (mon_port) {
+		sprintf(url, "%s:%d", host, mon_port);
+		sim_net.socket_mon = bind_server_socket(url, &sim_net);
+	}
+
+	pthread_mutex_init(&sim_net.tx_lock, NULL);
+	pthread_mutex_init(&sim_net.shaper.lock, NULL);
+	pthread_cond_init(&sim_net.tx_space, NULL);
+
+	sim_net.tx_wake = eventfd(0, EFD_NONBLOCK);
+	if (sim_net.tx_wake < 0) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = pthread_create(&sim_net.thread_tx, NULL, sim_tx, &sim_net);
+	if (ret) {
+		printf("Epic fail in pthread_create: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
 
 	ret = pthread_create(&sim_net.thread_accept, NULL,
 			     accept_connections,
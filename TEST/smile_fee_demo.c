@@ -34,6 +34,7 @@
 #include <smile_fee_cfg.h>
 #include <smile_fee_ctrl.h>
 #include <smile_fee_rmap.h>
+#include <smile_fee_demux.h>
 
 #include <fitsio.h>
 
@@ -46,6 +47,9 @@
 
 int bridge_fd;
 
+/* the single reader of the bridge link */
+static struct fee_demux *demux;
+
 
 
 /**
@@ -113,87 +117,14 @@ static int32_t rmap_tx(const void *hdr,  uint32_t hdr_size,
 
 
 /**
- * dirty hack for packet reception, more or less a copy of rmap_rx()
+ * rx function for FEE data packets
+ *
+ * @note same semantics as rmap_rx()
  */
 
 static uint32_t pkt_rx(uint8_t *pkt)
 {
-	int recv_bytes;
-	int recv_left;
-	static uint32_t pkt_size; /* keep last packet size */
-
-	/* XXX: gresb-to-host header is just 4 bytes, but we need 2 extra in
-	 * order to be able to distinguish between rmap and non-rmap packets
-	 *
-	 *
-	 * NOTE THAT THIS IS A DIRTY HACK FOR THE DEMONSTRATOR ONLY, DO NOT DO
-	 * THIS IN PRODUCTION CODE! EVER!
-	 */
-
-	uint8_t gresb_hdr[4+2];
-
-	uint8_t *recv_buffer;
-
-	if (!pkt) {	/* next packet size requested */
-
-		/* try to grab a header */
-		recv_bytes = recv(bridge_fd, gresb_hdr, 6, MSG_PEEK | MSG_DONTWAIT);
-
-		/* we won't bother, this is a stupid demo, not production code */
-		if (recv_bytes <= 0)  {
-			return 0;
-		}
-
-		/* header is 4 bytes, but we need 6 */
-		if (recv_bytes < (4 + 2)) {
-			return 0;
-		}
-
-		/* XXX the protocol id is (or should be) in byte 6 */
-		if (gresb_hdr[5] == FEE_DATA_PROTOCOL)
-			pkt_size = gresb_get_spw_data_size(gresb_hdr);
-		else	/* not what we want, ignore */
-			pkt_size = 0;
-
-		/* tell caller about next packet */
-		return pkt_size;
-	}
-
-	/* we packet space, now start receiving
-	 * note the lack of basic sanity checks...
-	 */
-
-	/* buffer is payload + header */
-	recv_buffer = malloc(pkt_size + 4);
-
-	recv_bytes = 0;
-	recv_left  = pkt_size + 4;
-	while (recv_left) {
-		int rb;
-		rb = recv(bridge_fd, recv_buffer + recv_bytes, recv_left, 0);
-		recv_bytes += rb;
-		recv_left  -= rb;
-	}
-
-
-	if (0) {
-		int i;
-
-		printf("\nRAW DUMP (%d/%d bytes):\n", recv_bytes, pkt_size);
-
-		for (i=0 ;i < recv_bytes; i++)
-			printf("%02x ", recv_buffer[i]);
-		printf("END DUMP\n\n");
-	}
-
-
-
-	/* the caller supplied their own buffer */
-	memcpy(pkt, gresb_get_spw_data(recv_buffer), recv_bytes);
-	free(recv_buffer);
-
-	return recv_bytes;
-
+	return fee_demux_rx(demux, FEE_DEMUX_DATA, pkt);
 }
 
 
@@ -213,67 +144,7 @@ static uint32_t rmap_rx(uint8_t *pkt)
 #if FEE_SIM
 	return rmap_sim_tx(pkt);
 #else
-	int recv_bytes;
-	int recv_left;
-	static uint32_t pkt_size; /* keep last packet size */
-
-	/* XXX: gresb-to-host header is just 4 bytes, but we need 2 extra in
-	 * order to be able to distinguish between rmap and non-rmap packets
-	 *
-	 *
-	 * NOTE THAT THIS IS A DIRTY HACK FOR THE DEMONSTRATOR ONLY, DO NOT DO
-	 * THIS IN PRODUCTION CODE! EVER!
-	 */
-
-	uint8_t gresb_hdr[4+2];
-
-	uint8_t *recv_buffer;
-
-	if (!pkt) {	/* next packet size requested */
-
-		/* try to grab a header */
-		recv_bytes = recv(bridge_fd, gresb_hdr, 6, MSG_PEEK | MSG_DONTWAIT);
-
-		/* we won't bother, this is a stupid demo, not production code */
-		if (recv_bytes <= 0)
-			return 0;
-
-		/* header is 4 bytes, but we need 6 */
-		if (recv_bytes < (4 + 2))
-			return 0;
-
-		/* XXX the protocol id is (or should be) in byte 6 */
-		if (gresb_hdr[5] == RMAP_PROTOCOL_ID)
-			pkt_size = gresb_get_spw_data_size(gresb_hdr);
-		else
-			pkt_size = 0;
-
-		/* tell caller about next packet */
-		return pkt_size;
-	}
-
-	/* we packet space, now start receiving
-	 * note the lack of basic sanity checks...
-	 */
-
-	/* buffer is payload + header */
-	recv_buffer = malloc(pkt_size + 4);
-
-	recv_bytes = 0;
-	recv_left  = pkt_size + 4;
-	while (recv_left) {
-		int rb;
-		rb = recv(bridge_fd, recv_buffer + recv_bytes, recv_left, 0);
-		recv_bytes += rb;
-		recv_left  -= rb;
-	}
-
-
-	/* the caller supplied their own buffer */
-	memcpy(pkt, gresb_get_spw_data(recv_buffer), recv_bytes);
-	free(recv_buffer);
-
-	return recv_bytes;
+	return fee_demux_rx(demux, FEE_DEMUX_RMAP, pkt);
 #endif
 
 
@@ -624,16 +495,30 @@ static void smile_fee_demo(void)
 
 
 
+/* define to connect to the bridge or simulator via a local packet
+ * socket rather than TCP, e.g. -DBRIDGE_UNIX_PATH=\"/tmp/smile_fee\"
+ */
+
 int main(void)
 {
 	uint8_t dpath[] = DPATH;
 	uint8_t rpath[] = RPATH;
 
 
+#ifndef BRIDGE_UNIX_PATH
 	int flag = 1;
 	struct sockaddr_in server;
+#endif
 
 
+#ifdef BRIDGE_UNIX_PATH
+	/* local packet socket of a bridge or simulator on this host */
+	bridge_fd = gresb_unix_connect(BRIDGE_UNIX_PATH);
+	if (bridge_fd < 0) {
+		perror("connect failed. Error");
+		return 1;
+	}
+#else
 	bridge_fd = socket(AF_INET, SOCK_STREAM, 0);
 
 	setsockopt(bridge_fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(int));
@@ -648,10 +533,17 @@ int main(void)
 		perror("connect failed. Error");
 		return 1;
 	}
+#endif
 
 	/* set non-blocking so we can recv() easily */
 	fcntl(bridge_fd, F_SETFL, fcntl(bridge_fd, F_GETFL, 0) | O_NONBLOCK);
 
+	demux = fee_demux_create(bridge_fd, 0, 0);
+	if (!demux) {
+		printf("Could not create link demultiplexer\n");
+		return 1;
+	}
+
 	/* initialise the libraries */
 	smile_fee_ctrl_init(NULL);
 	smile_fee_rmap_init(GRSPW2_DEFAULT_MTU, rmap_tx, rmap_rx);